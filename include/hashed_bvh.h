@@ -3,6 +3,7 @@
 
 #include <basic_types.h>
 #include <spatial_hash.h>
+#include <stddef.h>
 
 
 #ifdef __cplusplus
@@ -10,6 +11,7 @@ extern "C" {
 #endif
 
 #define GEO_HASHED_BVH_MAX_DEPTH 10
+#define GEO_HASHED_BVH_MAX_DEPTH_64 21
 
 
 struct GeoHashedBvhNode;
@@ -17,16 +19,46 @@ struct GeoHashedBvhNode;
 struct GeoHashedBvh {
 	struct GeoBoundingBox *volumes;
 	void **data;
-	GeoNodeKey *hashes;
+	GeoNodeKey64 *hashes;
 	int capacity;
-	int level_begin[GEO_HASHED_BVH_MAX_DEPTH + 1];
+	int depth;
+	enum GeoKeyOrder order;
+	int level_begin[GEO_HASHED_BVH_MAX_DEPTH_64 + 1];
 	struct GeoBoundingBox bbox;
-	struct GeoHashedBvhNode *root;
+	/* The number of volumes below each node in Morton order, root
+	 * first. The nodes refer to their children by index. */
+	struct GeoHashedBvhNode *nodes;
+	int num_nodes;
+	int nodes_capacity;
+	/* Non-null for bvhs mapped by GeoHBMap. Their arrays point into the
+	 * mapping. */
+	const void *mapping;
+	size_t mapping_size;
 };
 
+/* Initializes a bvh with GEO_HASHED_BVH_MAX_DEPTH levels. */
 GEO_EXPORT void GeoHBInitialize(struct GeoHashedBvh *bvh,
 	struct GeoBoundingBox bbox);
+/* Initializes a bvh with depth levels. depth can be at most
+ * GEO_HASHED_BVH_MAX_DEPTH_64. */
+GEO_EXPORT void GeoHBInitializeWithDepth(struct GeoHashedBvh *bvh,
+	struct GeoBoundingBox bbox, int depth);
+/* Selects the order in which the volumes of each level are stored. Must
+ * be called before the first insertion. */
+GEO_EXPORT void GeoHBSetKeyOrder(struct GeoHashedBvh *bvh,
+	enum GeoKeyOrder order);
 GEO_EXPORT void GeoHBDestroy(struct GeoHashedBvh *bvh);
+/* Writes the bvh to a snapshot file that GeoHBMap can map. Instead of the
+ * data pointers the snapshot stores the index of every volume in
+ * bvh->data, so a mapped bvh passes visitors data[i] == (void *)i and
+ * bvh->data maps those indices back to the data. Returns 0 on success and
+ * -1 on failure. */
+GEO_EXPORT int GeoHBSave(const struct GeoHashedBvh *bvh, const char *path);
+/* Initializes bvh from a snapshot written by GeoHBSave by mapping it
+ * read-only, without copying. The bvh can be queried but not changed.
+ * GeoHBDestroy unmaps it. Returns 0 on success and -1 if the file can't be
+ * mapped or isn't a snapshot of this version. */
+GEO_EXPORT int GeoHBMap(struct GeoHashedBvh *bvh, const char *path);
 GEO_EXPORT void GeoHBInsert(struct GeoHashedBvh *bvh, int n,
 	struct GeoBoundingBox *volumes, void **data);
 typedef int GeoVolumeVisitor(struct GeoBoundingBox *volumes, void **data, int i,
@@ -35,6 +67,15 @@ GEO_EXPORT void GeoHBVisitIntersectingVolumes(struct GeoHashedBvh *bvh,
 	const struct GeoBoundingBox *volume,
 	GeoVolumeVisitor visitor,
 	void *ctx);
+/* Like GeoHBVisitIntersectingVolumes but hands the volumes to the visitor
+ * in blocks: indices holds n indices of intersecting volumes, n at most
+ * 128. Returning 0 from the visitor ends the query. */
+typedef int GeoVolumeBlockVisitor(struct GeoBoundingBox *volumes,
+	void **data, const int *indices, int n, void *ctx);
+GEO_EXPORT void GeoHBVisitIntersectingVolumeBlocks(struct GeoHashedBvh *bvh,
+	const struct GeoBoundingBox *volume,
+	GeoVolumeBlockVisitor visitor,
+	void *ctx);
 
 
 #ifdef __cplusplus
@@ -5,6 +5,7 @@
 #include <spatial_hash.h>
 #include <vertex_array.h>
 #include <geo_export.h>
+#include <stddef.h>
 
 
 #ifdef __cplusplus
@@ -12,31 +13,281 @@ extern "C" {
 #endif
 
 
+/* Default and largest number of key bits resolved by the directory of a
+ * tree, see GeoHOSetDirectoryBits. */
+#define GEO_HO_DEFAULT_DIRECTORY_BITS 15
+#define GEO_HO_MAX_DIRECTORY_BITS 24
+/* Default fraction of removed vertices at which GeoHORemove compacts the
+ * tree, see GeoHOSetMaxRemovedRatio. */
+#define GEO_HO_DEFAULT_MAX_REMOVED_RATIO 0.25
+
+/* GEO_INSERT_MERGE merges every insertion into a single sorted array of
+ * vertices. GEO_INSERT_RUNS keeps the insertions in a few sorted runs of
+ * geometrically decreasing size and only merges runs of similar size, so
+ * that appending many small batches takes O(n log n) instead of O(n^2). */
+enum GeoInsertMode {
+	GEO_INSERT_MERGE,
+	GEO_INSERT_RUNS
+};
+
 struct GeoHashedOctree
 {
 	struct GeoVertexArray vertices;
-	GeoSpatialHash *hashes;
+	GeoSpatialHash64 *hashes;
 	struct GeoBoundingBox bbox;
+	int depth;
+	enum GeoKeyOrder order;
+	/* directory[b] is the index of the first hash whose top
+	 * directory_bits bits are at least b. It has 2^directory_bits + 1
+	 * entries. */
+	uint32_t *directory;
+	int directory_bits;
+	int max_directory_bits;
+	enum GeoInsertMode insert_mode;
+	/* With GEO_INSERT_RUNS the vertices that haven't been merged into
+	 * vertices yet. Each run is more than twice as large as the next. */
+	struct GeoHashedOctree *runs;
+	int num_runs;
+	/* One bit per vertex of vertices that is set for removed vertices.
+	 * Null if no vertex is removed. */
+	uint64_t *removed;
+	int num_removed;
+	double max_removed_ratio;
+	/* Non-null for trees mapped by GeoHOMap. Their arrays point into the
+	 * mapping. */
+	const void *mapping;
+	size_t mapping_size;
+	/* For trees attached to the caller's coordinates by GeoHOAttach the
+	 * caller's index of the vertex of every hash. vertices then refers
+	 * to the caller's arrays in the caller's order and has no ptrs. Null
+	 * for trees that store their vertices. */
+	uint32_t *indices;
+	/* For trees attached by GeoHOAttachFloat the caller's single
+	 * precision coordinates. vertices.x, y and z are then null. */
+	const float *float_x;
+	const float *float_y;
+	const float *float_z;
+	/* Nonzero if insertions grow bbox to contain the new vertices, see
+	 * GeoHOSetGrowBoundingBox. */
+	int grow_bbox;
+	/* Queries stop refining at nodes with at most leaf_capacity
+	 * vertices, see GeoHOSetLeafCapacity. */
+	int leaf_capacity;
 };
 
+/* Initializes a tree with GeoNodeMaxDepth() levels. The hashes of such a
+ * tree are the same as the 32 bit GeoSpatialHash of the vertices. */
 GEO_EXPORT void GeoHOInitialize(struct GeoHashedOctree *tree,
 	struct GeoBoundingBox b);
+/* Initializes a tree with depth levels. depth can be at most
+ * GeoNodeMaxDepth64(). Deeper trees have smaller leaves which is
+ * useful for small epsilon relative to the extent of the bounding box. */
+GEO_EXPORT void GeoHOInitializeWithDepth(struct GeoHashedOctree *tree,
+	struct GeoBoundingBox b, int depth);
+/* Initializes a tree with GeoNodeMaxDepth64() levels whose queries refine
+ * nodes only while they hold more than leaf_capacity vertices, so that
+ * the tree is deep in dense clusters and shallow elsewhere. */
+GEO_EXPORT void GeoHOInitializeAdaptive(struct GeoHashedOctree *tree,
+	struct GeoBoundingBox b, int leaf_capacity);
+/* Selects the order in which the vertices are stored. Trees use Morton
+ * order by default. With Hilbert order the vertices of neighbouring nodes
+ * are more often adjacent in memory. Must be called before the first
+ * insertion. */
+GEO_EXPORT void GeoHOSetKeyOrder(struct GeoHashedOctree *tree,
+	enum GeoKeyOrder order);
+/* Limits the size of the directory that maps the top bits of the hashes
+ * to offsets into the hashes array. Lookups of a node's vertices read the
+ * directory and then search only the vertices sharing the node's top
+ * bits. The directory resolves at most bits bits, at most 3 * depth and
+ * not many more than the number of vertices, so it takes at most
+ * 4 * (2^bits + 1) bytes. bits is clamped to
+ * [0, GEO_HO_MAX_DIRECTORY_BITS]; 0 turns lookups into binary searches
+ * over all vertices. The default is GEO_HO_DEFAULT_DIRECTORY_BITS. */
+GEO_EXPORT void GeoHOSetDirectoryBits(struct GeoHashedOctree *tree,
+	int bits);
+/* With grow nonzero insertions double the bounding box of the tree until
+ * it contains the new vertices, instead of hashing the vertices outside
+ * of it into the boundary nodes. The box of the tree becomes one octant
+ * of the doubled box, so the hashes of the stored vertices are updated
+ * with shifts. Attached trees grow their box before hashing. Off by
+ * default. */
+GEO_EXPORT void GeoHOSetGrowBoundingBox(struct GeoHashedOctree *tree,
+	int grow);
+/* Queries collect the nodes overlapping the query box. By default they
+ * refine nodes down to about the size of the query box or the leaves of
+ * the tree. With a leaf capacity they refine exactly the nodes that hold
+ * more than capacity vertices, are larger than the query box and aren't
+ * inside of it. So with a deep tree the vertices scanned per node stay
+ * small in dense clusters while empty and sparse regions end in a few
+ * large nodes. 0 restores the default. Only affects queries and can be
+ * changed at any time. */
+GEO_EXPORT void GeoHOSetLeafCapacity(struct GeoHashedOctree *tree,
+	int capacity);
+/* Selects how insertions are stored, see enum GeoInsertMode. Switching
+ * to GEO_INSERT_MERGE compacts the tree. */
+GEO_EXPORT void GeoHOSetInsertMode(struct GeoHashedOctree *tree,
+	enum GeoInsertMode mode);
+/* Merges all runs into tree->vertices and drops removed vertices. */
+GEO_EXPORT void GeoHOCompact(struct GeoHashedOctree *tree);
+/* The number of vertices in tree->vertices and in the runs that haven't
+ * been removed. */
+GEO_EXPORT int GeoHONumVertices(const struct GeoHashedOctree *tree);
+/* The number of vertices in tree->vertices and in the runs including the
+ * removed ones that haven't been dropped yet. */
+GEO_EXPORT int GeoHONumStoredVertices(const struct GeoHashedOctree *tree);
+/* Removes the vertices with the given indices, numbered as for
+ * GeoHOLocateVertex. Removed vertices are only marked, queries skip them.
+ * Once the marked vertices make up more than the tree's maximum removed
+ * ratio of all vertices the arrays are compacted, which renumbers the
+ * vertices; so does inserting into an array with removed vertices. */
+GEO_EXPORT void GeoHORemove(struct GeoHashedOctree *tree,
+	const int *indices, int n);
+/* Removes the vertices for which predicate returns nonzero. */
+typedef int GeoVertexPredicate(struct GeoVertexArray *va, int i, void *ctx);
+GEO_EXPORT void GeoHORemoveIf(struct GeoHashedOctree *tree,
+	GeoVertexPredicate predicate, void *ctx);
+/* Sets the fraction of removed vertices at which GeoHORemove compacts. The
+ * default is GEO_HO_DEFAULT_MAX_REMOVED_RATIO. */
+GEO_EXPORT void GeoHOSetMaxRemovedRatio(struct GeoHashedOctree *tree,
+	double ratio);
+/* Vertex indices returned by GeoHOFindKNearest count through
+ * tree->vertices and then through the runs in order. Returns the vertex
+ * array holding vertex *i and replaces *i by its index in that array. */
+GEO_EXPORT struct GeoVertexArray *GeoHOLocateVertex(
+	struct GeoHashedOctree *tree, int *i);
 GEO_EXPORT void GeoHODestroy(struct GeoHashedOctree *tree);
 
+/* Writes the tree to a snapshot file that GeoHOMap can map. The tree is
+ * compacted first. Instead of the ptrs the snapshot stores the index of
+ * every vertex in tree->vertices, so a mapped tree passes visitors ptrs[i]
+ * == (void *)i; tree->vertices.ptrs after saving maps those indices back
+ * to the ptrs. Returns 0 on success and -1 on failure. */
+GEO_EXPORT int GeoHOSave(struct GeoHashedOctree *tree, const char *path);
+/* Initializes tree from a snapshot written by GeoHOSave by mapping it
+ * read-only, without copying. The tree can be queried but not changed.
+ * GeoHODestroy unmaps it. Returns 0 on success and -1 if the file can't be
+ * mapped or isn't a snapshot of this version. */
+GEO_EXPORT int GeoHOMap(struct GeoHashedOctree *tree, const char *path);
+
 GEO_EXPORT void GeoHOInsert(struct GeoHashedOctree *tree,
 	const struct GeoVertexArray *va);
+/* GeoHOInsert that also reports where every vertex went, so that arrays
+ * of attributes kept in the order of the tree can follow, see
+ * GeoHOApplyPermutation. The vertices are numbered as for
+ * GeoHOLocateVertex, the GeoHONumStoredVertices(tree) vertices stored
+ * before the insertion followed by those of va. permutation[i] is the new
+ * index of vertex i, or -1 for removed vertices that were dropped. */
+GEO_EXPORT void GeoHOInsertWithPermutation(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va, int *permutation);
+/* Copies element i of src to element permutation[i] of dst for the n
+ * entries of permutation that aren't -1. Elements are element_size bytes
+ * and start every src_stride and dst_stride bytes. src and dst must not
+ * overlap. Large arrays are copied in parallel. */
+GEO_EXPORT void GeoHOApplyPermutation(const int *permutation, int n,
+	const void *src, size_t src_stride, void *dst, size_t dst_stride,
+	size_t element_size);
+
+/* Builds the tree over the n vertices whose coordinates the caller keeps
+ * in x, y and z, without copying them. The tree only stores the sorted
+ * hashes and the permutation into the caller's arrays, which must outlive
+ * it. Queries pass visitors a vertex array over the caller's arrays with
+ * null ptrs and the caller's index of the vertex, and GeoHOFindKNearest
+ * returns the caller's indices. Attached trees can't be inserted into,
+ * removed from, deduplicated or saved. Must be called on an empty or
+ * attached tree. */
+GEO_EXPORT void GeoHOAttach(struct GeoHashedOctree *tree,
+	const double *x, const double *y, const double *z, int n);
+/* Like GeoHOAttach over single precision coordinates. The tree takes 12
+ * bytes per vertex on top of the caller's 12, against 40 for a tree that
+ * stores its vertices. Queries compare the coordinates exactly as
+ * converted to double. The vertex array passed to visitors has null
+ * coordinates; visitors read the caller's arrays at the index they get. */
+GEO_EXPORT void GeoHOAttachFloat(struct GeoHashedOctree *tree,
+	const float *x, const float *y, const float *z, int n);
+/* Rehashes the vertices of an attached tree after the caller has moved
+ * them in place and sorts them again. */
+GEO_EXPORT void GeoHOUpdate(struct GeoHashedOctree *tree);
 
+/* Query visitors get the vertex array holding the vertex, which is one of
+ * the runs of the tree with GEO_INSERT_RUNS, and its index in that
+ * array. */
 typedef int GeoVertexVisitor(struct GeoVertexArray *va, int i, void *ctx);
 GEO_EXPORT void GeoHOVisitNearVertices(struct GeoHashedOctree *tree,
 	const struct GeoPoint *p, double eps,
 	GeoVertexVisitor visitor, void *ctx);
+/* Visits the vertices within Euclidean distance radius of p.
+ * GeoHOVisitNearVertices visits the ones within eps in each coordinate. */
+GEO_EXPORT void GeoHOVisitVerticesInBall(struct GeoHashedOctree *tree,
+	const struct GeoPoint *p, double radius,
+	GeoVertexVisitor visitor, void *ctx);
+/* Visits the vertices inside box, including the ones on its faces. The box
+ * is split into ranges of keys; vertices in ranges well inside the box are
+ * visited without comparing their coordinates. */
+GEO_EXPORT void GeoHOVisitVerticesInBox(struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box,
+	GeoVertexVisitor visitor, void *ctx);
+/* Variants of the queries above that hand the hits to the visitor in
+ * blocks: indices holds n indices into va, all of them hits, and n is at
+ * most 128. Dense queries make one call per block rather than one per
+ * hit. Returning 0 from the visitor ends the query. */
+typedef int GeoVertexBlockVisitor(struct GeoVertexArray *va,
+	const int *indices, int n, void *ctx);
+GEO_EXPORT void GeoHOVisitNearVertexBlocks(struct GeoHashedOctree *tree,
+	const struct GeoPoint *p, double eps,
+	GeoVertexBlockVisitor visitor, void *ctx);
+GEO_EXPORT void GeoHOVisitVertexBlocksInBall(struct GeoHashedOctree *tree,
+	const struct GeoPoint *p, double radius,
+	GeoVertexBlockVisitor visitor, void *ctx);
+GEO_EXPORT void GeoHOVisitVertexBlocksInBox(struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box,
+	GeoVertexBlockVisitor visitor, void *ctx);
+/* Visits the vertices near each of the n points like n calls to
+ * GeoHOVisitNearVertices. query is the index of the point. The queries are
+ * answered in spatial order rather than in the order of points; returning
+ * 0 from the visitor ends the current query only. */
+typedef int GeoBatchVertexVisitor(struct GeoVertexArray *va, int query,
+	int i, void *ctx);
+GEO_EXPORT void GeoHOVisitNearVerticesBatch(struct GeoHashedOctree *tree,
+	const struct GeoPoint *points, int n, double eps,
+	GeoBatchVertexVisitor visitor, void *ctx);
 
+/* Finds the k vertices nearest to p in Euclidean distance. Their indices
+ * and squared distances are written to indices and dist2 in ascending
+ * order of distance, ties ordered by index. Returns the number of
+ * vertices found which is less than k only if the tree has fewer
+ * vertices. */
+GEO_EXPORT int GeoHOFindKNearest(struct GeoHashedOctree *tree,
+	const struct GeoPoint *p, int k, int *indices, double *dist2);
+/* GeoHOFindKNearest for n points. The results for points[q] are written
+ * to indices[q * k] and dist2[q * k] onwards. */
+GEO_EXPORT int GeoHOFindKNearestBatch(struct GeoHashedOctree *tree,
+	const struct GeoPoint *points, int n, int k,
+	int *indices, double *dist2);
 
 /* The following are higher order utility functions. They don't require
  * internals of GeoHashesOctree. */
 typedef void GeoVertexDestructor(void *ptr, void *ctx);
 GEO_EXPORT void GeoHODeleteDuplicates(struct GeoHashedOctree *tree, double eps,
 	GeoVertexDestructor dtor, void *ctx);
+/* Both modes delete every vertex that has a vertex with a lower index
+ * within eps. GEO_DEDUP_TREE runs a tree query per vertex. GEO_DEDUP_GRID
+ * doesn't use the tree. It bins the vertices into cells of size 2 eps in a
+ * hash table and only compares against the vertices in the 8 cells the
+ * eps box around a vertex can overlap, which takes expected linear time.
+ * Both compact the tree first. */
+enum GeoDedupMode {
+	GEO_DEDUP_TREE,
+	GEO_DEDUP_GRID
+};
+GEO_EXPORT void GeoHODeleteDuplicatesWithMode(struct GeoHashedOctree *tree,
+	double eps, enum GeoDedupMode mode,
+	GeoVertexDestructor dtor, void *ctx);
+/* GeoHODeleteDuplicatesWithMode that writes the new index of each of the
+ * GeoHONumStoredVertices(tree) vertices to permutation, -1 for deleted
+ * and removed ones, like GeoHOInsertWithPermutation. */
+GEO_EXPORT void GeoHODeleteDuplicatesWithPermutation(
+	struct GeoHashedOctree *tree, double eps, enum GeoDedupMode mode,
+	GeoVertexDestructor dtor, void *ctx, int *permutation);
 
 #ifdef __cplusplus
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <basic_types.h>
+#include <vertex_array.h>
 #include <geo_export.h>
 
 
@@ -10,9 +11,28 @@
 extern "C" {
 #endif
 
+/* Implementations of the bit interleaving behind the scalar hash and node
+ * key functions. All of them produce the same keys. When the library is
+ * loaded the fastest codec supported by the CPU is selected. */
+enum GeoMortonCodec {
+	GEO_MORTON_CODEC_SHIFT,
+	GEO_MORTON_CODEC_TABLE,
+	GEO_MORTON_CODEC_BMI2
+};
+GEO_EXPORT int GeoMortonCodecSupported(enum GeoMortonCodec codec);
+/* Returns 0 and leaves the active codec unchanged if codec is not
+ * supported. */
+GEO_EXPORT int GeoSetMortonCodec(enum GeoMortonCodec codec);
+GEO_EXPORT enum GeoMortonCodec GeoGetMortonCodec();
+
 typedef uint32_t GeoSpatialHash;
 GEO_EXPORT GeoSpatialHash GeoComputeHash(const struct GeoBoundingBox* b,
 	const struct GeoPoint* p);
+/* Computes the hashes of all vertices in va. The result is the same as
+ * calling GeoComputeHash for each vertex. hashes must have room for
+ * va->size elements. */
+GEO_EXPORT void GeoComputeHashes(const struct GeoBoundingBox* b,
+	const struct GeoVertexArray *va, GeoSpatialHash *hashes);
 
 typedef uint32_t GeoNodeKey;
 GEO_EXPORT GeoNodeKey GeoNodeRoot();
@@ -20,16 +40,164 @@ GEO_EXPORT int GeoNodeMaxDepth();
 GEO_EXPORT void GeoNodeComputeChildKeys(GeoNodeKey key, GeoNodeKey *child_keys);
 GEO_EXPORT void GeoComputeChildBoxes(
 	const struct GeoBoundingBox *bbox, struct GeoBoundingBox *child_boxes);
-GEO_EXPORT int GeoNodeValidKey(GeoNodeKey key);
-GEO_EXPORT int GeoNodeLevel(GeoNodeKey key);
-GEO_EXPORT GeoNodeKey GeoNodeParent(GeoNodeKey key);
-GEO_EXPORT GeoSpatialHash GeoNodeBegin(GeoNodeKey key);
-GEO_EXPORT GeoSpatialHash GeoNodeEnd(GeoNodeKey key);
 GEO_EXPORT void GeoNodePrint(GeoNodeKey key);
 GEO_EXPORT struct GeoBoundingBox GeoNodeBox(GeoNodeKey key,
 	const struct GeoBoundingBox *bbox);
-GEO_EXPORT GeoNodeKey GeoNodeSmallestContaining(const struct GeoBoundingBox* root_box,
-	const struct GeoBoundingBox *b);
+/* Computes the keys of the 26 nodes at the same level that share a face,
+ * edge or corner with key, without decoding it. The neighbors are written
+ * with the x offset varying fastest, then y, then z, skipping the node
+ * itself. Neighbors outside of the root box are set to 0 which is not a
+ * valid key. Returns the number of valid neighbors. */
+GEO_EXPORT int GeoNodeComputeNeighborKeys(GeoNodeKey key,
+	GeoNodeKey *neighbor_keys);
+
+/* The node key helpers below sit in the inner loops of the tree traversals
+ * so they are defined inline. A node key is a Morton code prefix with a
+ * marker bit at position 3 * level in front of it; the level follows from
+ * the position of the most significant bit. */
+#define GEO_NODE_MAX_DEPTH 10
+
+static inline int GeoNodeLevel(GeoNodeKey key)
+{
+	return (31 - __builtin_clz(key | 1u)) / 3;
+}
+
+static inline int GeoNodeValidKey(GeoNodeKey key)
+{
+	int msb = 31 - __builtin_clz(key | 1u);
+	return (key != 0) & (msb % 3 == 0);
+}
+
+static inline GeoNodeKey GeoNodeParent(GeoNodeKey key)
+{
+	return key >> 3;
+}
+
+static inline GeoSpatialHash GeoNodeBegin(GeoNodeKey key)
+{
+	int level = GeoNodeLevel(key);
+	GeoSpatialHash begin = key ^ (1u << (3 * level));
+	return begin << (3 * (GEO_NODE_MAX_DEPTH - level));
+}
+
+static inline GeoSpatialHash GeoNodeEnd(GeoNodeKey key)
+{
+	int level = GeoNodeLevel(key);
+	GeoSpatialHash end = (key ^ (1u << (3 * level))) + 1;
+	return end << (3 * (GEO_NODE_MAX_DEPTH - level));
+}
+
+/* The common prefix of the hashes of the two corners of b. The number of
+ * triples to drop is the bit length of their difference rounded up to a
+ * multiple of 3. */
+static inline GeoNodeKey GeoNodeSmallestContaining(
+	const struct GeoBoundingBox* root_box, const struct GeoBoundingBox *b)
+{
+	GeoSpatialHash min = GeoComputeHash(root_box, &b->min);
+	GeoSpatialHash max = GeoComputeHash(root_box, &b->max);
+	int bits = 31 - __builtin_clz(((min ^ max) << 1) | 1u);
+	int drop = (bits + 2) / 3;
+	return (min >> (3 * drop)) | (1u << (3 * (GEO_NODE_MAX_DEPTH - drop)));
+}
+
+/* 64 bit variants of the keys above. These have 21 bits per dimension
+ * instead of 10 so the finest nodes are 2**11 times smaller along each
+ * axis. */
+typedef uint64_t GeoSpatialHash64;
+GEO_EXPORT GeoSpatialHash64 GeoComputeHash64(const struct GeoBoundingBox* b,
+	const struct GeoPoint* p);
+GEO_EXPORT void GeoComputeHashes64(const struct GeoBoundingBox* b,
+	const struct GeoVertexArray *va, GeoSpatialHash64 *hashes);
+
+typedef uint64_t GeoNodeKey64;
+GEO_EXPORT GeoNodeKey64 GeoNodeRoot64();
+GEO_EXPORT int GeoNodeMaxDepth64();
+GEO_EXPORT void GeoNodeComputeChildKeys64(GeoNodeKey64 key,
+	GeoNodeKey64 *child_keys);
+GEO_EXPORT void GeoNodePrint64(GeoNodeKey64 key);
+GEO_EXPORT struct GeoBoundingBox GeoNodeBox64(GeoNodeKey64 key,
+	const struct GeoBoundingBox *bbox);
+GEO_EXPORT int GeoNodeComputeNeighborKeys64(GeoNodeKey64 key,
+	GeoNodeKey64 *neighbor_keys);
+/* Conversion between node keys and the integer coordinates of the node
+ * among the 2**level nodes along each axis at its level. */
+GEO_EXPORT GeoNodeKey64 GeoNodeFromCoordinates64(int level,
+	uint32_t a, uint32_t b, uint32_t c);
+GEO_EXPORT void GeoNodeCoordinates64(GeoNodeKey64 key,
+	uint32_t *a, uint32_t *b, uint32_t *c);
+
+#define GEO_NODE_MAX_DEPTH_64 21
+
+static inline int GeoNodeLevel64(GeoNodeKey64 key)
+{
+	return (63 - __builtin_clzll(key | 1ull)) / 3;
+}
+
+static inline int GeoNodeValidKey64(GeoNodeKey64 key)
+{
+	int msb = 63 - __builtin_clzll(key | 1ull);
+	return (key != 0) & (msb % 3 == 0);
+}
+
+static inline GeoNodeKey64 GeoNodeParent64(GeoNodeKey64 key)
+{
+	return key >> 3;
+}
+
+static inline GeoSpatialHash64 GeoNodeBegin64(GeoNodeKey64 key)
+{
+	int level = GeoNodeLevel64(key);
+	GeoSpatialHash64 begin = key ^ (1ull << (3 * level));
+	return begin << (3 * (GEO_NODE_MAX_DEPTH_64 - level));
+}
+
+static inline GeoSpatialHash64 GeoNodeEnd64(GeoNodeKey64 key)
+{
+	int level = GeoNodeLevel64(key);
+	GeoSpatialHash64 end = (key ^ (1ull << (3 * level))) + 1;
+	return end << (3 * (GEO_NODE_MAX_DEPTH_64 - level));
+}
+
+static inline GeoNodeKey64 GeoNodeSmallestContaining64(
+	const struct GeoBoundingBox* root_box, const struct GeoBoundingBox *b)
+{
+	GeoSpatialHash64 min = GeoComputeHash64(root_box, &b->min);
+	GeoSpatialHash64 max = GeoComputeHash64(root_box, &b->max);
+	int bits = 63 - __builtin_clzll(((min ^ max) << 1) | 1ull);
+	int drop = (bits + 2) / 3;
+	return (min >> (3 * drop)) |
+		(1ull << (3 * (GEO_NODE_MAX_DEPTH_64 - drop)));
+}
+
+/* Hilbert order. The node keys above always address octants in Morton
+ * order. GeoNodeMortonToHilbert64 maps such a key to the key of the same
+ * octant in Hilbert order so that GeoNodeBegin64 and GeoNodeEnd64 of the
+ * converted key give the range of Hilbert hashes inside the octant. */
+enum GeoKeyOrder {
+	GEO_KEY_ORDER_MORTON,
+	GEO_KEY_ORDER_HILBERT
+};
+GEO_EXPORT GeoSpatialHash64 GeoComputeHilbertHash64(
+	const struct GeoBoundingBox* b, const struct GeoPoint* p);
+GEO_EXPORT void GeoComputeHilbertHashes64(const struct GeoBoundingBox* b,
+	const struct GeoVertexArray *va, GeoSpatialHash64 *hashes);
+GEO_EXPORT GeoNodeKey64 GeoNodeMortonToHilbert64(GeoNodeKey64 key);
+GEO_EXPORT GeoNodeKey64 GeoNodeHilbertToMorton64(GeoNodeKey64 key);
+
+/* Top down Hilbert keys. The state of a node fixes the order in which the
+ * curve visits its octants: the child with Morton digit i of a node in
+ * state s has Hilbert digit GeoHilbertDigits[s][i] and state
+ * GeoHilbertChildStates[s][i]. The root is in state 0. Traversals keep the
+ * Hilbert key and the state of the current node so that every child costs
+ * one table lookup instead of a call to GeoNodeMortonToHilbert64.
+ * GeoNodeMortonToHilbertState64 converts a node like
+ * GeoNodeMortonToHilbert64 and also returns the state of the node. */
+#define GEO_HILBERT_NUM_STATES 24
+GEO_EXPORT extern const uint8_t GeoHilbertDigits[GEO_HILBERT_NUM_STATES][8];
+GEO_EXPORT extern const uint8_t
+	GeoHilbertChildStates[GEO_HILBERT_NUM_STATES][8];
+GEO_EXPORT GeoNodeKey64 GeoNodeMortonToHilbertState64(GeoNodeKey64 key,
+	int *state);
 
 #ifdef __cplusplus
 }
@@ -15,6 +15,16 @@ GEO_EXPORT void GeoApplyTransform(double T[3][4],
 	const struct GeoVertexArray *a, struct GeoVertexArray *b);
 GEO_EXPORT void GeoApplyTransformInplace(double T[3][4],
 	struct GeoVertexArray *a);
+/* Transform single precision coordinates held in the caller's arrays,
+ * such as those of a tree attached by GeoHOAttachFloat. The arrays need
+ * not be aligned. Each coordinate is computed in double precision and
+ * rounded once. tx, ty and tz may be the same arrays as x, y and z,
+ * which is what the in-place variant does. */
+GEO_EXPORT void GeoApplyTransformFloat(double T[3][4],
+	const float *x, const float *y, const float *z,
+	float *tx, float *ty, float *tz, int n);
+GEO_EXPORT void GeoApplyTransformFloatInplace(double T[3][4],
+	float *x, float *y, float *z, int n);
 
 #ifdef __cplusplus
 }
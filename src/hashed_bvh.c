@@ -4,40 +4,28 @@
 #include <stdlib.h>
 #include <qsort.h>
 #include <spatial_hash.h>
+#include <snapshot.h>
 
 
+// Child indices are -1 for absent children.
 struct GeoHashedBvhNode {
-	int size;
-	struct GeoHashedBvhNode *child[8];
+	int32_t size;
+	int32_t child[8];
 };
 
 
-static void GeoHBNInitialize(struct GeoHashedBvhNode *node)
+static int new_node(struct GeoHashedBvh *bvh)
 {
-	memset(node, 0, sizeof(*node));
-}
-
-static void GeoHBNDestroy(struct GeoHashedBvhNode *node)
-{
-	if (0 == node) return;
-	for (int i = 0; i < 8; ++i) {
-		struct GeoHashedBvhNode *child = node->child[i];
-		GeoHBNDestroy(child);
-		free(child);
+	if (bvh->num_nodes == bvh->nodes_capacity) {
+		bvh->nodes_capacity = bvh->nodes_capacity ?
+			2 * bvh->nodes_capacity : 64;
+		bvh->nodes = realloc(bvh->nodes,
+			bvh->nodes_capacity * sizeof(*bvh->nodes));
 	}
-}
-
-static struct GeoHashedBvhNode *GeoHBNNew()
-{
-	struct GeoHashedBvhNode *node = malloc(sizeof(*node));
-	GeoHBNInitialize(node);
-	return node;
-}
-
-static void GeoHBNDelete(struct GeoHashedBvhNode *node)
-{
-	GeoHBNDestroy(node);
-	free(node);
+	struct GeoHashedBvhNode *node = &bvh->nodes[bvh->num_nodes];
+	node->size = 0;
+	for (int i = 0; i < 8; ++i) node->child[i] = -1;
+	return bvh->num_nodes++;
 }
 
 static void reserve_space(struct GeoHashedBvh *bvh, int capacity)
@@ -55,50 +43,182 @@ static void reserve_space(struct GeoHashedBvh *bvh, int capacity)
 
 void GeoHBInitialize(struct GeoHashedBvh *bvh, struct GeoBoundingBox bbox)
 {
+	GeoHBInitializeWithDepth(bvh, bbox, GEO_HASHED_BVH_MAX_DEPTH);
+}
+
+void GeoHBInitializeWithDepth(struct GeoHashedBvh *bvh,
+	struct GeoBoundingBox bbox, int depth)
+{
+	assert(depth > 0 && depth <= GEO_HASHED_BVH_MAX_DEPTH_64);
 	memset(bvh, 0, sizeof(*bvh));
 	static const int initial_capacity = 32;
 	reserve_space(bvh, initial_capacity);
 	bvh->bbox = bbox;
+	bvh->depth = depth;
+	bvh->order = GEO_KEY_ORDER_MORTON;
+}
+
+void GeoHBSetKeyOrder(struct GeoHashedBvh *bvh, enum GeoKeyOrder order)
+{
+	assert(!bvh->mapping);
+	assert(bvh->level_begin[bvh->depth] == 0);
+	bvh->order = order;
 }
 
 void GeoHBDestroy(struct GeoHashedBvh *bvh)
 {
-	GeoHBNDelete(bvh->root);
+	if (bvh->mapping) {
+		GeoSnapshotUnmap(bvh->mapping, bvh->mapping_size);
+		return;
+	}
+	free(bvh->nodes);
 	free(bvh->volumes);
 	free(bvh->data);
 	free(bvh->hashes);
 }
 
-static uint64_t BigHash(uint32_t hash, uint32_t tag)
-{
-	// Store the hash in the higher order bits so we sort by that.
-	return ((uint64_t)hash << 32) | (uint64_t)tag;
+// Snapshot sections of a bvh.
+#define BVH_MAGIC "GEOHB"
+enum {
+	BVH_HASHES,
+	BVH_VOLUMES,
+	BVH_DATA,
+	BVH_NODES,
+	BVH_NUM_SECTIONS
 };
 
-static uint32_t GetHash(uint64_t big_hash)
+struct BvhSnapshot {
+	struct GeoSnapshotHeader header;
+	struct GeoBoundingBox bbox;
+	int32_t depth;
+	int32_t order;
+	int32_t num_nodes;
+	int32_t level_begin[GEO_HASHED_BVH_MAX_DEPTH_64 + 1];
+};
+
+int GeoHBSave(const struct GeoHashedBvh *bvh, const char *path)
 {
-	return (uint32_t)(0x00000000FFFFFFFFull & (big_hash >> 32));
+	struct BvhSnapshot snapshot;
+	uint64_t n = bvh->level_begin[bvh->depth];
+	void **positions = GeoSnapshotPositions(n);
+	const void *sections[BVH_NUM_SECTIONS] = {
+		bvh->hashes, bvh->volumes, positions, bvh->nodes};
+	uint64_t sizes[BVH_NUM_SECTIONS] = {
+		n * sizeof(*bvh->hashes), n * sizeof(*bvh->volumes),
+		n * sizeof(*bvh->data),
+		(uint64_t)bvh->num_nodes * sizeof(*bvh->nodes)};
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.bbox = bvh->bbox;
+	snapshot.depth = bvh->depth;
+	snapshot.order = bvh->order;
+	snapshot.num_nodes = bvh->num_nodes;
+	for (int i = 0; i <= bvh->depth; ++i) {
+		snapshot.level_begin[i] = bvh->level_begin[i];
+	}
+	int status = GeoSnapshotWrite(path, BVH_MAGIC, &snapshot,
+		sizeof(snapshot), sections, sizes, BVH_NUM_SECTIONS);
+	free(positions);
+	return status;
 }
 
-static uint32_t GetTag(uint64_t big_hash)
+static int level_begin_is_valid(const struct BvhSnapshot *snapshot)
 {
-	return (uint32_t)(0x00000000FFFFFFFFull & big_hash);
+	if (snapshot->level_begin[0] != 0) return 0;
+	for (int i = 0; i < snapshot->depth; ++i) {
+		if (snapshot->level_begin[i] > snapshot->level_begin[i + 1]) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
+// Queries follow the child indices of the nodes, so these must be -1 or
+// the index of a node.
+static int nodes_are_valid(const struct GeoHashedBvhNode *nodes,
+	int num_nodes)
+{
+	for (int k = 0; k < num_nodes; ++k) {
+		for (int i = 0; i < 8; ++i) {
+			int32_t child = nodes[k].child[i];
+			if (child < -1 || child >= num_nodes) return 0;
+		}
+	}
+	return 1;
+}
 
-static void ComputeHashes(const struct GeoBoundingBox *b,
+int GeoHBMap(struct GeoHashedBvh *bvh, const char *path)
+{
+	size_t size;
+	const struct BvhSnapshot *snapshot = GeoSnapshotMap(path, BVH_MAGIC,
+		sizeof(*snapshot), &size);
+	if (!snapshot) return -1;
+	const struct GeoSnapshotHeader *h = &snapshot->header;
+	int depth = snapshot->depth;
+	if (depth <= 0 || depth > GEO_HASHED_BVH_MAX_DEPTH_64 ||
+	    (snapshot->order != GEO_KEY_ORDER_MORTON &&
+	     snapshot->order != GEO_KEY_ORDER_HILBERT) ||
+	    snapshot->num_nodes < 0 || !level_begin_is_valid(snapshot)) {
+		GeoSnapshotUnmap(snapshot, size);
+		return -1;
+	}
+	uint64_t n = snapshot->level_begin[depth];
+	if (h->sizes[BVH_HASHES] != n * sizeof(*bvh->hashes) ||
+	    h->sizes[BVH_VOLUMES] != n * sizeof(*bvh->volumes) ||
+	    h->sizes[BVH_DATA] != n * sizeof(*bvh->data) ||
+	    h->sizes[BVH_NODES] !=
+	    (uint64_t)snapshot->num_nodes * sizeof(*bvh->nodes)) {
+		GeoSnapshotUnmap(snapshot, size);
+		return -1;
+	}
+	const char *base = (const char *)snapshot;
+	if (!nodes_are_valid(
+		(const struct GeoHashedBvhNode *)(base + h->offsets[BVH_NODES]),
+		snapshot->num_nodes)) {
+		GeoSnapshotUnmap(snapshot, size);
+		return -1;
+	}
+	memset(bvh, 0, sizeof(*bvh));
+	bvh->volumes = (struct GeoBoundingBox *)(base + h->offsets[BVH_VOLUMES]);
+	bvh->data = (void **)(base + h->offsets[BVH_DATA]);
+	bvh->hashes = (GeoNodeKey64 *)(base + h->offsets[BVH_HASHES]);
+	bvh->capacity = n;
+	bvh->depth = depth;
+	bvh->order = snapshot->order;
+	for (int i = 0; i <= depth; ++i) {
+		bvh->level_begin[i] = snapshot->level_begin[i];
+	}
+	bvh->bbox = snapshot->bbox;
+	bvh->nodes = (struct GeoHashedBvhNode *)(base + h->offsets[BVH_NODES]);
+	bvh->num_nodes = snapshot->num_nodes;
+	bvh->nodes_capacity = snapshot->num_nodes;
+	bvh->mapping = snapshot;
+	bvh->mapping_size = size;
+	return 0;
+}
+
+static void ComputeHashes(const struct GeoBoundingBox *b, int depth,
+	enum GeoKeyOrder order,
 	const struct GeoBoundingBox *boxes,
 	int n,
-	uint64_t *hashes)
+	GeoNodeKey64 *hashes, uint32_t *tags)
 {
 	for (int i = 0; i < n; ++i) {
-		GeoNodeKey hash = GeoNodeSmallestContaining(b, &boxes[i]);
-		hashes[i] = BigHash(hash, i);
+		GeoNodeKey64 hash = GeoNodeSmallestContaining64(b, &boxes[i]);
+		// Volumes are stored in the nodes of levels 0 through
+		// depth - 1. Smaller volumes go into their ancestor at
+		// level depth - 1.
+		int level = GeoNodeLevel64(hash);
+		if (level >= depth) hash >>= 3 * (level - depth + 1);
+		if (order == GEO_KEY_ORDER_HILBERT) {
+			hash = GeoNodeMortonToHilbert64(hash);
+		}
+		hashes[i] = hash;
+		tags[i] = i;
 	}
 }
 
 #ifndef NDEBUG
-static int hashes_are_sorted(GeoNodeKey *h, int n)
+static int hashes_are_sorted(GeoNodeKey64 *h, int n)
 {
 	for (int i = 0; i < n - 1; ++i) {
 		if (h[i] > h[i + 1]) return 0;
@@ -111,16 +231,17 @@ static void merge(
 	struct GeoHashedBvh *merged_bvh,
 	struct GeoHashedBvh *bvh,
 	int n,
-	const uint64_t *hashes,
+	const GeoNodeKey64 *hashes,
+	const uint32_t *tags,
 	struct GeoBoundingBox *volumes,
 	void **data)
 {
-	int n1 = bvh->level_begin[GEO_HASHED_BVH_MAX_DEPTH];
+	int n1 = bvh->level_begin[bvh->depth];
 	int n2 = n;
 
-	const GeoNodeKey *hashes1 = bvh->hashes;
-	const uint64_t *hashes2 = hashes;
-	GeoNodeKey *hashes_merged = merged_bvh->hashes;
+	const GeoNodeKey64 *hashes1 = bvh->hashes;
+	const GeoNodeKey64 *hashes2 = hashes;
+	GeoNodeKey64 *hashes_merged = merged_bvh->hashes;
 
 	struct GeoBoundingBox *volumes1 = bvh->volumes;
 	struct GeoBoundingBox *volumes2 = volumes;
@@ -135,14 +256,14 @@ static void merge(
 	int k = 0;
 
 	while (i < n1 && j < n2) {
-		if (hashes1[i] < GetHash(hashes2[j])) {
+		if (hashes1[i] < hashes2[j]) {
 			hashes_merged[k] = hashes1[i];
 			volumes_merged[k] = volumes1[i];
 			data_merged[k] = data1[i];
 			++i;
 		} else {
-			hashes_merged[k] = GetHash(hashes2[j]);
-			uint32_t m = GetTag(hashes2[j]);
+			hashes_merged[k] = hashes2[j];
+			uint32_t m = tags[j];
 			volumes_merged[k] = volumes2[m];
 			data_merged[k] = data2[m];
 			++j;
@@ -159,8 +280,8 @@ static void merge(
 	}
 
 	while (j < n2) {
-		hashes_merged[k] = GetHash(hashes2[j]);
-		uint32_t m = GetTag(hashes2[j]);
+		hashes_merged[k] = hashes2[j];
+		uint32_t m = tags[j];
 		volumes_merged[k] = volumes2[m];
 		data_merged[k] = data2[m];
 		++j;
@@ -170,34 +291,34 @@ static void merge(
 	assert(hashes_are_sorted(hashes_merged, n1 + n2));
 }
 
-static void reset_sizes(struct GeoHashedBvhNode *node)
+static void add_entity(struct GeoHashedBvh *bvh, GeoNodeKey64 hash)
 {
-	node->size = 0;
-	for (int i = 0; i < 8; ++i) {
-		struct GeoHashedBvhNode *child = node->child[i];
-		if (child) reset_sizes(child);
-	}
-}
-
-static void add_entity(struct GeoHashedBvhNode **node, int level,
-	GeoNodeKey hash)
-{
-	if (0 == *node) *node = GeoHBNNew();
-	++(*node)->size;
-	if (level > 0) {
-		int i = (hash >> (3 * level)) & 0x7;
-		add_entity(&(*node)->child[i], level - 1, hash);
+	if (bvh->num_nodes == 0) new_node(bvh);
+	int node = 0;
+	++bvh->nodes[node].size;
+	for (int level = GeoNodeLevel64(hash); level > 0; --level) {
+		// The child index is the most significant octant digit
+		// among the remaining levels.
+		int i = (hash >> (3 * (level - 1))) & 0x7;
+		if (bvh->nodes[node].child[i] < 0) {
+			int child = new_node(bvh);
+			bvh->nodes[node].child[i] = child;
+		}
+		node = bvh->nodes[node].child[i];
+		++bvh->nodes[node].size;
 	}
 }
 
 static void recompute_sizes(struct GeoHashedBvh *bvh)
 {
-	if (bvh->root) {
-		reset_sizes(bvh->root);
-	}
-	for (int i = 0; i < bvh->level_begin[GEO_HASHED_BVH_MAX_DEPTH]; ++i) {
-		GeoNodeKey hash = bvh->hashes[i];
-		add_entity(&bvh->root, GeoNodeLevel(hash), hash);
+	bvh->num_nodes = 0;
+	for (int i = 0; i < bvh->level_begin[bvh->depth]; ++i) {
+		GeoNodeKey64 hash = bvh->hashes[i];
+		// The tree of counts is laid out in Morton order.
+		if (bvh->order == GEO_KEY_ORDER_HILBERT) {
+			hash = GeoNodeHilbertToMorton64(hash);
+		}
+		add_entity(bvh, hash);
 	}
 }
 
@@ -219,38 +340,45 @@ static uint64_t lower_bound_64(uint64_t* arr, uint64_t n, uint64_t x)
 void GeoHBInsert(struct GeoHashedBvh *bvh, int n,
 	struct GeoBoundingBox *volumes, void **data)
 {
+	assert(!bvh->mapping);
+	int depth = bvh->depth;
+
 	// Compute hashes
-	uint64_t *new_hashes;
+	GeoNodeKey64 *new_hashes;
 	new_hashes = malloc(n * sizeof(*new_hashes));
-	ComputeHashes(&bvh->bbox, volumes, n, new_hashes);
+	uint32_t *tags = malloc(n * sizeof(*tags));
+	ComputeHashes(&bvh->bbox, depth, bvh->order, volumes, n,
+		new_hashes, tags);
 
-	GeoQsort(new_hashes, n);
+	// Keys carry the level marker of nodes up to level depth - 1.
+	GeoRadixSortPairs(new_hashes, tags, n, 3 * (depth - 1) + 1);
 
 	// Find level partitioning
-	int level_begin[GEO_HASHED_BVH_MAX_DEPTH + 1];
+	int level_begin[GEO_HASHED_BVH_MAX_DEPTH_64 + 1];
 	level_begin[0] = 0;
 	// TODO: This could be optimized by recursively partitioning
 	// the hashes.
-	for (int i = 0; i < GEO_HASHED_BVH_MAX_DEPTH; ++i) {
+	for (int i = 0; i < depth; ++i) {
 		level_begin[i + 1] = level_begin[i] +
 			lower_bound_64(
 				new_hashes + level_begin[i],
 				n - level_begin[i],
-				BigHash(0x1u << (3 * (i + 1)), 0x0u));
+				0x1ull << (3 * (i + 1)));
 	}
-	assert(level_begin[GEO_HASHED_BVH_MAX_DEPTH] == n);
+	assert(level_begin[depth] == n);
 
 	// Merge the sorted hashes
 	struct GeoHashedBvh merged_bvh;
-	GeoHBInitialize(&merged_bvh, bvh->bbox);
-	reserve_space(&merged_bvh,
-		bvh->level_begin[GEO_HASHED_BVH_MAX_DEPTH] + n);
-	merged_bvh.root = bvh->root;
-	bvh->root = 0;
-	merge(&merged_bvh, bvh, n, new_hashes, volumes, data);
+	GeoHBInitializeWithDepth(&merged_bvh, bvh->bbox, depth);
+	merged_bvh.order = bvh->order;
+	reserve_space(&merged_bvh, bvh->level_begin[depth] + n);
+	merged_bvh.nodes = bvh->nodes;
+	merged_bvh.nodes_capacity = bvh->nodes_capacity;
+	bvh->nodes = 0;
+	merge(&merged_bvh, bvh, n, new_hashes, tags, volumes, data);
 
 	// Update the level pointers
-	for (int i = 0; i < GEO_HASHED_BVH_MAX_DEPTH + 1; ++i) {
+	for (int i = 0; i < depth + 1; ++i) {
 		merged_bvh.level_begin[i] =
 			bvh->level_begin[i] + level_begin[i];
 	}
@@ -258,13 +386,14 @@ void GeoHBInsert(struct GeoHashedBvh *bvh, int n,
 	// Swap data into bvh and cleanup
 	GeoHBDestroy(bvh);
 	*bvh = merged_bvh;
+	free(tags);
 	free(new_hashes);
 
 	// Update the size information
 	recompute_sizes(bvh);
 }
 
-static uint32_t lower_bound(uint32_t* arr, uint32_t n, uint32_t x)
+static uint32_t lower_bound(uint64_t* arr, uint32_t n, uint64_t x)
 {
 	uint32_t l = 0;
 	uint32_t h = n;
@@ -279,7 +408,7 @@ static uint32_t lower_bound(uint32_t* arr, uint32_t n, uint32_t x)
 	return l;
 }
 
-static uint32_t upper_bound(uint32_t* arr, uint32_t n, uint32_t x)
+static uint32_t upper_bound(uint64_t* arr, uint32_t n, uint64_t x)
 {
 	uint32_t l = 0;
 	uint32_t h = n;
@@ -306,46 +435,108 @@ static int boxes_overlap(
 	}
 }
 
+// The volumes found by a query go to a volume visitor, one call per
+// volume, or to a block visitor. The volumes of a node are tested in
+// blocks of VISIT_BLOCK and the hits compacted without branches; for
+// block visitors they are collected until there are at least VISIT_BLOCK
+// of them.
+#define VISIT_BLOCK 64
+
+struct VolumeSink {
+	GeoVolumeVisitor *visitor;
+	GeoVolumeBlockVisitor *block_visitor;
+	void *ctx;
+	int num_hits;
+	int hits[2 * VISIT_BLOCK];
+};
+
+static void VolumeSinkInitialize(struct VolumeSink *sink,
+	GeoVolumeVisitor *visitor, GeoVolumeBlockVisitor *block_visitor,
+	void *ctx)
+{
+	sink->visitor = visitor;
+	sink->block_visitor = block_visitor;
+	sink->ctx = ctx;
+	sink->num_hits = 0;
+}
+
+static int flush_hits(struct GeoHashedBvh *bvh, struct VolumeSink *sink)
+{
+	int n = sink->num_hits;
+	sink->num_hits = 0;
+	return n == 0 || sink->block_visitor(bvh->volumes, bvh->data,
+		sink->hits, n, sink->ctx);
+}
+
+// Visits the volumes in [l, h) that overlap volume. Returns 0 if the
+// visitor asked to stop.
+static int visit_overlapping(struct GeoHashedBvh *bvh, int l, int h,
+	const struct GeoBoundingBox *volume, struct VolumeSink *sink)
+{
+	for (; l < h; l += VISIT_BLOCK) {
+		int n = h - l < VISIT_BLOCK ? h - l : VISIT_BLOCK;
+		int *hits = sink->hits + sink->num_hits;
+		int num_hits = 0;
+		for (int j = 0; j < n; ++j) {
+			hits[num_hits] = l + j;
+			num_hits += boxes_overlap(&bvh->volumes[l + j], volume);
+		}
+		if (sink->visitor) {
+			for (int j = 0; j < num_hits; ++j) {
+				if (0 == sink->visitor(bvh->volumes, bvh->data,
+					hits[j], sink->ctx)) {
+					return 0;
+				}
+			}
+			continue;
+		}
+		sink->num_hits += num_hits;
+		if (sink->num_hits >= VISIT_BLOCK && !flush_hits(bvh, sink)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// The node is passed by its key in the order of the hashes and by its
+// Hilbert state so that the keys of the children cost a table lookup.
 static int visit_node(
-	GeoNodeKey node,
-	struct GeoHashedBvhNode *tree_node,
+	GeoNodeKey64 key,
+	int state,
+	int tree_node,
 	const struct GeoBoundingBox *my_bbox,
 	struct GeoHashedBvh *bvh,
 	const struct GeoBoundingBox *volume,
-	GeoVolumeVisitor visitor,
-	void *ctx)
+	struct VolumeSink *sink)
 {
 	// Bail early if the subtree starting at this node is empty
-	if (!tree_node || tree_node->size == 0) return 1;
-
-	// Visit own volumes
-	GeoNodeKey begin = GeoNodeBegin(node);
-	GeoNodeKey end = GeoNodeEnd(node);
-	int level = GeoNodeLevel(node);
-	begin |= (0x1u << (3 * level));
-	end |= (0x1u << (3 * level));
-	int n = bvh->level_begin[level + 1] - bvh->level_begin[level];
-	int l = lower_bound(bvh->hashes + bvh->level_begin[level], n, begin);
-	int h = upper_bound(bvh->hashes + bvh->level_begin[level], n, end);
-	for (int i = l; i < h; ++i) {
-		if (boxes_overlap(&bvh->volumes[i], volume)) {
-			int cont = visitor(bvh->volumes, bvh->data, i, ctx);
-			if (cont == 0) return 0;
-		}
-	}
-	if (level == GEO_HASHED_BVH_MAX_DEPTH - 1) return 1;
+	if (tree_node < 0 || bvh->nodes[tree_node].size == 0) return 1;
+
+	// Visit own volumes. These are the volumes whose key is equal to
+	// the key of this node.
+	int level = GeoNodeLevel64(key);
+	int offset = bvh->level_begin[level];
+	int n = bvh->level_begin[level + 1] - offset;
+	int l = offset + lower_bound(bvh->hashes + offset, n, key);
+	int h = offset + upper_bound(bvh->hashes + offset, n, key);
+	if (!visit_overlapping(bvh, l, h, volume, sink)) return 0;
+	if (level == bvh->depth - 1) return 1;
 
 	// Visit children
-	GeoNodeKey children[8];
-	GeoNodeComputeChildKeys(node, children);
+	int hilbert = bvh->order == GEO_KEY_ORDER_HILBERT;
 	struct GeoBoundingBox child_boxes[8];
 	GeoComputeChildBoxes(my_bbox, child_boxes);
 	for (int i = 0; i < 8; ++i) {
 		if (boxes_overlap(&child_boxes[i], volume)) {
+			GeoNodeKey64 child = (key << 3) |
+				(hilbert ? GeoHilbertDigits[state][i] : i);
+			int child_state = hilbert ?
+				GeoHilbertChildStates[state][i] : 0;
 			int cont = visit_node(
-				children[i], tree_node->child[i],
+				child, child_state,
+				bvh->nodes[tree_node].child[i],
 				&child_boxes[i],
-				bvh, volume, visitor, ctx);
+				bvh, volume, sink);
 			if (cont == 0) return 0;
 		}
 	}
@@ -358,8 +549,23 @@ void GeoHBVisitIntersectingVolumes(struct GeoHashedBvh *bvh,
 	GeoVolumeVisitor visitor,
 	void *ctx)
 {
-	visit_node(GeoNodeRoot(), bvh->root, &bvh->bbox, bvh, volume, visitor,
-		ctx);
+	struct VolumeSink sink;
+	VolumeSinkInitialize(&sink, visitor, 0, ctx);
+	visit_node(GeoNodeRoot64(), 0, bvh->num_nodes > 0 ? 0 : -1, &bvh->bbox,
+		bvh, volume, &sink);
+}
+
+void GeoHBVisitIntersectingVolumeBlocks(struct GeoHashedBvh *bvh,
+	const struct GeoBoundingBox *volume,
+	GeoVolumeBlockVisitor visitor,
+	void *ctx)
+{
+	struct VolumeSink sink;
+	VolumeSinkInitialize(&sink, 0, visitor, ctx);
+	if (visit_node(GeoNodeRoot64(), 0, bvh->num_nodes > 0 ? 0 : -1,
+		&bvh->bbox, bvh, volume, &sink)) {
+		flush_hits(bvh, &sink);
+	}
 }
 
 
@@ -1,58 +1,382 @@
 #include <hashed_octree.h>
+#include <geo_config.h>
 #include <string.h>
 #include <stdlib.h>
 #include <qsort.h>
+#include <snapshot.h>
 #include <math.h>
 #include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
+static void build_directory(struct GeoHashedOctree *tree);
+static void purge_removed(struct GeoHashedOctree *tree);
 
 void GeoHOInitialize(struct GeoHashedOctree* tree, struct GeoBoundingBox b)
 {
+	GeoHOInitializeWithDepth(tree, b, GeoNodeMaxDepth());
+}
+
+void GeoHOInitializeWithDepth(struct GeoHashedOctree* tree,
+	struct GeoBoundingBox b, int depth)
+{
+	assert(depth > 0 && depth <= GeoNodeMaxDepth64());
 	memset(tree, 0, sizeof(*tree));
 	GeoVAInitialize(&tree->vertices);
 	tree->hashes = malloc(tree->vertices.capacity * sizeof(*tree->hashes));
 	tree->bbox = b;
+	tree->depth = depth;
+	tree->order = GEO_KEY_ORDER_MORTON;
+	tree->max_directory_bits = GEO_HO_DEFAULT_DIRECTORY_BITS;
+	tree->max_removed_ratio = GEO_HO_DEFAULT_MAX_REMOVED_RATIO;
+	build_directory(tree);
+}
+
+void GeoHOInitializeAdaptive(struct GeoHashedOctree *tree,
+	struct GeoBoundingBox b, int leaf_capacity)
+{
+	GeoHOInitializeWithDepth(tree, b, GeoNodeMaxDepth64());
+	GeoHOSetLeafCapacity(tree, leaf_capacity);
+}
+
+void GeoHOSetKeyOrder(struct GeoHashedOctree *tree, enum GeoKeyOrder order)
+{
+	assert(tree->vertices.size == 0);
+	tree->order = order;
+}
+
+void GeoHOSetDirectoryBits(struct GeoHashedOctree *tree, int bits)
+{
+	assert(!tree->mapping);
+	if (bits < 0) bits = 0;
+	if (bits > GEO_HO_MAX_DIRECTORY_BITS) bits = GEO_HO_MAX_DIRECTORY_BITS;
+	tree->max_directory_bits = bits;
+	build_directory(tree);
+	for (int r = 0; r < tree->num_runs; ++r) {
+		GeoHOSetDirectoryBits(&tree->runs[r], bits);
+	}
+}
+
+void GeoHOSetLeafCapacity(struct GeoHashedOctree *tree, int capacity)
+{
+	tree->leaf_capacity = capacity > 0 ? capacity : 0;
+	for (int r = 0; r < tree->num_runs; ++r) {
+		tree->runs[r].leaf_capacity = tree->leaf_capacity;
+	}
+}
+
+void GeoHOSetGrowBoundingBox(struct GeoHashedOctree *tree, int grow)
+{
+	tree->grow_bbox = grow;
+}
+
+void GeoHOSetInsertMode(struct GeoHashedOctree *tree, enum GeoInsertMode mode)
+{
+	assert(mode == GEO_INSERT_MERGE || !tree->indices);
+	if (mode == GEO_INSERT_MERGE) GeoHOCompact(tree);
+	tree->insert_mode = mode;
+}
+
+// Run 0 is the tree itself, the others are tree->runs.
+static struct GeoHashedOctree *run_at(struct GeoHashedOctree *tree, int r)
+{
+	return r == 0 ? tree : &tree->runs[r - 1];
+}
+
+static int is_removed(const struct GeoHashedOctree *tree, uint32_t i)
+{
+	return tree->removed && ((tree->removed[i / 64] >> (i % 64)) & 1);
+}
+
+int GeoHONumVertices(const struct GeoHashedOctree *tree)
+{
+	int n = tree->vertices.size - tree->num_removed;
+	for (int r = 0; r < tree->num_runs; ++r) {
+		n += tree->runs[r].vertices.size - tree->runs[r].num_removed;
+	}
+	return n;
+}
+
+int GeoHONumStoredVertices(const struct GeoHashedOctree *tree)
+{
+	int n = tree->vertices.size;
+	for (int r = 0; r < tree->num_runs; ++r) {
+		n += tree->runs[r].vertices.size;
+	}
+	return n;
+}
+
+static struct GeoHashedOctree *locate_run(struct GeoHashedOctree *tree,
+	int *i)
+{
+	int r = 0;
+	while (r < tree->num_runs && *i >= run_at(tree, r)->vertices.size) {
+		*i -= run_at(tree, r)->vertices.size;
+		++r;
+	}
+	return run_at(tree, r);
+}
+
+struct GeoVertexArray *GeoHOLocateVertex(struct GeoHashedOctree *tree,
+	int *i)
+{
+	return &locate_run(tree, i)->vertices;
 }
 
 void GeoHODestroy(struct GeoHashedOctree* tree)
 {
+	if (tree->mapping) {
+		GeoSnapshotUnmap(tree->mapping, tree->mapping_size);
+		return;
+	}
 	GeoVADestroy(&tree->vertices);
 	free(tree->hashes);
+	free(tree->directory);
+	free(tree->removed);
+	free(tree->indices);
+	for (int r = 0; r < tree->num_runs; ++r) {
+		GeoHODestroy(&tree->runs[r]);
+	}
+	free(tree->runs);
 }
 
-static uint64_t BigHash(uint32_t hash, uint32_t tag)
-{
-	// Store the hash in the higher order bits so we sort by that.
-	return ((uint64_t)hash << 32) | (uint64_t)tag;
+// Snapshot sections of a tree.
+#define OCTREE_MAGIC "GEOHO"
+enum {
+	OCTREE_HASHES,
+	OCTREE_X,
+	OCTREE_Y,
+	OCTREE_Z,
+	OCTREE_PTRS,
+	OCTREE_DIRECTORY,
+	OCTREE_NUM_SECTIONS
+};
+
+struct OctreeSnapshot {
+	struct GeoSnapshotHeader header;
+	struct GeoBoundingBox bbox;
+	int32_t depth;
+	int32_t order;
+	int32_t size;
+	int32_t directory_bits;
 };
 
-static uint32_t GetHash(uint64_t big_hash)
+int GeoHOSave(struct GeoHashedOctree *tree, const char *path)
+{
+	assert(!tree->indices);
+	GeoHOCompact(tree);
+	struct OctreeSnapshot snapshot;
+	uint64_t n = tree->vertices.size;
+	void **positions = GeoSnapshotPositions(n);
+	const void *sections[OCTREE_NUM_SECTIONS] = {
+		tree->hashes, tree->vertices.x, tree->vertices.y,
+		tree->vertices.z, positions, tree->directory};
+	uint64_t sizes[OCTREE_NUM_SECTIONS] = {
+		n * sizeof(*tree->hashes), n * sizeof(double),
+		n * sizeof(double), n * sizeof(double), n * sizeof(void *),
+		((1ull << tree->directory_bits) + 1) *
+			sizeof(*tree->directory)};
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.bbox = tree->bbox;
+	snapshot.depth = tree->depth;
+	snapshot.order = tree->order;
+	snapshot.size = n;
+	snapshot.directory_bits = tree->directory_bits;
+	int status = GeoSnapshotWrite(path, OCTREE_MAGIC, &snapshot,
+		sizeof(snapshot), sections, sizes, OCTREE_NUM_SECTIONS);
+	free(positions);
+	return status;
+}
+
+// Queries search the positions between consecutive directory entries, so
+// these must be non-decreasing and within the vertices.
+static int directory_is_valid(const uint32_t *directory, int bits,
+	uint64_t n)
+{
+	uint32_t size = (1u << bits) + 1;
+	for (uint32_t b = 0; b < size; ++b) {
+		if (directory[b] > n) return 0;
+		if (b > 0 && directory[b - 1] > directory[b]) return 0;
+	}
+	return 1;
+}
+
+static int key_order_is_valid(int32_t order)
+{
+	return order == GEO_KEY_ORDER_MORTON || order == GEO_KEY_ORDER_HILBERT;
+}
+
+int GeoHOMap(struct GeoHashedOctree *tree, const char *path)
+{
+	size_t size;
+	const struct OctreeSnapshot *snapshot = GeoSnapshotMap(path,
+		OCTREE_MAGIC, sizeof(*snapshot), &size);
+	if (!snapshot) return -1;
+	const struct GeoSnapshotHeader *h = &snapshot->header;
+	uint64_t n = snapshot->size;
+	int depth = snapshot->depth;
+	int bits = snapshot->directory_bits;
+	if (snapshot->size < 0 || !key_order_is_valid(snapshot->order) ||
+	    depth <= 0 || depth > GeoNodeMaxDepth64() ||
+	    bits < 0 || bits > GEO_HO_MAX_DIRECTORY_BITS || bits > 3 * depth ||
+	    h->sizes[OCTREE_HASHES] != n * sizeof(GeoSpatialHash64) ||
+	    h->sizes[OCTREE_X] != n * sizeof(double) ||
+	    h->sizes[OCTREE_Y] != n * sizeof(double) ||
+	    h->sizes[OCTREE_Z] != n * sizeof(double) ||
+	    h->sizes[OCTREE_PTRS] != n * sizeof(void *) ||
+	    h->sizes[OCTREE_DIRECTORY] !=
+	    ((1ull << bits) + 1) * sizeof(uint32_t)) {
+		GeoSnapshotUnmap(snapshot, size);
+		return -1;
+	}
+	const char *base = (const char *)snapshot;
+	if (!directory_is_valid(
+		(const uint32_t *)(base + h->offsets[OCTREE_DIRECTORY]),
+		bits, n)) {
+		GeoSnapshotUnmap(snapshot, size);
+		return -1;
+	}
+	memset(tree, 0, sizeof(*tree));
+	tree->vertices.size = n;
+	tree->vertices.capacity = n;
+	tree->vertices.x = (double *)(base + h->offsets[OCTREE_X]);
+	tree->vertices.y = (double *)(base + h->offsets[OCTREE_Y]);
+	tree->vertices.z = (double *)(base + h->offsets[OCTREE_Z]);
+	tree->vertices.ptrs = (void **)(base + h->offsets[OCTREE_PTRS]);
+	tree->hashes = (GeoSpatialHash64 *)(base + h->offsets[OCTREE_HASHES]);
+	tree->bbox = snapshot->bbox;
+	tree->depth = depth;
+	tree->order = snapshot->order;
+	tree->directory = (uint32_t *)(base + h->offsets[OCTREE_DIRECTORY]);
+	tree->directory_bits = bits;
+	tree->max_directory_bits = bits;
+	tree->max_removed_ratio = GEO_HO_DEFAULT_MAX_REMOVED_RATIO;
+	tree->mapping = snapshot;
+	tree->mapping_size = size;
+	return 0;
+}
+
+// The tree stores hashes with 3 * depth significant bits. These are
+// obtained from the 64 bit hashes by dropping the levels below depth.
+static int hash_shift(const struct GeoHashedOctree *tree)
+{
+	return 3 * (GeoNodeMaxDepth64() - tree->depth);
+}
+
+// The directory gets about one entry per vertex, up to
+// max_directory_bits. It is rebuilt whenever the hashes change.
+static void build_directory(struct GeoHashedOctree *tree)
+{
+	int n = tree->vertices.size;
+	int bits = 0;
+	while (bits < tree->max_directory_bits && bits < 3 * tree->depth &&
+	       (1 << bits) < n) {
+		++bits;
+	}
+	uint32_t size = (1u << bits) + 1;
+	free(tree->directory);
+	tree->directory = malloc(size * sizeof(*tree->directory));
+	tree->directory_bits = bits;
+	int shift = 3 * tree->depth - bits;
+	uint32_t b = 0;
+	for (int i = 0; i < n; ++i) {
+		uint64_t prefix = tree->hashes[i] >> shift;
+		while (b <= prefix) tree->directory[b++] = i;
+	}
+	while (b < size) tree->directory[b++] = n;
+}
+
+// Insertions of at least this many vertices are split into one chunk per
+// OpenMP thread. Deduplication does a query per vertex so it pays off
+// sooner.
+#define MIN_PARALLEL_INSERT_SIZE (1 << 16)
+#define MIN_PARALLEL_DEDUP_SIZE (1 << 12)
+
+static int num_parallel_chunks(int n, int min_parallel_size)
+{
+#ifdef _OPENMP
+	if (n >= min_parallel_size) return omp_get_max_threads();
+#endif
+	(void)n;
+	(void)min_parallel_size;
+	return 1;
+}
+
+// Chunks start at multiples of 16 vertices so that the coordinate arrays
+// of every chunk keep the alignment of the vertex array.
+static int chunk_begin(int n, int t, int num_chunks)
 {
-	return (uint32_t)(0x00000000FFFFFFFFull & (big_hash >> 32));
+	if (t == num_chunks) return n;
+	return (int)((int64_t)n * t / num_chunks) & ~15;
 }
 
-static uint32_t GetTag(uint64_t big_hash)
+static int is_aligned(const double *x)
 {
-	return (uint32_t)(0x00000000FFFFFFFFull & big_hash);
+	return (uintptr_t)x % GEO_VA_ALIGNMENT == 0;
 }
 
+// The coordinates of vertex i of va. Trees attached by GeoHOAttachFloat
+// read them from the caller's single precision arrays instead.
+static inline struct GeoPoint vertex_point(const struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va, uint32_t i)
+{
+	if (tree->float_x) {
+		return (struct GeoPoint){
+			tree->float_x[i], tree->float_y[i], tree->float_z[i]};
+	}
+	return (struct GeoPoint){va->x[i], va->y[i], va->z[i]};
+}
 
-static void ComputeHashes(const struct GeoBoundingBox *b,
+// Hashes the vertices of va and sets tags to the identity unless tags is
+// null.
+static void ComputeHashes(const struct GeoHashedOctree *tree,
 	const struct GeoVertexArray *va,
-	uint64_t *hashes)
+	GeoSpatialHash64 *hashes, uint32_t *tags)
 {
-	for (int i = 0; i < va->size; ++i) {
-		struct GeoPoint p = {
-			va->x[i],
-			va->y[i],
-			va->z[i]};
-		GeoSpatialHash hash = GeoComputeHash(b, &p);
-		hashes[i] = BigHash(hash, i);
+	int shift = hash_shift(tree);
+	int num_chunks = num_parallel_chunks(va->size, MIN_PARALLEL_INSERT_SIZE);
+	// The vectorized hashing needs aligned arrays of doubles. Vertex
+	// arrays are aligned, the arrays of attached trees may not be.
+	int aligned = !tree->float_x && is_aligned(va->x) &&
+		is_aligned(va->y) && is_aligned(va->z);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int t = 0; t < num_chunks; ++t) {
+		int begin = chunk_begin(va->size, t, num_chunks);
+		int end = chunk_begin(va->size, t + 1, num_chunks);
+		if (!aligned) {
+			for (int i = begin; i < end; ++i) {
+				struct GeoPoint p = vertex_point(tree, va, i);
+				hashes[i] = tree->order == GEO_KEY_ORDER_HILBERT ?
+					GeoComputeHilbertHash64(&tree->bbox, &p) :
+					GeoComputeHash64(&tree->bbox, &p);
+			}
+		} else {
+			struct GeoVertexArray chunk = *va;
+			chunk.size = end - begin;
+			chunk.x += begin;
+			chunk.y += begin;
+			chunk.z += begin;
+			if (tree->order == GEO_KEY_ORDER_HILBERT) {
+				GeoComputeHilbertHashes64(&tree->bbox, &chunk,
+					hashes + begin);
+			} else {
+				GeoComputeHashes64(&tree->bbox, &chunk,
+					hashes + begin);
+			}
+		}
+		for (int i = begin; i < end; ++i) hashes[i] >>= shift;
+		if (tags) {
+			for (int i = begin; i < end; ++i) tags[i] = i;
+		}
 	}
 }
 
 #ifndef NDEBUG
-static int hashes_are_sorted(GeoSpatialHash *h, int n)
+static int hashes_are_sorted(GeoSpatialHash64 *h, int n)
 {
 	for (int i = 0; i < n - 1; ++i) {
 		if (h[i] > h[i + 1]) return 0;
@@ -61,61 +385,106 @@ static int hashes_are_sorted(GeoSpatialHash *h, int n)
 }
 #endif
 
-static void merge(
-	GeoSpatialHash **hashes_1, struct GeoVertexArray *va_1,
-	const uint64_t *hashes_2, const struct GeoVertexArray *va_2)
+// Number of elements of the first sequence among the first d elements of
+// the merged sequence (merge path). Ties go to the second sequence first,
+// like in merge_range.
+static int merge_path_split(const GeoSpatialHash64 *hashes_1, int n1,
+	const GeoSpatialHash64 *hashes_2, int n2, int d)
 {
-	int n1 = va_1->size;
-	int n2 = va_2->size;
+	int l = d > n2 ? d - n2 : 0;
+	int h = d < n1 ? d : n1;
+	while (l < h) {
+		int mid = (l + h) / 2;
+		if (hashes_1[mid] < hashes_2[d - 1 - mid]) {
+			l = mid + 1;
+		} else {
+			h = mid;
+		}
+	}
+	return l;
+}
 
-	struct GeoVertexArray temp_va;
-	GeoVAInitialize(&temp_va);
-	GeoVAResize(&temp_va, n1 + n2);
-	GeoSpatialHash *temp_hashes = malloc((n1 + n2) * sizeof(*temp_hashes));
-
-	int i = 0;
-	int j = 0;
-	int k = 0;
-	while (i < n1 && j  < n2) {
-		if ((*hashes_1)[i] < GetHash(hashes_2[j])) {
-			temp_hashes[k] = (*hashes_1)[i];
-			temp_va.x[k] = va_1->x[i];
-			temp_va.y[k] = va_1->y[i];
-			temp_va.z[k] = va_1->z[i];
-			temp_va.ptrs[k] = va_1->ptrs[i];
+// Merges elements [i, i_end) of the tree and [j, j_end) of the new
+// vertices into the output starting at k.
+static void merge_range(
+	const GeoSpatialHash64 *hashes_1, const struct GeoVertexArray *va_1,
+	int i, int i_end,
+	const GeoSpatialHash64 *hashes_2, const uint32_t *tags_2,
+	const struct GeoVertexArray *va_2, int j, int j_end,
+	GeoSpatialHash64 *temp_hashes, struct GeoVertexArray *temp_va, int k)
+{
+	while (i < i_end && j < j_end) {
+		if (hashes_1[i] < hashes_2[j]) {
+			temp_hashes[k] = hashes_1[i];
+			temp_va->x[k] = va_1->x[i];
+			temp_va->y[k] = va_1->y[i];
+			temp_va->z[k] = va_1->z[i];
+			temp_va->ptrs[k] = va_1->ptrs[i];
 			++i;
 		} else {
-			temp_hashes[k] = GetHash(hashes_2[j]);
-			int m = GetTag(hashes_2[j]);
-			temp_va.x[k] = va_2->x[m];
-			temp_va.y[k] = va_2->y[m];
-			temp_va.z[k] = va_2->z[m];
-			temp_va.ptrs[k] = va_2->ptrs[m];
+			temp_hashes[k] = hashes_2[j];
+			int m = tags_2[j];
+			temp_va->x[k] = va_2->x[m];
+			temp_va->y[k] = va_2->y[m];
+			temp_va->z[k] = va_2->z[m];
+			temp_va->ptrs[k] = va_2->ptrs[m];
 			++j;
 		}
 		++k;
 	}
 
-	while (i < n1) {
-		temp_hashes[k] = (*hashes_1)[i];
-		temp_va.x[k] = va_1->x[i];
-		temp_va.y[k] = va_1->y[i];
-		temp_va.z[k] = va_1->z[i];
-		temp_va.ptrs[k] = va_1->ptrs[i];
+	while (i < i_end) {
+		temp_hashes[k] = hashes_1[i];
+		temp_va->x[k] = va_1->x[i];
+		temp_va->y[k] = va_1->y[i];
+		temp_va->z[k] = va_1->z[i];
+		temp_va->ptrs[k] = va_1->ptrs[i];
 		++i;
 		++k;
 	}
 
-	while (j < n2) {
-		temp_hashes[k] = GetHash(hashes_2[j]);
-		int m = GetTag(hashes_2[j]);
-		temp_va.x[k] = va_2->x[m];
-		temp_va.y[k] = va_2->y[m];
-		temp_va.z[k] = va_2->z[m];
-		temp_va.ptrs[k] = va_2->ptrs[m];
+	while (j < j_end) {
+		temp_hashes[k] = hashes_2[j];
+		int m = tags_2[j];
+		temp_va->x[k] = va_2->x[m];
+		temp_va->y[k] = va_2->y[m];
+		temp_va->z[k] = va_2->z[m];
+		temp_va->ptrs[k] = va_2->ptrs[m];
 		++j;
 		++k;
 	}
+}
+
+// Every thread merges one slice of the output. The slice boundaries are
+// found with merge_path_split so the threads write disjoint parts of the
+// hashes and of the x, y, z and ptrs arrays.
+static void merge(
+	GeoSpatialHash64 **hashes_1, struct GeoVertexArray *va_1,
+	const GeoSpatialHash64 *hashes_2, const uint32_t *tags_2,
+	const struct GeoVertexArray *va_2)
+{
+	int n1 = va_1->size;
+	int n2 = va_2->size;
+
+	struct GeoVertexArray temp_va;
+	GeoVAInitialize(&temp_va);
+	GeoVAResize(&temp_va, n1 + n2);
+	GeoSpatialHash64 *temp_hashes =
+		malloc((n1 + n2) * sizeof(*temp_hashes));
+
+	int num_chunks = num_parallel_chunks(n1 + n2, MIN_PARALLEL_INSERT_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int t = 0; t < num_chunks; ++t) {
+		int k = chunk_begin(n1 + n2, t, num_chunks);
+		int k_end = chunk_begin(n1 + n2, t + 1, num_chunks);
+		int i = merge_path_split(*hashes_1, n1, hashes_2, n2, k);
+		int i_end = merge_path_split(*hashes_1, n1, hashes_2, n2, k_end);
+		merge_range(*hashes_1, va_1, i, i_end,
+			hashes_2, tags_2, va_2, k - i, k_end - i_end,
+			temp_hashes, &temp_va, k);
+	}
 
 	free(*hashes_1);
 	*hashes_1 = temp_hashes;
@@ -125,252 +494,2062 @@ static void merge(
 	assert(hashes_are_sorted(*hashes_1, va_1->size));
 }
 
+static void insert_run(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va);
+static void grow_to_fit(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va);
+
 void GeoHOInsert(struct GeoHashedOctree *tree,
 	const struct GeoVertexArray *va)
 {
-	uint64_t *new_hashes;
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	if (tree->grow_bbox) grow_to_fit(tree, va);
+	if (tree->insert_mode == GEO_INSERT_RUNS) {
+		insert_run(tree, va);
+		return;
+	}
+	purge_removed(tree);
+	GeoSpatialHash64 *new_hashes;
 	new_hashes = malloc(va->size * sizeof(*new_hashes));
-	ComputeHashes(&tree->bbox, va, new_hashes);
-	GeoQsort(new_hashes, va->size);
-	merge(&tree->hashes, &tree->vertices, new_hashes, va);
+	uint32_t *tags = malloc(va->size * sizeof(*tags));
+	ComputeHashes(tree, va, new_hashes, tags);
+	GeoRadixSortPairs(new_hashes, tags, va->size, 3 * tree->depth);
+	merge(&tree->hashes, &tree->vertices, new_hashes, tags, va);
+	free(tags);
 	free(new_hashes);
+	build_directory(tree);
 }
 
-struct NodeList {
-	struct NodeList* next;
-	GeoNodeKey node;
-};
-static void NodeListDelete(struct NodeList *list) {
-	while (list) {
-		struct NodeList *next = list->next;
-		free(list);
-		list = next;
+// The permutation is found by replacing the ptrs of the stored vertices
+// by their index before an operation and reading the indices back
+// afterwards, wherever the vertices went. tag_vertices saves the ptrs to
+// ptrs[0, n) and untag_vertices restores them. Both take time linear in the
+// number of stored vertices which is the size of the permutation.
+static void tag_vertices(struct GeoHashedOctree *tree, void **ptrs)
+{
+	int offset = 0;
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		struct GeoVertexArray *va = &run_at(tree, r)->vertices;
+		int n = va->size;
+		int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_INSERT_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+		for (int i = 0; i < n; ++i) {
+			ptrs[offset + i] = va->ptrs[i];
+			va->ptrs[i] = (void *)(uintptr_t)(offset + i);
+		}
+		offset += n;
 	}
 }
-static struct NodeList *NodeListPush(struct NodeList *list, GeoNodeKey node) {
-	struct NodeList *new_node = malloc(sizeof(*new_node));
-	new_node->next = list;
-	new_node->node = node;
-	return new_node;
+
+static void untag_vertices(struct GeoHashedOctree *tree, void **ptrs, int n,
+	int *permutation)
+{
+	int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_INSERT_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int i = 0; i < n; ++i) permutation[i] = -1;
+	int offset = 0;
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		struct GeoVertexArray *va = &run_at(tree, r)->vertices;
+		int m = va->size;
+		num_chunks = num_parallel_chunks(m, MIN_PARALLEL_INSERT_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+		for (int i = 0; i < m; ++i) {
+			uintptr_t id = (uintptr_t)va->ptrs[i];
+			permutation[id] = offset + i;
+			va->ptrs[i] = ptrs[id];
+		}
+		offset += m;
+	}
 }
 
-static int boxes_overlap(
-	const struct GeoBoundingBox* a, const struct GeoBoundingBox* b)
+void GeoHOInsertWithPermutation(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va, int *permutation)
 {
-	if (a->max.x >= b->min.x && b->max.x >= a->min.x &&
-	    a->max.y >= b->min.y && b->max.y >= a->min.y &&
-	    a->max.z >= b->min.z && b->max.z >= a->min.z) {
-		return 1;
-	} else {
-		return 0;
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	int num_stored = GeoHONumStoredVertices(tree);
+	int n = num_stored + va->size;
+	void **ptrs = malloc(n * sizeof(*ptrs));
+	tag_vertices(tree, ptrs);
+	struct GeoVertexArray tagged = *va;
+	void **new_ptrs = malloc(va->size * sizeof(*new_ptrs));
+	for (int i = 0; i < va->size; ++i) {
+		ptrs[num_stored + i] = va->ptrs[i];
+		new_ptrs[i] = (void *)(uintptr_t)(num_stored + i);
 	}
+	tagged.ptrs = new_ptrs;
+	GeoHOInsert(tree, &tagged);
+	untag_vertices(tree, ptrs, n, permutation);
+	free(new_ptrs);
+	free(ptrs);
 }
 
-static double volume(const struct GeoBoundingBox* bbox)
+static void copy_element(char *dst, const char *src, size_t size)
 {
-	return
-		(bbox->max.x - bbox->min.x) *
-		(bbox->max.y - bbox->min.y) *
-		(bbox->max.z - bbox->min.z);
+	// Constant sizes let the compiler replace the calls by moves.
+	switch (size) {
+	case 4:
+		memcpy(dst, src, 4);
+		break;
+	case 8:
+		memcpy(dst, src, 8);
+		break;
+	case 16:
+		memcpy(dst, src, 16);
+		break;
+	default:
+		memcpy(dst, src, size);
+	}
 }
 
-static void find_overlapping_nodes(
-	GeoNodeKey node, const struct GeoBoundingBox *bbox,
-	const struct GeoBoundingBox *p_bbox, double eps_cubed,
-	struct NodeList **node_list)
+void GeoHOApplyPermutation(const int *permutation, int n,
+	const void *src, size_t src_stride, void *dst, size_t dst_stride,
+	size_t element_size)
 {
-	if (boxes_overlap(p_bbox, bbox)) {
-		// Keep this node if we have reached the finest level or
-		// if the node is of comparable size to the bounding volume
-		// of the point (eps_cubed). Note that the exact termination
-		// criterion can be tuned. Choosing a tighter criterion leads to
-		// more (but smaller) nodes and rejects more candidate vertices.
-		// Choosing a looser criterion leads to fewer (but larger) nodes
-		// and rejects fewer vertices outright. The correctness of the
-		// algorithm is not affected.
-		if (GeoNodeLevel(node) == GeoNodeMaxDepth() ||
-		    volume(bbox) < 8 * eps_cubed) {
-			*node_list = NodeListPush(*node_list, node);
-		} else {
-			GeoNodeKey children[8];
-			GeoNodeComputeChildKeys(node, children);
-			struct GeoBoundingBox child_boxes[8];
-			GeoComputeChildBoxes(bbox, child_boxes);
-			for (int i = 0; i < 8; ++i) {
-				find_overlapping_nodes(children[i],
-					&child_boxes[i], p_bbox, eps_cubed,
-					node_list);
-			}
-		}
+	const char *s = src;
+	char *d = dst;
+	int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_INSERT_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int i = 0; i < n; ++i) {
+		if (permutation[i] < 0) continue;
+		copy_element(d + (size_t)permutation[i] * dst_stride,
+			s + (size_t)i * src_stride, element_size);
 	}
 }
 
-static struct NodeList *find_visit_list(const struct GeoPoint *p, double eps,
-	const struct GeoBoundingBox *bbox)
+// Drops the vertices of an empty or attached tree before it is pointed
+// at the caller's arrays.
+static void detach_vertices(struct GeoHashedOctree *tree)
 {
-	struct GeoBoundingBox p_bbox = {
-		{ p->x - eps, p->y - eps, p->z - eps },
-		{ p->x + eps, p->y + eps, p->z + eps }};
-	GeoNodeKey node = GeoNodeSmallestContaining(bbox, &p_bbox);
-	struct GeoBoundingBox smallest_bbox = GeoNodeBox(node, bbox);
-	struct NodeList *visit_list = 0;
-	find_overlapping_nodes(node, &smallest_bbox, &p_bbox, eps * eps * eps,
-		&visit_list);
-	return visit_list;
+	assert(!tree->mapping);
+	assert(tree->indices || (tree->vertices.size == 0 &&
+		tree->num_runs == 0));
+	assert(tree->insert_mode == GEO_INSERT_MERGE);
+	GeoVADestroy(&tree->vertices);
+	tree->float_x = 0;
+	tree->float_y = 0;
+	tree->float_z = 0;
 }
 
-static uint32_t upper_bound(uint32_t* arr, uint32_t n, uint32_t x)
+// Hashes and sorts the n vertices of the caller's arrays that the tree
+// has been pointed at.
+static void attach(struct GeoHashedOctree *tree, int n)
 {
-	uint32_t l = 0;
-	uint32_t h = n;
-	while (l < h) {
-		uint32_t mid = (l + h) / 2;
-		if (x >= arr[mid]) {
-			l = mid + 1;
-		} else {
-			h = mid;
-		}
-	}
-	return l;
+	tree->vertices.size = n;
+	tree->vertices.capacity = n;
+	free(tree->hashes);
+	free(tree->indices);
+	tree->hashes = malloc(n * sizeof(*tree->hashes));
+	tree->indices = malloc(n * sizeof(*tree->indices));
+	if (tree->grow_bbox) grow_to_fit(tree, &tree->vertices);
+	ComputeHashes(tree, &tree->vertices, tree->hashes, tree->indices);
+	GeoRadixSortPairs(tree->hashes, tree->indices, n, 3 * tree->depth);
+	build_directory(tree);
 }
 
-static uint32_t lower_bound(uint32_t* arr, uint32_t n, uint32_t x)
+void GeoHOAttach(struct GeoHashedOctree *tree,
+	const double *x, const double *y, const double *z, int n)
 {
-	uint32_t l = 0;
-	uint32_t h = n;
-	while (l < h) {
-		uint32_t mid = (l + h) / 2;
-		if (x <= arr[mid]) {
-			h = mid;
-		} else {
-			l = mid + 1;
-		}
-	}
-	return l;
+	detach_vertices(tree);
+	tree->vertices.x = (double *)x;
+	tree->vertices.y = (double *)y;
+	tree->vertices.z = (double *)z;
+	attach(tree, n);
 }
 
-static int vertex_is_near(int i, const struct GeoVertexArray *va,
-	const struct GeoPoint *p, double eps)
+void GeoHOAttachFloat(struct GeoHashedOctree *tree,
+	const float *x, const float *y, const float *z, int n)
 {
-	if ((fabs(p->x - va->x[i]) <= eps) &&
-	    (fabs(p->y - va->y[i]) <= eps) &&
-	    (fabs(p->z - va->z[i]) <= eps)) {
-		return 1;
-	} else {
-		return 0;
+	detach_vertices(tree);
+	tree->float_x = x;
+	tree->float_y = y;
+	tree->float_z = z;
+	attach(tree, n);
+}
+
+// The new hashes are put in the old order of the vertices. Vertices that
+// haven't left their leaf keep their hash so after small steps the keys
+// are mostly sorted; if they are still sorted the sort is skipped. The
+// radix sort is stable so vertices with equal hashes keep their order.
+void GeoHOUpdate(struct GeoHashedOctree *tree)
+{
+	assert(tree->indices);
+	int n = tree->vertices.size;
+	if (tree->grow_bbox) grow_to_fit(tree, &tree->vertices);
+	GeoSpatialHash64 *hashes = malloc(n * sizeof(*hashes));
+	ComputeHashes(tree, &tree->vertices, hashes, 0);
+	int sorted = 1;
+	for (int k = 0; k < n; ++k) {
+		tree->hashes[k] = hashes[tree->indices[k]];
+		sorted &= k == 0 || tree->hashes[k - 1] <= tree->hashes[k];
+	}
+	if (!sorted) {
+		GeoRadixSortPairs(tree->hashes, tree->indices, n,
+			3 * tree->depth);
 	}
+	free(hashes);
+	build_directory(tree);
 }
 
-static int visit_node(GeoNodeKey node, struct GeoHashedOctree *tree,
-	const struct GeoPoint* p, double eps,
-	GeoVertexVisitor visitor, void *ctx)
+// Merges the last run into the one before it. The vertices of the last
+// run are newer so they go first on ties, as in GeoHOInsert.
+static void merge_last_run(struct GeoHashedOctree *tree)
 {
-	GeoSpatialHash begin = GeoNodeBegin(node);
-	GeoSpatialHash end = GeoNodeEnd(node);
-	int l = lower_bound(tree->hashes, tree->vertices.size, begin);
-	int h = upper_bound(tree->hashes, tree->vertices.size, end);
-	struct GeoVertexArray *va = &tree->vertices;
-	for (int i = l; i != h; ++i) {
-		if (vertex_is_near(i, va, p, eps)) {
-			int cont = visitor(va, i, ctx);
-			if (0 == cont) return cont;
-		}
+	struct GeoHashedOctree *last = run_at(tree, tree->num_runs);
+	struct GeoHashedOctree *prev = run_at(tree, tree->num_runs - 1);
+	purge_removed(last);
+	purge_removed(prev);
+	int n = last->vertices.size;
+	uint32_t *tags = malloc(n * sizeof(*tags));
+	for (int i = 0; i < n; ++i) tags[i] = i;
+	merge(&prev->hashes, &prev->vertices, last->hashes, tags,
+		&last->vertices);
+	free(tags);
+	build_directory(prev);
+	GeoHODestroy(last);
+	--tree->num_runs;
+}
+
+// Sorts the new vertices into a run of their own and then merges the last
+// two runs while the last one is at least half as large as the one before,
+// like the carries of a binary counter. Each vertex is copied O(log n)
+// times and there are O(log n) runs.
+static void insert_run(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va)
+{
+	if (va->size == 0) return;
+	tree->runs = realloc(tree->runs,
+		(tree->num_runs + 1) * sizeof(*tree->runs));
+	struct GeoHashedOctree *run = &tree->runs[tree->num_runs++];
+	GeoHOInitializeWithDepth(run, tree->bbox, tree->depth);
+	run->order = tree->order;
+	run->max_directory_bits = tree->max_directory_bits;
+	run->leaf_capacity = tree->leaf_capacity;
+	GeoHOInsert(run, va);
+	while (tree->num_runs > 0 &&
+	       run_at(tree, tree->num_runs - 1)->vertices.size <=
+	       2 * run_at(tree, tree->num_runs)->vertices.size) {
+		merge_last_run(tree);
 	}
-	return 1;
 }
 
-void GeoHOVisitNearVertices(struct GeoHashedOctree *tree,
-	const struct GeoPoint* p, double eps,
-	GeoVertexVisitor visitor, void *ctx)
+// The box of the finite vertices of va. Returns 0 if there are none.
+static int vertex_extent(const struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va, struct GeoBoundingBox *extent)
 {
-	struct NodeList *visit_list =
-		find_visit_list(p, eps, &tree->bbox);
-	for (struct NodeList *n = visit_list; n != 0; n = n->next) {
-		int cont = visit_node(n->node, tree, p, eps, visitor, ctx);
-		if (0 == cont) {
-			NodeListDelete(visit_list);
-			return;
+	double min[3] = {INFINITY, INFINITY, INFINITY};
+	double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+	for (int i = 0; i < va->size; ++i) {
+		struct GeoPoint q = vertex_point(tree, va, i);
+		double p[3] = {q.x, q.y, q.z};
+		if (!isfinite(p[0]) || !isfinite(p[1]) || !isfinite(p[2])) {
+			continue;
+		}
+		for (int j = 0; j < 3; ++j) {
+			min[j] = fmin(min[j], p[j]);
+			max[j] = fmax(max[j], p[j]);
 		}
 	}
-	NodeListDelete(visit_list);
+	*extent = (struct GeoBoundingBox){
+		{min[0], min[1], min[2]}, {max[0], max[1], max[2]}};
+	return min[0] <= max[0];
 }
 
-
-struct DedupCtx {
-	int self;
-	int *vertices_to_delete;
-	int size;
-	int capacity;
+// The remapping of the hashes after some doublings of the box:
+// f(hash) = (prefix << 3 * (depth - levels)) | (hash >> 3 * levels). The
+// old box is the node prefix at level levels of the new one. levels stops
+// at depth; beyond that all old vertices are in the leaf prefix.
+struct BoxGrowth {
+	uint64_t prefix;
+	int levels;
 };
 
-static void DedupCtxInitialize(struct DedupCtx *ctx)
+// Doubles the box so that the old box becomes one of its octants, the
+// one on the side of extent. The octant digit has the x bit lowest like
+// the child keys.
+static void double_box(struct GeoBoundingBox *bbox,
+	const struct GeoBoundingBox *extent, int depth,
+	struct BoxGrowth *growth)
 {
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->capacity = 16;
-	ctx->vertices_to_delete = malloc(ctx->capacity * sizeof(int));
+	double *min[3] = {&bbox->min.x, &bbox->min.y, &bbox->min.z};
+	double *max[3] = {&bbox->max.x, &bbox->max.y, &bbox->max.z};
+	const double emin[3] = {extent->min.x, extent->min.y, extent->min.z};
+	uint64_t digit = 0;
+	for (int j = 0; j < 3; ++j) {
+		double length = *max[j] - *min[j];
+		if (emin[j] < *min[j]) {
+			*min[j] -= length;
+			digit |= 1u << j;
+		} else {
+			*max[j] += length;
+		}
+	}
+	if (growth->levels < depth) {
+		growth->prefix |= digit << (3 * growth->levels);
+		++growth->levels;
+	} else {
+		growth->prefix = (digit << (3 * (depth - 1))) |
+			(growth->prefix >> 3);
+	}
 }
 
-static void DedupCtxDestroy(struct DedupCtx *ctx)
+static int box_contains(const struct GeoBoundingBox *a,
+	const struct GeoBoundingBox *b)
 {
-	free(ctx->vertices_to_delete);
-	memset(ctx, 0, sizeof(*ctx));
+	return a->min.x <= b->min.x && b->max.x <= a->max.x &&
+		a->min.y <= b->min.y && b->max.y <= a->max.y &&
+		a->min.z <= b->min.z && b->max.z <= a->max.z;
 }
 
-static void DedupCtxPushBack(struct DedupCtx *ctx, int i)
+// Puts the vertices of run in the order of tags: position k gets the
+// vertex at tags[k].
+static void reorder(struct GeoHashedOctree *run, const uint32_t *tags)
 {
-	if (ctx->size == ctx->capacity) {
-		static const double growth_factor = 1.7;
-		ctx->capacity *= growth_factor;
-		ctx->vertices_to_delete = realloc(ctx->vertices_to_delete,
-			ctx->capacity * sizeof(int));
+	struct GeoVertexArray *va = &run->vertices;
+	int n = va->size;
+	struct GeoVertexArray temp_va;
+	GeoVAInitialize(&temp_va);
+	GeoVAResize(&temp_va, n);
+	uint64_t *removed = run->removed ?
+		calloc((n + 63) / 64, sizeof(*removed)) : 0;
+	for (int k = 0; k < n; ++k) {
+		uint32_t i = tags[k];
+		temp_va.x[k] = va->x[i];
+		temp_va.y[k] = va->y[i];
+		temp_va.z[k] = va->z[i];
+		temp_va.ptrs[k] = va->ptrs[i];
+		if (is_removed(run, i)) removed[k / 64] |= 1ull << (k % 64);
 	}
-	ctx->vertices_to_delete[ctx->size] = i;
-	++ctx->size;
+	GeoVASwap(&temp_va, va);
+	GeoVADestroy(&temp_va);
+	free(run->removed);
+	run->removed = removed;
 }
 
-static int DedupVisitor(struct GeoVertexArray* va, int i, void *ctx)
+// Morton keys keep their order under the remapping. Hilbert keys are
+// remapped through Morton keys; the orientation of the curve in the old
+// box changes so they are sorted again.
+static void remap_hashes(struct GeoHashedOctree *run,
+	const struct BoxGrowth *growth)
 {
-	(void)va;
-	struct DedupCtx *dedup_ctx = ctx;
-	if (i < dedup_ctx->self) {
-		DedupCtxPushBack(dedup_ctx, dedup_ctx->self);
-	        return 0;
+	int depth = run->depth;
+	int n = run->vertices.size;
+	int levels = growth->levels;
+	uint64_t high = growth->prefix << (3 * (depth - levels));
+	uint64_t marker = 1ull << (3 * depth);
+	for (int i = 0; i < n; ++i) {
+		uint64_t hash = run->hashes[i];
+		if (run->order == GEO_KEY_ORDER_HILBERT) {
+			hash = GeoNodeHilbertToMorton64(hash | marker) ^ marker;
+		}
+		hash = high | (hash >> (3 * levels));
+		if (run->order == GEO_KEY_ORDER_HILBERT) {
+			hash = GeoNodeMortonToHilbert64(hash | marker) ^ marker;
+		}
+		run->hashes[i] = hash;
 	}
-	return 1;
+	if (run->order == GEO_KEY_ORDER_HILBERT) {
+		uint32_t *tags = malloc(n * sizeof(*tags));
+		for (int i = 0; i < n; ++i) tags[i] = i;
+		GeoRadixSortPairs(run->hashes, tags, n, 3 * depth);
+		reorder(run, tags);
+		free(tags);
+	}
+	assert(hashes_are_sorted(run->hashes, n));
+	build_directory(run);
 }
 
-void GeoHODeleteDuplicates(struct GeoHashedOctree *tree, double eps,
-	GeoVertexDestructor dtor, void *ctx)
+// Doubles the box of the tree until it contains the vertices of va and
+// remaps the hashes of the stored vertices. Attached trees rehash all
+// vertices anyway so only their box is grown.
+static void grow_to_fit(struct GeoHashedOctree *tree,
+	const struct GeoVertexArray *va)
 {
-	struct DedupCtx dedup_ctx;
-	DedupCtxInitialize(&dedup_ctx);
-	for (int i = 0; i < tree->vertices.size; ++i) {
-		dedup_ctx.self = i;
-		struct GeoPoint p = {
-			tree->vertices.x[i],
-			tree->vertices.y[i],
-			tree->vertices.z[i]};
-		GeoHOVisitNearVertices(tree, &p, eps, DedupVisitor, &dedup_ctx);
-	}
-	char *deleted = calloc(tree->vertices.size, sizeof(*deleted));
-	for (int i = 0; i < dedup_ctx.size; ++i) {
-		int ii = dedup_ctx.vertices_to_delete[i];
-		if (dtor) dtor(tree->vertices.ptrs[ii], ctx);
-		tree->vertices.ptrs[ii] = 0;
-		deleted[ii] = 1;
-	}
-	int j = 0;
-	for (int i = 0; i < tree->vertices.size; ++i) {
-		if (0 == deleted[i]) {
-			tree->vertices.x[j] = tree->vertices.x[i];
-			tree->vertices.y[j] = tree->vertices.y[i];
-			tree->vertices.z[j] = tree->vertices.z[i];
-			tree->vertices.ptrs[j] = tree->vertices.ptrs[i];
-			++j;
-		}
+	struct GeoBoundingBox extent;
+	if (!vertex_extent(tree, va, &extent)) return;
+	struct GeoBoundingBox *bbox = &tree->bbox;
+	if (!(bbox->max.x > bbox->min.x && bbox->max.y > bbox->min.y &&
+	      bbox->max.z > bbox->min.z)) {
+		return;
 	}
-	tree->vertices.size = j;
-	free(deleted);
-	DedupCtxDestroy(&dedup_ctx);
+	struct BoxGrowth growth = {0, 0};
+	while (!box_contains(bbox, &extent)) {
+		double_box(bbox, &extent, tree->depth, &growth);
+	}
+	if (growth.levels == 0) return;
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		struct GeoHashedOctree *run = run_at(tree, r);
+		run->bbox = *bbox;
+		if (!tree->indices) remap_hashes(run, &growth);
+	}
+}
+
+void GeoHOCompact(struct GeoHashedOctree *tree)
+{
+	while (tree->num_runs > 0) merge_last_run(tree);
+	free(tree->runs);
+	tree->runs = 0;
+	purge_removed(tree);
 }
 
+// A query collects the hash ranges of the nodes it has to visit in a
+// fixed size buffer on the stack. Ranges that touch are merged as they
+// are added; nodes are found in Morton order so with Morton keys most
+// neighbouring nodes end up in a single range. When the buffer is full the
+// ranges collected so far are visited and the buffer is reused.
+// Batched queries collect the ranges of a group of queries without a
+// visitor; for those the ranges are moved to the heap when the buffer is
+// full.
+#define MAX_QUERY_RANGES 64
+
+struct KeyRange {
+	GeoSpatialHash64 begin;
+	GeoSpatialHash64 end;
+};
+
+// Box queries find the vertices within eps of p in each coordinate, ball
+// queries the ones within Euclidean distance eps.
+enum QueryShape {
+	QUERY_BOX,
+	QUERY_BALL
+};
+
+// Candidate vertices are filtered in blocks of FILTER_BLOCK. The
+// comparisons of a block are independent of each other and vectorize; the
+// hits are then compacted into a list of indices without branches so only
+// the visitor calls depend on the data.
+#define FILTER_BLOCK 64
+
+// The hits of a query go to a vertex visitor, one call per hit, or to a
+// block visitor. Hits are compacted into hits in either case; for block
+// visitors they are collected until there are at least FILTER_BLOCK of
+// them, so that a query with many hits makes few calls. The hits of
+// different runs are never handed over in the same block.
+struct HitSink {
+	GeoVertexVisitor *visitor;
+	GeoVertexBlockVisitor *block_visitor;
+	void *ctx;
+	struct GeoVertexArray *va;
+	int num_hits;
+	int hits[2 * FILTER_BLOCK];
+};
+
+static void HitSinkInitialize(struct HitSink *sink,
+	GeoVertexVisitor *visitor, GeoVertexBlockVisitor *block_visitor,
+	void *ctx)
+{
+	sink->visitor = visitor;
+	sink->block_visitor = block_visitor;
+	sink->ctx = ctx;
+	sink->va = 0;
+	sink->num_hits = 0;
+}
+
+// Where the next hits are compacted to. There is room for FILTER_BLOCK.
+static int *next_hits(struct HitSink *sink)
+{
+	return sink->hits + sink->num_hits;
+}
+
+// Hands the collected hits to the block visitor. Returns 0 if it asked to
+// stop.
+static int flush_hits(struct HitSink *sink)
+{
+	int n = sink->num_hits;
+	sink->num_hits = 0;
+	return n == 0 || sink->block_visitor(sink->va, sink->hits, n,
+		sink->ctx);
+}
+
+// Takes the n hits in va that were compacted to next_hits. Returns 0 if
+// the visitor asked to stop.
+static int commit_hits(struct HitSink *sink, struct GeoVertexArray *va,
+	int n)
+{
+	if (sink->visitor) {
+		for (int j = 0; j < n; ++j) {
+			if (0 == sink->visitor(va, sink->hits[j], sink->ctx)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	assert(sink->num_hits == 0 || sink->va == va);
+	sink->va = va;
+	sink->num_hits += n;
+	return sink->num_hits < FILTER_BLOCK || flush_hits(sink);
+}
+
+struct Query {
+	struct GeoHashedOctree *tree;
+	const struct GeoPoint *p;
+	double eps;
+	enum QueryShape shape;
+	struct HitSink *sink;
+	int cont;
+	// Nonzero if the ranges hold positions rather than hashes, see
+	// find_adaptive_nodes.
+	int positions;
+	int num_ranges;
+	int max_ranges;
+	struct KeyRange *ranges;
+	struct KeyRange buffer[MAX_QUERY_RANGES];
+};
+
+static void QueryInitialize(struct Query *query,
+	struct GeoHashedOctree *tree, const struct GeoPoint *p, double eps,
+	enum QueryShape shape, struct HitSink *sink)
+{
+	query->tree = tree;
+	query->p = p;
+	query->eps = eps;
+	query->shape = shape;
+	query->sink = sink;
+	query->cont = 1;
+	query->positions = 0;
+	query->num_ranges = 0;
+	query->max_ranges = MAX_QUERY_RANGES;
+	query->ranges = query->buffer;
+}
+
+static void QueryDestroy(struct Query *query)
+{
+	if (query->ranges != query->buffer) free(query->ranges);
+	query->ranges = 0;
+}
+
+static void grow_ranges(struct Query *query)
+{
+	int capacity = 2 * query->max_ranges;
+	struct KeyRange *ranges = malloc(capacity * sizeof(*ranges));
+	memcpy(ranges, query->ranges, query->num_ranges * sizeof(*ranges));
+	QueryDestroy(query);
+	query->ranges = ranges;
+	query->max_ranges = capacity;
+}
+
+static int boxes_overlap(
+	const struct GeoBoundingBox* a, const struct GeoBoundingBox* b)
+{
+	if (a->max.x >= b->min.x && b->max.x >= a->min.x &&
+	    a->max.y >= b->min.y && b->max.y >= a->min.y &&
+	    a->max.z >= b->min.z && b->max.z >= a->min.z) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static double volume(const struct GeoBoundingBox* bbox)
+{
+	return
+		(bbox->max.x - bbox->min.x) *
+		(bbox->max.y - bbox->min.y) *
+		(bbox->max.z - bbox->min.z);
+}
+
+// The key of a node in the order of the tree's hashes. Traversals start
+// from it and step down with curve_child, which also needs the Hilbert
+// state of the node.
+static GeoNodeKey64 curve_key(const struct GeoHashedOctree *tree,
+	GeoNodeKey64 node, int *state)
+{
+	*state = 0;
+	if (tree->order == GEO_KEY_ORDER_HILBERT) {
+		return GeoNodeMortonToHilbertState64(node, state);
+	}
+	return node;
+}
+
+// The curve key and the state of the child with Morton digit i.
+static inline GeoNodeKey64 curve_child(const struct GeoHashedOctree *tree,
+	GeoNodeKey64 curve_node, int state, int i, int *child_state)
+{
+	if (tree->order == GEO_KEY_ORDER_HILBERT) {
+		*child_state = GeoHilbertChildStates[state][i];
+		return (curve_node << 3) | GeoHilbertDigits[state][i];
+	}
+	*child_state = 0;
+	return (curve_node << 3) | i;
+}
+
+static void visit_ranges(struct Query *query);
+
+// Appends [begin, end) to the ranges of the query.
+static void add_range(struct Query *query, uint64_t begin, uint64_t end)
+{
+	if (query->num_ranges > 0) {
+		struct KeyRange *last = &query->ranges[query->num_ranges - 1];
+		if (last->end == begin) {
+			last->end = end;
+			return;
+		}
+	}
+	if (query->num_ranges == query->max_ranges) {
+		if (query->sink) {
+			visit_ranges(query);
+		} else {
+			grow_ranges(query);
+		}
+	}
+	struct KeyRange range = {begin, end};
+	query->ranges[query->num_ranges] = range;
+	++query->num_ranges;
+}
+
+// Adds the range of a node given by its curve key.
+static void add_node(struct Query *query, GeoNodeKey64 node)
+{
+	int shift = hash_shift(query->tree);
+	add_range(query, GeoNodeBegin64(node) >> shift,
+		GeoNodeEnd64(node) >> shift);
+}
+
+// Nodes are passed by their curve key and Hilbert state, see curve_child.
+static void find_overlapping_nodes(
+	GeoNodeKey64 curve_node, int state, const struct GeoBoundingBox *bbox,
+	const struct GeoBoundingBox *p_bbox, double eps_cubed,
+	struct Query *query)
+{
+	if (query->cont && boxes_overlap(p_bbox, bbox)) {
+		// Keep this node if we have reached the finest level or
+		// if the node is of comparable size to the bounding volume
+		// of the point (eps_cubed). Note that the exact termination
+		// criterion can be tuned. Choosing a tighter criterion leads to
+		// more (but smaller) nodes and rejects more candidate vertices.
+		// Choosing a looser criterion leads to fewer (but larger) nodes
+		// and rejects fewer vertices outright. The correctness of the
+		// algorithm is not affected.
+		struct GeoHashedOctree *tree = query->tree;
+		if (GeoNodeLevel64(curve_node) == tree->depth ||
+		    volume(bbox) < 8 * eps_cubed) {
+			add_node(query, curve_node);
+		} else {
+			struct GeoBoundingBox child_boxes[8];
+			GeoComputeChildBoxes(bbox, child_boxes);
+			for (int i = 0; i < 8; ++i) {
+				int child_state;
+				GeoNodeKey64 child = curve_child(tree,
+					curve_node, state, i, &child_state);
+				find_overlapping_nodes(child, child_state,
+					&child_boxes[i], p_bbox, eps_cubed,
+					query);
+			}
+		}
+	}
+}
+
+static uint32_t lower_bound(const uint64_t* arr, uint32_t n, uint64_t x)
+{
+	uint32_t l = 0;
+	uint32_t h = n;
+	while (l < h) {
+		uint32_t mid = (l + h) / 2;
+		if (x <= arr[mid]) {
+			h = mid;
+		} else {
+			l = mid + 1;
+		}
+	}
+	return l;
+}
+
+// The index of the first hash that is not less than x. Only the hashes
+// sharing the top bits of x are searched.
+static uint32_t find_hash(const struct GeoHashedOctree *tree,
+	GeoSpatialHash64 x)
+{
+	uint64_t b = x >> (3 * tree->depth - tree->directory_bits);
+	if (b >> tree->directory_bits) return tree->vertices.size;
+	uint32_t l = tree->directory[b];
+	return l + lower_bound(tree->hashes + l, tree->directory[b + 1] - l, x);
+}
+
+// The position of the first hash not less than x, given that it is in
+// [l, h]. Only the positions that are also in the directory bucket of x are
+// searched; in dense clusters a bucket holds many nodes so [l, h) is often
+// the tighter limit.
+static uint32_t find_hash_in(const struct GeoHashedOctree *tree,
+	GeoSpatialHash64 x, uint32_t l, uint32_t h)
+{
+	uint64_t b = x >> (3 * tree->depth - tree->directory_bits);
+	if (b >> tree->directory_bits) return h;
+	if (tree->directory[b] > l) l = tree->directory[b];
+	if (tree->directory[b + 1] < h) h = tree->directory[b + 1];
+	return l + lower_bound(tree->hashes + l, h - l, x);
+}
+
+// The children of a node split its positions [bounds[0], bounds[8]) into
+// eight consecutive ranges, one per octant digit in the order of the
+// curve. The bounds in between are searched when they are first needed.
+#define UNKNOWN_BOUND UINT32_MAX
+
+static uint32_t child_bound(const struct GeoHashedOctree *tree,
+	GeoNodeKey64 curve_node, int digit, uint32_t bounds[9])
+{
+	if (bounds[digit] == UNKNOWN_BOUND) {
+		GeoSpatialHash64 x = GeoNodeBegin64((curve_node << 3) | digit) >>
+			hash_shift(tree);
+		bounds[digit] = find_hash_in(tree, x, bounds[0], bounds[8]);
+	}
+	return bounds[digit];
+}
+
+static int no_larger(const struct GeoBoundingBox *a,
+	const struct GeoBoundingBox *b)
+{
+	return a->max.x - a->min.x <= b->max.x - b->min.x &&
+		a->max.y - a->min.y <= b->max.y - b->min.y &&
+		a->max.z - a->min.z <= b->max.z - b->min.z;
+}
+
+// Adaptive trees refine a node with vertices at positions [l, h) only
+// while it holds more than leaf_capacity vertices, is larger than the
+// query box and not inside of it. The positions of the children are
+// searched within those of the node and the ranges of the query hold
+// positions rather than hashes, so every node boundary is searched once.
+static void find_adaptive_nodes(
+	GeoNodeKey64 curve_node, int state, const struct GeoBoundingBox *bbox,
+	uint32_t l, uint32_t h, const struct GeoBoundingBox *p_bbox,
+	struct Query *query)
+{
+	if (!query->cont || l == h || !boxes_overlap(p_bbox, bbox)) return;
+	struct GeoHashedOctree *tree = query->tree;
+	if (GeoNodeLevel64(curve_node) == tree->depth ||
+	    h - l <= (uint32_t)tree->leaf_capacity ||
+	    no_larger(bbox, p_bbox) || box_contains(p_bbox, bbox)) {
+		add_range(query, l, h);
+		return;
+	}
+	uint32_t bounds[9];
+	for (int d = 0; d < 9; ++d) bounds[d] = UNKNOWN_BOUND;
+	bounds[0] = l;
+	bounds[8] = h;
+	struct GeoBoundingBox child_boxes[8];
+	GeoComputeChildBoxes(bbox, child_boxes);
+	for (int i = 0; i < 8; ++i) {
+		if (!boxes_overlap(p_bbox, &child_boxes[i])) continue;
+		int child_state;
+		GeoNodeKey64 child = curve_child(tree, curve_node, state, i,
+			&child_state);
+		int digit = (int)(child & 7);
+		uint32_t begin = child_bound(tree, curve_node, digit, bounds);
+		uint32_t end = child_bound(tree, curve_node, digit + 1, bounds);
+		find_adaptive_nodes(child, child_state, &child_boxes[i],
+			begin, end, p_bbox, query);
+	}
+}
+
+// Collects the ranges of the nodes overlapping p_bbox.
+static void find_visit_ranges(struct Query *query,
+	const struct GeoBoundingBox *p_bbox)
+{
+	double eps = query->eps;
+	struct GeoHashedOctree *tree = query->tree;
+	const struct GeoBoundingBox *bbox = &tree->bbox;
+	int depth = tree->depth;
+	GeoNodeKey64 node = GeoNodeSmallestContaining64(bbox, p_bbox);
+	int level = GeoNodeLevel64(node);
+	if (level > depth) node >>= 3 * (level - depth);
+	struct GeoBoundingBox smallest_bbox = GeoNodeBox64(node, bbox);
+	int state;
+	GeoNodeKey64 curve_node = curve_key(tree, node, &state);
+	query->positions = tree->leaf_capacity > 0;
+	if (query->positions) {
+		int shift = hash_shift(tree);
+		uint32_t l = find_hash(tree, GeoNodeBegin64(curve_node) >> shift);
+		uint32_t h = find_hash(tree, GeoNodeEnd64(curve_node) >> shift);
+		find_adaptive_nodes(curve_node, state, &smallest_bbox, l, h,
+			p_bbox, query);
+	} else {
+		find_overlapping_nodes(curve_node, state, &smallest_bbox,
+			p_bbox, eps * eps * eps, query);
+	}
+}
+
+static int vertex_is_near(int i, const struct GeoVertexArray *va,
+	const struct GeoPoint *p, double eps)
+{
+	if ((fabs(p->x - va->x[i]) <= eps) &&
+	    (fabs(p->y - va->y[i]) <= eps) &&
+	    (fabs(p->z - va->z[i]) <= eps)) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+// Points coords at the coordinates of the candidates [l, l + n) of run.
+// Attached trees read the coordinates through the permutation. They are
+// gathered first so that the comparisons vectorize as well; single
+// precision coordinates are converted on the way.
+static inline void gather_block(const struct GeoHashedOctree *run,
+	uint32_t l, int n, double gathered[3][FILTER_BLOCK],
+	const double *coords[3])
+{
+	const struct GeoVertexArray *va = &run->vertices;
+	const uint32_t *indices = run->indices;
+	coords[0] = gathered[0];
+	coords[1] = gathered[1];
+	coords[2] = gathered[2];
+	if (run->float_x) {
+		for (int j = 0; j < n; ++j) {
+			uint32_t i = indices[l + j];
+			gathered[0][j] = run->float_x[i];
+			gathered[1][j] = run->float_y[i];
+			gathered[2][j] = run->float_z[i];
+		}
+	} else if (indices) {
+		for (int j = 0; j < n; ++j) {
+			uint32_t i = indices[l + j];
+			gathered[0][j] = va->x[i];
+			gathered[1][j] = va->y[i];
+			gathered[2][j] = va->z[i];
+		}
+	} else {
+		coords[0] = va->x + l;
+		coords[1] = va->y + l;
+		coords[2] = va->z + l;
+	}
+}
+
+// Drops the removed candidates and compacts the indices of the others
+// that are marked in near into hits.
+static inline int compact_hits(const uint32_t *indices,
+	const uint64_t *removed, uint32_t l, int n, int *near, int *hits)
+{
+	if (removed) {
+		for (int j = 0; j < n; ++j) {
+			uint32_t k = l + j;
+			near[j] &= !((removed[k / 64] >> (k % 64)) & 1);
+		}
+	}
+	int num_hits = 0;
+	if (indices) {
+		for (int j = 0; j < n; ++j) {
+			hits[num_hits] = indices[l + j];
+			num_hits += near[j];
+		}
+	} else {
+		for (int j = 0; j < n; ++j) {
+			hits[num_hits] = l + j;
+			num_hits += near[j];
+		}
+	}
+	return num_hits;
+}
+
+#ifdef GEO_HAVE_FUNCTION_MULTI_DISPATH
+__attribute__((target_clones("avx512f","avx2","avx","sse4.2","default")))
+#endif
+static int filter_block(const struct GeoHashedOctree *run, uint32_t l,
+	int n, const struct GeoPoint *p, double eps, enum QueryShape shape,
+	int *hits)
+{
+	double gathered[3][FILTER_BLOCK];
+	const double *coords[3];
+	gather_block(run, l, n, gathered, coords);
+	const double *restrict x = coords[0];
+	const double *restrict y = coords[1];
+	const double *restrict z = coords[2];
+	double px = p->x;
+	double py = p->y;
+	double pz = p->z;
+	int near[FILTER_BLOCK];
+	if (shape == QUERY_BALL) {
+		double eps2 = eps * eps;
+		for (int j = 0; j < n; ++j) {
+			double dx = x[j] - px;
+			double dy = y[j] - py;
+			double dz = z[j] - pz;
+			near[j] = dx * dx + dy * dy + dz * dz <= eps2;
+		}
+	} else {
+		for (int j = 0; j < n; ++j) {
+			near[j] = (fabs(px - x[j]) <= eps) &
+				(fabs(py - y[j]) <= eps) &
+				(fabs(pz - z[j]) <= eps);
+		}
+	}
+	return compact_hits(run->indices, run->removed, l, n, near, hits);
+}
+
+#ifdef GEO_HAVE_FUNCTION_MULTI_DISPATH
+__attribute__((target_clones("avx512f","avx2","avx","sse4.2","default")))
+#endif
+static int filter_box_block(const struct GeoHashedOctree *run,
+	uint32_t l, int n, const struct GeoBoundingBox *box, int *hits)
+{
+	double gathered[3][FILTER_BLOCK];
+	const double *coords[3];
+	gather_block(run, l, n, gathered, coords);
+	const double *restrict x = coords[0];
+	const double *restrict y = coords[1];
+	const double *restrict z = coords[2];
+	struct GeoBoundingBox b = *box;
+	int near[FILTER_BLOCK];
+	for (int j = 0; j < n; ++j) {
+		near[j] = (x[j] >= b.min.x) & (x[j] <= b.max.x) &
+			(y[j] >= b.min.y) & (y[j] <= b.max.y) &
+			(z[j] >= b.min.z) & (z[j] <= b.max.z);
+	}
+	return compact_hits(run->indices, run->removed, l, n, near, hits);
+}
+
+// Visits the vertices of run in [l, h) that are near p and not removed.
+// Returns 0 if the visitor asked to stop.
+static int visit_near_in_range(struct GeoHashedOctree *run,
+	uint32_t l, uint32_t h, const struct GeoPoint *p, double eps,
+	enum QueryShape shape, struct HitSink *sink)
+{
+	struct GeoVertexArray *va = &run->vertices;
+	while (l != h) {
+		int n = h - l < FILTER_BLOCK ? h - l : FILTER_BLOCK;
+		int num_hits = filter_block(run, l, n, p, eps, shape,
+			next_hits(sink));
+		if (0 == commit_hits(sink, va, num_hits)) return 0;
+		l += n;
+	}
+	return 1;
+}
+
+// Visits the vertices of run in [l, h) that are inside box and not
+// removed.
+static int visit_in_box_range(struct GeoHashedOctree *run,
+	uint32_t l, uint32_t h, const struct GeoBoundingBox *box,
+	struct HitSink *sink)
+{
+	struct GeoVertexArray *va = &run->vertices;
+	while (l != h) {
+		int n = h - l < FILTER_BLOCK ? h - l : FILTER_BLOCK;
+		int num_hits = filter_box_block(run, l, n, box,
+			next_hits(sink));
+		if (0 == commit_hits(sink, va, num_hits)) return 0;
+		l += n;
+	}
+	return 1;
+}
+
+// Visits the vertices of run in [l, h) that are not removed.
+static int visit_all_in_range(struct GeoHashedOctree *run,
+	uint32_t l, uint32_t h, struct HitSink *sink)
+{
+	struct GeoVertexArray *va = &run->vertices;
+	while (l != h) {
+		int n = h - l < FILTER_BLOCK ? h - l : FILTER_BLOCK;
+		int *hits = next_hits(sink);
+		int num_hits = 0;
+		for (int j = 0; j < n; ++j) {
+			uint32_t k = l + j;
+			hits[num_hits] = run->indices ? (int)run->indices[k] :
+				(int)k;
+			num_hits += !is_removed(run, k);
+		}
+		if (0 == commit_hits(sink, va, num_hits)) return 0;
+		l += n;
+	}
+	return 1;
+}
+
+// Sorts the collected ranges and merges the ones that touch. In Hilbert
+// order the nodes aren't found in key order so this can merge more than
+// add_node does.
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct KeyRange *ra = a;
+	const struct KeyRange *rb = b;
+	return (ra->begin > rb->begin) - (ra->begin < rb->begin);
+}
+
+static void merge_ranges(struct Query *query)
+{
+	struct KeyRange *r = query->ranges;
+	int n = query->num_ranges;
+	if (n > MAX_QUERY_RANGES) qsort(r, n, sizeof(*r), compare_ranges);
+	for (int i = 1; i < n; ++i) {
+		struct KeyRange tmp = r[i];
+		int j = i;
+		for (; j > 0 && r[j - 1].begin > tmp.begin; --j) {
+			r[j] = r[j - 1];
+		}
+		r[j] = tmp;
+	}
+	int m = 0;
+	for (int i = 1; i < n; ++i) {
+		if (r[m].end == r[i].begin) {
+			r[m].end = r[i].end;
+		} else {
+			r[++m] = r[i];
+		}
+	}
+	query->num_ranges = n > 0 ? m + 1 : 0;
+}
+
+// Visits the vertices in the collected ranges and empties the buffer.
+static void visit_ranges(struct Query *query)
+{
+	merge_ranges(query);
+	struct GeoHashedOctree *tree = query->tree;
+	for (int r = 0; r < query->num_ranges && query->cont; ++r) {
+		struct KeyRange range = query->ranges[r];
+		uint32_t l = query->positions ? range.begin :
+			find_hash(tree, range.begin);
+		uint32_t h = query->positions ? range.end :
+			find_hash(tree, range.end);
+		query->cont = visit_near_in_range(tree, l, h, query->p,
+			query->eps, query->shape, query->sink);
+	}
+	query->num_ranges = 0;
+}
+
+// Queries a single run. Returns 0 if the visitor asked to stop.
+static int visit_run(struct GeoHashedOctree *run,
+	const struct GeoPoint* p, double eps, enum QueryShape shape,
+	struct HitSink *sink)
+{
+	struct Query query;
+	QueryInitialize(&query, run, p, eps, shape, sink);
+	struct GeoBoundingBox p_bbox = {
+		{ p->x - eps, p->y - eps, p->z - eps },
+		{ p->x + eps, p->y + eps, p->z + eps }};
+	find_visit_ranges(&query, &p_bbox);
+	visit_ranges(&query);
+	QueryDestroy(&query);
+	return query.cont && flush_hits(sink);
+}
+
+static void visit_near_vertices(struct GeoHashedOctree *tree,
+	const struct GeoPoint* p, double eps, enum QueryShape shape,
+	struct HitSink *sink)
+{
+	int cont = 1;
+	for (int r = 0; r <= tree->num_runs && cont; ++r) {
+		cont = visit_run(run_at(tree, r), p, eps, shape, sink);
+	}
+}
+
+void GeoHOVisitNearVertices(struct GeoHashedOctree *tree,
+	const struct GeoPoint* p, double eps,
+	GeoVertexVisitor visitor, void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, visitor, 0, ctx);
+	visit_near_vertices(tree, p, eps, QUERY_BOX, &sink);
+}
+
+void GeoHOVisitNearVertexBlocks(struct GeoHashedOctree *tree,
+	const struct GeoPoint* p, double eps,
+	GeoVertexBlockVisitor visitor, void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, 0, visitor, ctx);
+	visit_near_vertices(tree, p, eps, QUERY_BOX, &sink);
+}
+
+// The ball is looked up through its bounding box; the candidates are
+// filtered by distance.
+void GeoHOVisitVerticesInBall(struct GeoHashedOctree *tree,
+	const struct GeoPoint* p, double radius,
+	GeoVertexVisitor visitor, void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, visitor, 0, ctx);
+	visit_near_vertices(tree, p, radius, QUERY_BALL, &sink);
+}
+
+void GeoHOVisitVertexBlocksInBall(struct GeoHashedOctree *tree,
+	const struct GeoPoint* p, double radius,
+	GeoVertexBlockVisitor visitor, void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, 0, visitor, ctx);
+	visit_near_vertices(tree, p, radius, QUERY_BALL, &sink);
+}
+
+// The cells of a bounding box query along each axis at the depth of the
+// tree. Vertices in cells outside [outer_lo, outer_hi] are outside the
+// box and vertices in cells inside [inner_lo, inner_hi] are inside it.
+// Hashes remapped by a growing bounding box may be one cell off from
+// freshly computed ones, so both ranges leave a cell to spare.
+struct BoxCells {
+	int64_t outer_lo[3];
+	int64_t outer_hi[3];
+	int64_t inner_lo[3];
+	int64_t inner_hi[3];
+};
+
+static void box_cells(const struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box, struct BoxCells *cells)
+{
+	int max_depth = GeoNodeMaxDepth64();
+	GeoNodeKey64 leaf = 1ull << (3 * max_depth);
+	uint32_t lo[3];
+	uint32_t hi[3];
+	GeoNodeCoordinates64(GeoComputeHash64(&tree->bbox, &box->min) | leaf,
+		&lo[0], &lo[1], &lo[2]);
+	GeoNodeCoordinates64(GeoComputeHash64(&tree->bbox, &box->max) | leaf,
+		&hi[0], &hi[1], &hi[2]);
+	int shift = max_depth - tree->depth;
+	for (int k = 0; k < 3; ++k) {
+		cells->outer_lo[k] = (int64_t)(lo[k] >> shift) - 1;
+		cells->outer_hi[k] = (int64_t)(hi[k] >> shift) + 1;
+		cells->inner_lo[k] = (int64_t)(lo[k] >> shift) + 2;
+		cells->inner_hi[k] = (int64_t)(hi[k] >> shift) - 2;
+	}
+}
+
+enum BoxOverlap {
+	BOX_OUTSIDE,
+	BOX_INSIDE,
+	BOX_STRADDLES
+};
+
+static enum BoxOverlap box_overlap(const struct GeoHashedOctree *tree,
+	GeoNodeKey64 node, const struct BoxCells *cells)
+{
+	int shift = tree->depth - GeoNodeLevel64(node);
+	uint32_t c[3];
+	GeoNodeCoordinates64(node, &c[0], &c[1], &c[2]);
+	int inside = 1;
+	for (int k = 0; k < 3; ++k) {
+		int64_t lo = (int64_t)c[k] << shift;
+		int64_t hi = lo + (1ll << shift) - 1;
+		if (hi < cells->outer_lo[k] || lo > cells->outer_hi[k]) {
+			return BOX_OUTSIDE;
+		}
+		inside &= lo >= cells->inner_lo[k] && hi <= cells->inner_hi[k];
+	}
+	return inside ? BOX_INSIDE : BOX_STRADDLES;
+}
+
+// Visits the vertices inside the box of a node that straddles a face of
+// the box and whose vertices are at positions [l, h). This is a range
+// decomposition of the box along the curve: children whose cells are all
+// inside the box are visited without tests and children whose cells are
+// all outside are skipped without looking at their vertices. The positions
+// of the children are searched within those of the parent, so the gaps
+// between the ranges cost a short binary search rather than a scan. Every
+// range costs a search and cache misses at its start, about as much as
+// filtering a few hundred candidates in a row, so nodes are only split
+// while they hold more than BOX_SPLIT_SIZE vertices.
+#define BOX_SPLIT_SIZE 1024
+
+static int visit_box_node(struct GeoHashedOctree *run, GeoNodeKey64 node,
+	GeoNodeKey64 curve_node, int state, uint32_t l, uint32_t h,
+	const struct BoxCells *cells, const struct GeoBoundingBox *box,
+	struct HitSink *sink)
+{
+	if (GeoNodeLevel64(node) == run->depth || h - l <= BOX_SPLIT_SIZE) {
+		return visit_in_box_range(run, l, h, box, sink);
+	}
+	uint32_t bounds[9];
+	for (int d = 0; d < 9; ++d) bounds[d] = UNKNOWN_BOUND;
+	bounds[0] = l;
+	bounds[8] = h;
+	GeoNodeKey64 children[8];
+	GeoNodeComputeChildKeys64(node, children);
+	for (int i = 0; i < 8; ++i) {
+		enum BoxOverlap overlap = box_overlap(run, children[i], cells);
+		if (overlap == BOX_OUTSIDE) continue;
+		int child_state;
+		GeoNodeKey64 curve_child_node = curve_child(run, curve_node,
+			state, i, &child_state);
+		int digit = (int)(curve_child_node & 7);
+		uint32_t begin = child_bound(run, curve_node, digit, bounds);
+		uint32_t end = child_bound(run, curve_node, digit + 1, bounds);
+		int cont = 1;
+		if (begin == end) {
+			continue;
+		} else if (overlap == BOX_INSIDE) {
+			cont = visit_all_in_range(run, begin, end, sink);
+		} else {
+			cont = visit_box_node(run, children[i],
+				curve_child_node, child_state, begin, end,
+				cells, box, sink);
+		}
+		if (!cont) return 0;
+	}
+	return 1;
+}
+
+// Queries a single run with a bounding box. The decomposition starts at
+// the smallest node holding all candidate cells.
+static int visit_run_in_box(struct GeoHashedOctree *run,
+	const struct GeoBoundingBox *box, struct HitSink *sink)
+{
+	struct BoxCells cells;
+	box_cells(run, box, &cells);
+	int depth = run->depth;
+	int64_t lo[3];
+	int64_t hi[3];
+	for (int k = 0; k < 3; ++k) {
+		lo[k] = cells.outer_lo[k] > 0 ? cells.outer_lo[k] : 0;
+		hi[k] = cells.outer_hi[k] < (1ll << depth) - 1 ?
+			cells.outer_hi[k] : (1ll << depth) - 1;
+	}
+	int level = 0;
+	while (level < depth &&
+	       lo[0] >> (depth - level - 1) == hi[0] >> (depth - level - 1) &&
+	       lo[1] >> (depth - level - 1) == hi[1] >> (depth - level - 1) &&
+	       lo[2] >> (depth - level - 1) == hi[2] >> (depth - level - 1)) {
+		++level;
+	}
+	int shift = depth - level;
+	GeoNodeKey64 node = GeoNodeFromCoordinates64(level,
+		lo[0] >> shift, lo[1] >> shift, lo[2] >> shift);
+	int state;
+	GeoNodeKey64 curve_node = curve_key(run, node, &state);
+	int key_shift = hash_shift(run);
+	uint32_t begin = find_hash(run, GeoNodeBegin64(curve_node) >>
+		key_shift);
+	uint32_t end = find_hash(run, GeoNodeEnd64(curve_node) >>
+		key_shift);
+	if (begin == end) return 1;
+	int cont;
+	if (box_overlap(run, node, &cells) == BOX_INSIDE) {
+		cont = visit_all_in_range(run, begin, end, sink);
+	} else {
+		cont = visit_box_node(run, node, curve_node, state, begin, end,
+			&cells, box, sink);
+	}
+	return cont && flush_hits(sink);
+}
+
+static void visit_vertices_in_box(struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box, struct HitSink *sink)
+{
+	if (!(box->min.x <= box->max.x && box->min.y <= box->max.y &&
+	      box->min.z <= box->max.z)) {
+		return;
+	}
+	int cont = 1;
+	for (int r = 0; r <= tree->num_runs && cont; ++r) {
+		cont = visit_run_in_box(run_at(tree, r), box, sink);
+	}
+}
+
+void GeoHOVisitVerticesInBox(struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box, GeoVertexVisitor visitor, void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, visitor, 0, ctx);
+	visit_vertices_in_box(tree, box, &sink);
+}
+
+void GeoHOVisitVertexBlocksInBox(struct GeoHashedOctree *tree,
+	const struct GeoBoundingBox *box, GeoVertexBlockVisitor visitor,
+	void *ctx)
+{
+	struct HitSink sink;
+	HitSinkInitialize(&sink, 0, visitor, ctx);
+	visit_vertices_in_box(tree, box, &sink);
+}
+
+struct BatchVisitorCtx {
+	GeoBatchVertexVisitor *visitor;
+	void *ctx;
+	int query;
+};
+
+static int BatchVisitor(struct GeoVertexArray *va, int i, void *ctx)
+{
+	struct BatchVisitorCtx *batch_ctx = ctx;
+	return batch_ctx->visitor(va, batch_ctx->query, i, batch_ctx->ctx);
+}
+
+static int point_in_box(const struct GeoPoint *p,
+	const struct GeoBoundingBox *b)
+{
+	return p->x >= b->min.x && p->x <= b->max.x &&
+		p->y >= b->min.y && p->y <= b->max.y &&
+		p->z >= b->min.z && p->z <= b->max.z;
+}
+
+// The level at which the queries are grouped: the first one whose nodes
+// are no larger than eps, so the box shared by a group is at most 1.5
+// times as wide as the box of a single query.
+static int batch_level(const struct GeoHashedOctree *tree, double eps)
+{
+	const struct GeoBoundingBox *b = &tree->bbox;
+	double extent = fmax(b->max.x - b->min.x,
+		fmax(b->max.y - b->min.y, b->max.z - b->min.z));
+	int level = 0;
+	while (level < tree->depth && extent > eps) {
+		extent *= 0.5;
+		++level;
+	}
+	return level;
+}
+
+// Queries are sorted by their Morton hash at batch_level and processed in
+// groups that share a node at that level. The node ranges are computed
+// once per group for the node's box grown by eps, turned into index ranges
+// and scanned for every query of the group while they are in cache.
+// Groups of one query and queries outside of the tree's bounding box,
+// which aren't covered by their group's box, are answered one by one, in
+// sorted order.
+static void visit_run_batch(struct GeoHashedOctree *tree,
+	const struct GeoPoint *points, int n, double eps,
+	GeoBatchVertexVisitor visitor, void *ctx)
+{
+	if (n == 0) return;
+	int level = batch_level(tree, eps);
+	int shift = 3 * (GeoNodeMaxDepth64() - level);
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	uint32_t *tags = malloc(n * sizeof(*tags));
+	for (int q = 0; q < n; ++q) {
+		keys[q] = GeoComputeHash64(&tree->bbox, &points[q]) >> shift;
+		tags[q] = q;
+	}
+	GeoRadixSortPairs(keys, tags, n, 3 * level);
+
+	struct Query query;
+	QueryInitialize(&query, tree, 0, eps, QUERY_BOX, 0);
+	struct HitSink sink;
+	for (int g = 0; g < n;) {
+		int g_end = g + 1;
+		while (g_end < n && keys[g_end] == keys[g]) ++g_end;
+		if (g_end - g == 1) {
+			// The grown box of a group doesn't pay off for a
+			// single query.
+			struct BatchVisitorCtx batch_ctx = {visitor, ctx, tags[g]};
+			HitSinkInitialize(&sink, BatchVisitor, 0, &batch_ctx);
+			visit_run(tree, &points[tags[g]], eps, QUERY_BOX, &sink);
+			g = g_end;
+			continue;
+		}
+
+		GeoNodeKey64 node = keys[g] | (1ull << (3 * level));
+		struct GeoBoundingBox group_bbox = GeoNodeBox64(node, &tree->bbox);
+		// Slightly more than eps so that rounding differences between
+		// the hash and the node box can't leave out a node.
+		double grow = eps +
+			1.0e-9 * (group_bbox.max.x - group_bbox.min.x +
+				group_bbox.max.y - group_bbox.min.y +
+				group_bbox.max.z - group_bbox.min.z);
+		group_bbox.min.x -= grow;
+		group_bbox.min.y -= grow;
+		group_bbox.min.z -= grow;
+		group_bbox.max.x += grow;
+		group_bbox.max.y += grow;
+		group_bbox.max.z += grow;
+		query.num_ranges = 0;
+		find_visit_ranges(&query, &group_bbox);
+		merge_ranges(&query);
+		// Replace the hash ranges by index ranges.
+		for (int r = 0; r < query.num_ranges && !query.positions; ++r) {
+			query.ranges[r].begin =
+				find_hash(tree, query.ranges[r].begin);
+			query.ranges[r].end = find_hash(tree, query.ranges[r].end);
+		}
+
+		for (int t = g; t < g_end; ++t) {
+			int q = tags[t];
+			const struct GeoPoint *p = &points[q];
+			if (!point_in_box(p, &tree->bbox)) {
+				struct BatchVisitorCtx batch_ctx = {
+					visitor, ctx, q};
+				HitSinkInitialize(&sink, BatchVisitor, 0,
+					&batch_ctx);
+				visit_run(tree, p, eps, QUERY_BOX, &sink);
+				continue;
+			}
+			struct BatchVisitorCtx batch_ctx = {visitor, ctx, q};
+			HitSinkInitialize(&sink, BatchVisitor, 0, &batch_ctx);
+			int cont = 1;
+			for (int r = 0; r < query.num_ranges && cont; ++r) {
+				cont = visit_near_in_range(tree,
+					query.ranges[r].begin,
+					query.ranges[r].end, p, eps, QUERY_BOX,
+					&sink);
+			}
+		}
+		g = g_end;
+	}
+	QueryDestroy(&query);
+	free(tags);
+	free(keys);
+}
+
+// Remembers which queries have been stopped so that the later runs skip
+// them.
+struct RunBatchCtx {
+	GeoBatchVertexVisitor *visitor;
+	void *ctx;
+	char *stopped;
+};
+
+static int RunBatchVisitor(struct GeoVertexArray *va, int query, int i,
+	void *ctx)
+{
+	struct RunBatchCtx *run_ctx = ctx;
+	if (run_ctx->stopped[query]) return 0;
+	if (0 == run_ctx->visitor(va, query, i, run_ctx->ctx)) {
+		run_ctx->stopped[query] = 1;
+		return 0;
+	}
+	return 1;
+}
+
+void GeoHOVisitNearVerticesBatch(struct GeoHashedOctree *tree,
+	const struct GeoPoint *points, int n, double eps,
+	GeoBatchVertexVisitor visitor, void *ctx)
+{
+	if (tree->num_runs == 0) {
+		visit_run_batch(tree, points, n, eps, visitor, ctx);
+		return;
+	}
+	struct RunBatchCtx run_ctx = {visitor, ctx, calloc(n, 1)};
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		visit_run_batch(run_at(tree, r), points, n, eps,
+			RunBatchVisitor, &run_ctx);
+	}
+	free(run_ctx.stopped);
+}
+
+
+// The k nearest vertices are kept in a max-heap ordered by squared
+// distance and index so that the result doesn't depend on the order in
+// which vertices are found. The heap lives in the output arrays.
+struct NearestHeap {
+	int *indices;
+	double *dist2;
+	int size;
+	int k;
+};
+
+static int nearer(double d1, int i1, double d2, int i2)
+{
+	return d1 < d2 || (d1 == d2 && i1 < i2);
+}
+
+static void heap_swap(struct NearestHeap *heap, int a, int b)
+{
+	double d = heap->dist2[a];
+	heap->dist2[a] = heap->dist2[b];
+	heap->dist2[b] = d;
+	int i = heap->indices[a];
+	heap->indices[a] = heap->indices[b];
+	heap->indices[b] = i;
+}
+
+static void heap_sift_down(struct NearestHeap *heap, int pos, int size)
+{
+	for (;;) {
+		int largest = pos;
+		for (int child = 2 * pos + 1; child <= 2 * pos + 2; ++child) {
+			if (child < size && nearer(
+				heap->dist2[largest], heap->indices[largest],
+				heap->dist2[child], heap->indices[child])) {
+				largest = child;
+			}
+		}
+		if (largest == pos) return;
+		heap_swap(heap, pos, largest);
+		pos = largest;
+	}
+}
+
+static void heap_push(struct NearestHeap *heap, double dist2, int i)
+{
+	if (heap->size < heap->k) {
+		int pos = heap->size++;
+		heap->dist2[pos] = dist2;
+		heap->indices[pos] = i;
+		while (pos > 0) {
+			int parent = (pos - 1) / 2;
+			if (!nearer(heap->dist2[parent], heap->indices[parent],
+				dist2, i)) break;
+			heap_swap(heap, pos, parent);
+			pos = parent;
+		}
+	} else if (nearer(dist2, i, heap->dist2[0], heap->indices[0])) {
+		heap->dist2[0] = dist2;
+		heap->indices[0] = i;
+		heap_sift_down(heap, 0, heap->size);
+	}
+}
+
+// Sorts the heap in ascending order.
+static void heap_sort(struct NearestHeap *heap)
+{
+	for (int size = heap->size; size > 1; --size) {
+		heap_swap(heap, 0, size - 1);
+		heap_sift_down(heap, 0, size - 1);
+	}
+}
+
+// The level of the cells that the search expands through. Cells at this
+// level hold about k vertices if the vertices are spread evenly.
+static int nearest_level(const struct GeoHashedOctree *tree, int k)
+{
+	int level = 0;
+	double vertices_per_cell = GeoHONumVertices(tree);
+	while (level < tree->depth && vertices_per_cell / 8 >= k) {
+		vertices_per_cell /= 8;
+		++level;
+	}
+	return level;
+}
+
+static void scan_cell(struct GeoHashedOctree *tree, int level,
+	const uint32_t cell[3], const double p[3], struct NearestHeap *heap)
+{
+	int state;
+	GeoNodeKey64 node = curve_key(tree, GeoNodeFromCoordinates64(level,
+		cell[0], cell[1], cell[2]), &state);
+	int shift = hash_shift(tree);
+	int offset = 0;
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		struct GeoHashedOctree *run = run_at(tree, r);
+		struct GeoVertexArray *va = &run->vertices;
+		uint32_t l = find_hash(run, GeoNodeBegin64(node) >> shift);
+		uint32_t h = find_hash(run, GeoNodeEnd64(node) >> shift);
+		for (uint32_t k = l; k < h; ++k) {
+			if (is_removed(run, k)) continue;
+			uint32_t i = run->indices ? run->indices[k] : k;
+			struct GeoPoint q = vertex_point(run, va, i);
+			double dx = q.x - p[0];
+			double dy = q.y - p[1];
+			double dz = q.z - p[2];
+			heap_push(heap, dx * dx + dy * dy + dz * dz,
+				offset + i);
+		}
+		offset += va->size;
+	}
+}
+
+// Visits the cells at nearest_level in rings of growing Chebyshev
+// distance around the cell of p. Vertices outside of the bounding box are
+// stored in the cells of their projection onto the box, so with q the
+// projection of p every vertex outside of the cells visited so far is at
+// least as far from p as the distance from q to the boundary of the
+// visited block. The search stops once the k-th nearest vertex is closer
+// than that. Cells of a ring that are farther away than the current k-th
+// nearest vertex are skipped.
+int GeoHOFindKNearest(struct GeoHashedOctree *tree, const struct GeoPoint *p,
+	int k, int *indices, double *dist2)
+{
+	struct NearestHeap heap = {indices, dist2, 0, k};
+	if (k <= 0 || GeoHONumVertices(tree) == 0) return 0;
+	int level = nearest_level(tree, k);
+	int64_t num_cells = 1ll << level;
+	const struct GeoBoundingBox *b = &tree->bbox;
+	double min[3] = {b->min.x, b->min.y, b->min.z};
+	double max[3] = {b->max.x, b->max.y, b->max.z};
+	double pp[3] = {p->x, p->y, p->z};
+	double q[3];
+	double h[3];
+	int64_t c[3];
+	double slack = 0.0;
+	for (int i = 0; i < 3; ++i) {
+		h[i] = (max[i] - min[i]) / num_cells;
+		q[i] = fmin(fmax(pp[i], min[i]), max[i]);
+		c[i] = (int64_t)((q[i] - min[i]) / h[i]);
+		if (c[i] > num_cells - 1) c[i] = num_cells - 1;
+		// Vertices within rounding error of a cell boundary may
+		// have been hashed into the cell on the other side.
+		slack = fmax(slack, 1.0e-9 * h[i]);
+	}
+
+	for (int64_t r = 0;; ++r) {
+		for (int64_t dz = -r; dz <= r; ++dz) {
+			int64_t z = c[2] + dz;
+			if (z < 0 || z >= num_cells) continue;
+			for (int64_t dy = -r; dy <= r; ++dy) {
+				int64_t y = c[1] + dy;
+				if (y < 0 || y >= num_cells) continue;
+				int64_t step = (dz == -r || dz == r ||
+					dy == -r || dy == r) ? 1 : 2 * r;
+				for (int64_t dx = -r; dx <= r; dx += step) {
+					int64_t x = c[0] + dx;
+					if (x < 0 || x >= num_cells) continue;
+					int64_t cell[3] = {x, y, z};
+					double d2 = 0.0;
+					for (int i = 0; i < 3; ++i) {
+						double lo = min[i] + cell[i] * h[i];
+						double d = fmax(fmax(lo - q[i],
+							q[i] - lo - h[i]), 0.0);
+						d = fmax(d - slack, 0.0);
+						d2 += d * d;
+					}
+					if (heap.size == k && d2 > heap.dist2[0]) {
+						continue;
+					}
+					uint32_t ucell[3] = {x, y, z};
+					scan_cell(tree, level, ucell, pp, &heap);
+				}
+			}
+		}
+
+		double bound = INFINITY;
+		for (int i = 0; i < 3; ++i) {
+			if (c[i] - r > 0) {
+				bound = fmin(bound,
+					q[i] - (min[i] + (c[i] - r) * h[i]));
+			}
+			if (c[i] + r < num_cells - 1) {
+				bound = fmin(bound,
+					min[i] + (c[i] + r + 1) * h[i] - q[i]);
+			}
+		}
+		if (bound == INFINITY) break;
+		bound = fmax(bound - slack, 0.0);
+		if (heap.size == k && heap.dist2[0] <= bound * bound) break;
+	}
+	heap_sort(&heap);
+	return heap.size;
+}
+
+// Like GeoHOVisitNearVerticesBatch the queries are answered in the order
+// of their Morton hashes to keep consecutive queries close in the tree.
+int GeoHOFindKNearestBatch(struct GeoHashedOctree *tree,
+	const struct GeoPoint *points, int n, int k,
+	int *indices, double *dist2)
+{
+	if (k <= 0 || GeoHONumVertices(tree) == 0) return 0;
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	uint32_t *tags = malloc(n * sizeof(*tags));
+	int shift = hash_shift(tree);
+	for (int q = 0; q < n; ++q) {
+		keys[q] = GeoComputeHash64(&tree->bbox, &points[q]) >> shift;
+		tags[q] = q;
+	}
+	GeoRadixSortPairs(keys, tags, n, 3 * tree->depth);
+	int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_DEDUP_SIZE);
+	int num_found = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 256) if (num_chunks > 1) \
+	reduction(max:num_found)
+#endif
+	for (int t = 0; t < n; ++t) {
+		int q = tags[t];
+		int found = GeoHOFindKNearest(tree, &points[q], k,
+			indices + (int64_t)q * k, dist2 + (int64_t)q * k);
+		if (found > num_found) num_found = found;
+	}
+	free(tags);
+	free(keys);
+	return num_found;
+}
+
+struct DedupCtx {
+	int self;
+	int is_duplicate;
+};
+
+static int DedupVisitor(struct GeoVertexArray* va, int i, void *ctx)
+{
+	(void)va;
+	struct DedupCtx *dedup_ctx = ctx;
+	if (i < dedup_ctx->self) {
+		dedup_ctx->is_duplicate = 1;
+		return 0;
+	}
+	return 1;
+}
+
+// Moves the vertices that aren't deleted to the front, keeping their
+// order. Every chunk counts its survivors, the counts give each chunk its
+// offset in new arrays and the chunks are copied in parallel.
+static void compact(struct GeoHashedOctree *tree, const char *deleted)
+{
+	struct GeoVertexArray *va = &tree->vertices;
+	int n = va->size;
+	int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_INSERT_SIZE);
+	int *offsets = malloc((num_chunks + 1) * sizeof(*offsets));
+	offsets[0] = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int t = 0; t < num_chunks; ++t) {
+		int count = 0;
+		int end = chunk_begin(n, t + 1, num_chunks);
+		for (int i = chunk_begin(n, t, num_chunks); i < end; ++i) {
+			count += !deleted[i];
+		}
+		offsets[t + 1] = count;
+	}
+	for (int t = 0; t < num_chunks; ++t) {
+		offsets[t + 1] += offsets[t];
+	}
+
+	struct GeoVertexArray temp_va;
+	GeoVAInitialize(&temp_va);
+	GeoVAResize(&temp_va, offsets[num_chunks]);
+	GeoSpatialHash64 *temp_hashes =
+		malloc(offsets[num_chunks] * sizeof(*temp_hashes));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+	for (int t = 0; t < num_chunks; ++t) {
+		int j = offsets[t];
+		int end = chunk_begin(n, t + 1, num_chunks);
+		for (int i = chunk_begin(n, t, num_chunks); i < end; ++i) {
+			if (deleted[i]) continue;
+			temp_hashes[j] = tree->hashes[i];
+			temp_va.x[j] = va->x[i];
+			temp_va.y[j] = va->y[i];
+			temp_va.z[j] = va->z[i];
+			temp_va.ptrs[j] = va->ptrs[i];
+			++j;
+		}
+	}
+
+	free(tree->hashes);
+	tree->hashes = temp_hashes;
+	GeoVASwap(&temp_va, va);
+	GeoVADestroy(&temp_va);
+	free(offsets);
+	build_directory(tree);
+}
+
+static void purge_removed(struct GeoHashedOctree *tree)
+{
+	if (tree->num_removed == 0) return;
+	int n = tree->vertices.size;
+	char *deleted = malloc(n * sizeof(*deleted));
+	for (int i = 0; i < n; ++i) deleted[i] = is_removed(tree, i);
+	compact(tree, deleted);
+	free(deleted);
+	free(tree->removed);
+	tree->removed = 0;
+	tree->num_removed = 0;
+}
+
+static void mark_removed(struct GeoHashedOctree *run, int i)
+{
+	if (!run->removed) {
+		run->removed = calloc((run->vertices.size + 63) / 64,
+			sizeof(*run->removed));
+	}
+	if (!is_removed(run, i)) {
+		run->removed[i / 64] |= 1ull << (i % 64);
+		++run->num_removed;
+	}
+}
+
+// Removal only sets bits until the removed vertices make up more than
+// max_removed_ratio of the stored ones. Then every run is compacted on
+// its own; the runs aren't merged.
+static void purge_if_needed(struct GeoHashedOctree *tree)
+{
+	int num_removed = 0;
+	int num_stored = 0;
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		num_removed += run_at(tree, r)->num_removed;
+		num_stored += run_at(tree, r)->vertices.size;
+	}
+	if (num_removed > tree->max_removed_ratio * num_stored) {
+		for (int r = 0; r <= tree->num_runs; ++r) {
+			purge_removed(run_at(tree, r));
+		}
+	}
+}
+
+void GeoHORemove(struct GeoHashedOctree *tree, const int *indices, int n)
+{
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	for (int k = 0; k < n; ++k) {
+		int i = indices[k];
+		assert(i >= 0 && i < GeoHONumStoredVertices(tree));
+		struct GeoHashedOctree *run = locate_run(tree, &i);
+		mark_removed(run, i);
+	}
+	purge_if_needed(tree);
+}
+
+void GeoHORemoveIf(struct GeoHashedOctree *tree,
+	GeoVertexPredicate predicate, void *ctx)
+{
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	for (int r = 0; r <= tree->num_runs; ++r) {
+		struct GeoHashedOctree *run = run_at(tree, r);
+		for (int i = 0; i < run->vertices.size; ++i) {
+			if (is_removed(run, i)) continue;
+			if (predicate(&run->vertices, i, ctx)) {
+				mark_removed(run, i);
+			}
+		}
+	}
+	purge_if_needed(tree);
+}
+
+void GeoHOSetMaxRemovedRatio(struct GeoHashedOctree *tree, double ratio)
+{
+	tree->max_removed_ratio = ratio;
+}
+
+// Grid used by GEO_DEDUP_GRID. Vertices are binned into cubic cells that
+// are at least 2 eps wide. The eps box around a vertex then overlaps at
+// most two cells along each axis: its own cell and the neighbour on the
+// side of the half it lies in. So only 8 of the 27 surrounding cells are
+// looked up. The cells are found with an open addressing table of cell
+// ids. The vertices of every cell are stored contiguously in ascending
+// order.
+struct DedupGrid {
+	double origin[3];
+	double inv_cell_size;
+	int num_cells;
+	int64_t *cell_coords;
+	int *cell_begin;
+	int *members;
+	int *slots;
+	uint64_t slot_mask;
+};
+
+// Computes the cell of p and, for every axis, the direction of the
+// neighbouring cell that the eps box around p can reach. p must be finite.
+// Trees that don't grow their box accept vertices far outside of it, so
+// the cell coordinates are clamped to keep c + side representable; the
+// vertices beyond the clamp share the outermost cells and are still
+// compared with each other.
+#define MAX_GRID_COORD 0x1p62
+
+static void grid_cell(const struct DedupGrid *grid, const double p[3],
+	int64_t c[3], int side[3])
+{
+	for (int i = 0; i < 3; ++i) {
+		double t = (p[i] - grid->origin[i]) * grid->inv_cell_size;
+		t = fmin(fmax(t, -MAX_GRID_COORD), MAX_GRID_COORD);
+		double f = floor(t);
+		c[i] = (int64_t)f;
+		side[i] = (t - f < 0.5) ? -1 : 1;
+	}
+}
+
+// The low 7 bits of the cell coordinates are interleaved so that nearby
+// cells land in nearby slots; the vertices are visited in tree order so
+// consecutive lookups then hit the same cache lines. The remaining bits
+// are hashed to spread the blocks of 128**3 cells over the table.
+static uint64_t grid_slot(const struct DedupGrid *grid, const int64_t c[3])
+{
+	uint64_t low = 0;
+	for (int b = 0; b < 7; ++b) {
+		low |= (((uint64_t)c[0] >> b) & 1) << (3 * b);
+		low |= (((uint64_t)c[1] >> b) & 1) << (3 * b + 1);
+		low |= (((uint64_t)c[2] >> b) & 1) << (3 * b + 2);
+	}
+	uint64_t h = ((uint64_t)c[0] >> 7) * 0x9e3779b97f4a7c15ull;
+	h ^= ((uint64_t)c[1] >> 7) * 0xc2b2ae3d27d4eb4full;
+	h ^= ((uint64_t)c[2] >> 7) * 0x165667b19e3779f9ull;
+	h ^= h >> 29;
+	return (h + low) & grid->slot_mask;
+}
+
+// Returns the id of the cell or -1 if it has no vertices.
+static int grid_lookup(const struct DedupGrid *grid, const int64_t c[3])
+{
+	uint64_t slot = grid_slot(grid, c);
+	while (grid->slots[slot] >= 0) {
+		int id = grid->slots[slot];
+		const int64_t *cc = grid->cell_coords + 3 * id;
+		if (cc[0] == c[0] && cc[1] == c[1] && cc[2] == c[2]) return id;
+		slot = (slot + 1) & grid->slot_mask;
+	}
+	return -1;
+}
+
+static int point_is_finite(const double p[3])
+{
+	return isfinite(p[0]) && isfinite(p[1]) && isfinite(p[2]);
+}
+
+static void DedupGridInitialize(struct DedupGrid *grid,
+	const struct GeoHashedOctree *tree, double eps)
+{
+	const struct GeoVertexArray *va = &tree->vertices;
+	int n = va->size;
+	grid->origin[0] = tree->bbox.min.x;
+	grid->origin[1] = tree->bbox.min.y;
+	grid->origin[2] = tree->bbox.min.z;
+	// Exact duplicates (eps == 0) still need a cell size. The cells are
+	// slightly wider than 2 eps so that rounding in grid_cell can't pick
+	// the wrong neighbour for vertices close to the middle of a cell.
+	double extent = fmax(tree->bbox.max.x - tree->bbox.min.x,
+		fmax(tree->bbox.max.y - tree->bbox.min.y,
+			tree->bbox.max.z - tree->bbox.min.z));
+	double cell_size = fmax(2 * eps, extent * 0x1p-30) * (1.0 + 1.0e-6);
+	grid->inv_cell_size = 1.0 / cell_size;
+
+	uint64_t num_slots = 16;
+	while (num_slots < 2 * (uint64_t)n) num_slots *= 2;
+	grid->slot_mask = num_slots - 1;
+	grid->slots = malloc(num_slots * sizeof(*grid->slots));
+	memset(grid->slots, 0xff, num_slots * sizeof(*grid->slots));
+	grid->cell_coords = malloc(3 * (size_t)n * sizeof(*grid->cell_coords));
+	grid->cell_begin = calloc((size_t)n + 1, sizeof(*grid->cell_begin));
+	grid->members = malloc((size_t)n * sizeof(*grid->members));
+	int *vertex_cell = malloc((size_t)n * sizeof(*vertex_cell));
+
+	// Non-finite vertices are in no cell. They aren't near any vertex so
+	// they are never deleted, just as in tree mode.
+	grid->num_cells = 0;
+	for (int i = 0; i < n; ++i) {
+		double p[3] = {va->x[i], va->y[i], va->z[i]};
+		if (!point_is_finite(p)) {
+			vertex_cell[i] = -1;
+			continue;
+		}
+		int64_t c[3];
+		int side[3];
+		grid_cell(grid, p, c, side);
+		uint64_t slot = grid_slot(grid, c);
+		int id;
+		for (;;) {
+			id = grid->slots[slot];
+			if (id < 0) {
+				id = grid->num_cells++;
+				memcpy(grid->cell_coords + 3 * id, c, sizeof(c));
+				grid->slots[slot] = id;
+				break;
+			}
+			const int64_t *cc = grid->cell_coords + 3 * id;
+			if (cc[0] == c[0] && cc[1] == c[1] && cc[2] == c[2]) break;
+			slot = (slot + 1) & grid->slot_mask;
+		}
+		vertex_cell[i] = id;
+		++grid->cell_begin[id + 1];
+	}
+	for (int id = 0; id < grid->num_cells; ++id) {
+		grid->cell_begin[id + 1] += grid->cell_begin[id];
+	}
+	int *fill = malloc(((size_t)grid->num_cells + 1) * sizeof(*fill));
+	memcpy(fill, grid->cell_begin, grid->num_cells * sizeof(*fill));
+	for (int i = 0; i < n; ++i) {
+		if (vertex_cell[i] >= 0) grid->members[fill[vertex_cell[i]]++] = i;
+	}
+	free(fill);
+	free(vertex_cell);
+}
+
+static void DedupGridDestroy(struct DedupGrid *grid)
+{
+	free(grid->cell_coords);
+	free(grid->cell_begin);
+	free(grid->members);
+	free(grid->slots);
+	memset(grid, 0, sizeof(*grid));
+}
+
+static int grid_has_earlier_neighbour(const struct DedupGrid *grid,
+	const struct GeoVertexArray *va, int i, double eps)
+{
+	struct GeoPoint p = {va->x[i], va->y[i], va->z[i]};
+	double pp[3] = {p.x, p.y, p.z};
+	if (!point_is_finite(pp)) return 0;
+	int64_t c[3];
+	int side[3];
+	grid_cell(grid, pp, c, side);
+	for (int m = 0; m < 8; ++m) {
+		int64_t nc[3] = {
+			c[0] + ((m & 1) ? side[0] : 0),
+			c[1] + ((m & 2) ? side[1] : 0),
+			c[2] + ((m & 4) ? side[2] : 0)};
+		int id = grid_lookup(grid, nc);
+		if (id < 0) continue;
+		int end = grid->cell_begin[id + 1];
+		for (int k = grid->cell_begin[id]; k < end; ++k) {
+			int j = grid->members[k];
+			if (j >= i) break;
+			if (vertex_is_near(j, va, &p, eps)) return 1;
+		}
+	}
+	return 0;
+}
+
+static int tree_has_earlier_neighbour(struct GeoHashedOctree *tree, int i,
+	double eps)
+{
+	struct DedupCtx dedup_ctx = {i, 0};
+	struct GeoPoint p = {
+		tree->vertices.x[i],
+		tree->vertices.y[i],
+		tree->vertices.z[i]};
+	GeoHOVisitNearVertices(tree, &p, eps, DedupVisitor, &dedup_ctx);
+	return dedup_ctx.is_duplicate;
+}
+
+void GeoHODeleteDuplicates(struct GeoHashedOctree *tree, double eps,
+	GeoVertexDestructor dtor, void *ctx)
+{
+	GeoHODeleteDuplicatesWithMode(tree, eps, GEO_DEDUP_TREE, dtor, ctx);
+}
+
+// A vertex is deleted if a vertex with a lower index is within eps. The
+// search only reads the tree or the grid so every vertex can be decided on
+// its own which makes the result independent of the number of threads.
+void GeoHODeleteDuplicatesWithMode(struct GeoHashedOctree *tree,
+	double eps, enum GeoDedupMode mode,
+	GeoVertexDestructor dtor, void *ctx)
+{
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	GeoHOCompact(tree);
+	int n = tree->vertices.size;
+	if (n == 0) return;
+	struct DedupGrid grid;
+	if (mode == GEO_DEDUP_GRID) DedupGridInitialize(&grid, tree, eps);
+	char *deleted = malloc(n * sizeof(*deleted));
+	int num_chunks = num_parallel_chunks(n, MIN_PARALLEL_DEDUP_SIZE);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024) if (num_chunks > 1)
+#endif
+	for (int i = 0; i < n; ++i) {
+		if (mode == GEO_DEDUP_GRID) {
+			deleted[i] = grid_has_earlier_neighbour(&grid,
+				&tree->vertices, i, eps);
+		} else {
+			deleted[i] = tree_has_earlier_neighbour(tree, i, eps);
+		}
+	}
+	if (mode == GEO_DEDUP_GRID) DedupGridDestroy(&grid);
+	if (dtor) {
+		for (int i = 0; i < n; ++i) {
+			if (deleted[i]) dtor(tree->vertices.ptrs[i], ctx);
+		}
+	}
+	compact(tree, deleted);
+	free(deleted);
+}
+
+// The destructor is called with the tags; TagDtor passes on the saved
+// ptrs.
+struct TagDtorCtx {
+	void **ptrs;
+	GeoVertexDestructor *dtor;
+	void *ctx;
+};
+
+static void TagDtor(void *ptr, void *ctx)
+{
+	struct TagDtorCtx *tag_ctx = ctx;
+	tag_ctx->dtor(tag_ctx->ptrs[(uintptr_t)ptr], tag_ctx->ctx);
+}
+
+void GeoHODeleteDuplicatesWithPermutation(struct GeoHashedOctree *tree,
+	double eps, enum GeoDedupMode mode,
+	GeoVertexDestructor dtor, void *ctx, int *permutation)
+{
+	assert(!tree->mapping);
+	assert(!tree->indices);
+	int n = GeoHONumStoredVertices(tree);
+	void **ptrs = malloc(n * sizeof(*ptrs));
+	tag_vertices(tree, ptrs);
+	struct TagDtorCtx tag_ctx = {ptrs, dtor, ctx};
+	GeoHODeleteDuplicatesWithMode(tree, eps, mode, dtor ? TagDtor : 0,
+		&tag_ctx);
+	untag_vertices(tree, ptrs, n, permutation);
+	free(ptrs);
+}
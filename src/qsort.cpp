@@ -1,8 +1,123 @@
 #include <qsort.h>
 
 #include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-void GeoQsort(uint64_t *x, int n) {
-  std::sort(x, x + n);
+namespace {
+
+// 11 bit digits keep the histograms of all threads in L2 and sort the
+// 30 bit keys of a default octree in three passes.
+const int kRadixBits = 11;
+const int kRadixSize = 1 << kRadixBits;
+// Below this size std::stable_sort wins over the histogram passes.
+const int kMinRadixSortSize = 1 << 12;
+// Below this size the threads would mostly synchronize.
+const int kMinParallelSortSize = 1 << 16;
+
+template <typename F>
+void for_each_chunk(int num_chunks, F f) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (num_chunks > 1)
+#endif
+  for (int t = 0; t < num_chunks; ++t) {
+    f(t);
+  }
+}
+
+}
+
+void GeoQsortPairs(uint64_t *keys, uint32_t *tags, int n) {
+  std::vector<std::pair<uint64_t, uint32_t>> pairs(n);
+  for (int i = 0; i < n; ++i) {
+    pairs[i] = std::make_pair(keys[i], tags[i]);
+  }
+  std::sort(pairs.begin(), pairs.end());
+  for (int i = 0; i < n; ++i) {
+    keys[i] = pairs[i].first;
+    tags[i] = pairs[i].second;
+  }
 }
 
+// Every pass splits the input into one contiguous chunk per thread. Each
+// thread counts the digits in its chunk, the counts are turned into
+// offsets in (digit, chunk) order and each thread scatters its chunk to
+// those offsets. This keeps the sort stable for any number of threads.
+void GeoRadixSortPairs(uint64_t *keys, uint32_t *tags, int n,
+                       int key_bits) {
+  if (n < kMinRadixSortSize) {
+    std::vector<std::pair<uint64_t, uint32_t>> pairs(n);
+    for (int i = 0; i < n; ++i) {
+      pairs[i] = std::make_pair(keys[i], tags[i]);
+    }
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [](const std::pair<uint64_t, uint32_t> &a,
+                        const std::pair<uint64_t, uint32_t> &b) {
+                       return a.first < b.first;
+                     });
+    for (int i = 0; i < n; ++i) {
+      keys[i] = pairs[i].first;
+      tags[i] = pairs[i].second;
+    }
+    return;
+  }
+  int num_chunks = 1;
+#ifdef _OPENMP
+  if (n >= kMinParallelSortSize) num_chunks = omp_get_max_threads();
+#endif
+  std::vector<uint64_t> keys_buffer(n);
+  std::vector<uint32_t> tags_buffer(n);
+  std::vector<int> offsets(num_chunks * kRadixSize);
+  uint64_t *src_keys = keys;
+  uint32_t *src_tags = tags;
+  uint64_t *dst_keys = keys_buffer.data();
+  uint32_t *dst_tags = tags_buffer.data();
+  auto chunk_begin = [n, num_chunks](int t) {
+    return (int)((int64_t)n * t / num_chunks);
+  };
+
+  for (int shift = 0; shift < key_bits; shift += kRadixBits) {
+    for_each_chunk(num_chunks, [&](int t) {
+      int *count = &offsets[t * kRadixSize];
+      std::fill(count, count + kRadixSize, 0);
+      for (int i = chunk_begin(t); i < chunk_begin(t + 1); ++i) {
+        ++count[(src_keys[i] >> shift) & (kRadixSize - 1)];
+      }
+    });
+
+    // A digit shared by all keys doesn't change the order.
+    int sum = 0;
+    bool trivial = false;
+    for (int d = 0; d < kRadixSize; ++d) {
+      int digit_total = 0;
+      for (int t = 0; t < num_chunks; ++t) {
+        int count = offsets[t * kRadixSize + d];
+        offsets[t * kRadixSize + d] = sum;
+        sum += count;
+        digit_total += count;
+      }
+      if (digit_total == n) trivial = true;
+    }
+    if (trivial) continue;
+
+    for_each_chunk(num_chunks, [&](int t) {
+      int *offset = &offsets[t * kRadixSize];
+      for (int i = chunk_begin(t); i < chunk_begin(t + 1); ++i) {
+        int j = offset[(src_keys[i] >> shift) & (kRadixSize - 1)]++;
+        dst_keys[j] = src_keys[i];
+        dst_tags[j] = src_tags[i];
+      }
+    });
+    std::swap(src_keys, dst_keys);
+    std::swap(src_tags, dst_tags);
+  }
+
+  if (src_keys != keys) {
+    std::memcpy(keys, src_keys, n * sizeof(*keys));
+    std::memcpy(tags, src_tags, n * sizeof(*tags));
+  }
+}
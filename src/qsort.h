@@ -2,17 +2,26 @@
 #define QSORT_H
 
 #include <stdint.h>
+#include <geo_export.h>
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void GeoQsort(uint64_t *x, int n);
+// Sorts keys in ascending order and permutes the tags along with them.
+// Ties between equal keys are broken by the tags.
+GEO_EXPORT void GeoQsortPairs(uint64_t *keys, uint32_t *tags, int n);
+// Stable LSD radix sort of keys with tags permuted along. Only the lowest
+// key_bits bits of the keys are looked at; the higher bits must be 0.
+// Since the sort is stable the result is the same as GeoQsortPairs if the
+// tags are ascending on input. Small inputs are sorted with
+// std::stable_sort and large ones by all OpenMP threads.
+GEO_EXPORT void GeoRadixSortPairs(uint64_t *keys, uint32_t *tags, int n,
+	int key_bits);
 
 #ifdef __cplusplus
 }
 #endif
 
 #endif
-
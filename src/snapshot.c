@@ -0,0 +1,129 @@
+#include <snapshot.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+#define BYTE_ORDER_MARK 0x01020304u
+
+static uint64_t align(uint64_t offset)
+{
+	return (offset + GEO_SNAPSHOT_ALIGNMENT - 1) /
+		GEO_SNAPSHOT_ALIGNMENT * GEO_SNAPSHOT_ALIGNMENT;
+}
+
+static int write_padding(FILE *f, uint64_t n)
+{
+	static const char zeros[GEO_SNAPSHOT_ALIGNMENT];
+	return n == 0 || fwrite(zeros, n, 1, f) == 1;
+}
+
+int GeoSnapshotWrite(const char *path, const char *magic,
+	void *header, size_t header_size,
+	const void *const *sections, const uint64_t *sizes, int num_sections)
+{
+	struct GeoSnapshotHeader *h = header;
+	memset(h, 0, sizeof(*h));
+	assert(strlen(magic) < sizeof(h->magic));
+	memcpy(h->magic, magic, strlen(magic));
+	h->version = GEO_SNAPSHOT_VERSION;
+	h->byte_order = BYTE_ORDER_MARK;
+	uint64_t offset = header_size;
+	for (int s = 0; s < num_sections; ++s) {
+		offset = align(offset);
+		h->offsets[s] = offset;
+		h->sizes[s] = sizes[s];
+		offset += sizes[s];
+	}
+	h->file_size = offset;
+
+	FILE *f = fopen(path, "wb");
+	if (!f) return -1;
+	int ok = fwrite(header, header_size, 1, f) == 1;
+	offset = header_size;
+	for (int s = 0; s < num_sections && ok; ++s) {
+		ok = write_padding(f, h->offsets[s] - offset);
+		if (ok && sizes[s] > 0) {
+			ok = fwrite(sections[s], sizes[s], 1, f) == 1;
+		}
+		offset = h->offsets[s] + sizes[s];
+	}
+	if (fclose(f) != 0) ok = 0;
+	return ok ? 0 : -1;
+}
+
+#ifndef _WIN32
+static int is_valid(const struct GeoSnapshotHeader *h, const char *magic,
+	size_t header_size, size_t size)
+{
+	if (strncmp(h->magic, magic, sizeof(h->magic)) != 0 ||
+	    h->version != GEO_SNAPSHOT_VERSION ||
+	    h->byte_order != BYTE_ORDER_MARK ||
+	    h->file_size != size) {
+		return 0;
+	}
+	for (int s = 0; s < GEO_SNAPSHOT_MAX_SECTIONS; ++s) {
+		if (h->sizes[s] == 0) continue;
+		if (h->offsets[s] < header_size ||
+		    h->offsets[s] % GEO_SNAPSHOT_ALIGNMENT != 0 ||
+		    h->offsets[s] > size ||
+		    h->sizes[s] > size - h->offsets[s]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+const void *GeoSnapshotMap(const char *path, const char *magic,
+	size_t header_size, size_t *size)
+{
+#ifdef _WIN32
+	(void)path;
+	(void)magic;
+	(void)header_size;
+	(void)size;
+	return 0;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < header_size) {
+		close(fd);
+		return 0;
+	}
+	*size = st.st_size;
+	void *mapping = mmap(0, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return 0;
+	if (!is_valid(mapping, magic, header_size, *size)) {
+		munmap(mapping, *size);
+		return 0;
+	}
+	return mapping;
+#endif
+}
+
+void **GeoSnapshotPositions(uint64_t n)
+{
+	void **positions = malloc(n * sizeof(*positions));
+	for (uint64_t i = 0; i < n; ++i) positions[i] = (void *)(uintptr_t)i;
+	return positions;
+}
+
+void GeoSnapshotUnmap(const void *mapping, size_t size)
+{
+#ifdef _WIN32
+	(void)mapping;
+	(void)size;
+#else
+	munmap((void *)mapping, size);
+#endif
+}
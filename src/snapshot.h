@@ -0,0 +1,45 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A snapshot file is a header followed by sections that start at
+// multiples of GEO_SNAPSHOT_ALIGNMENT. The header records where the
+// sections are so that a mapped snapshot can be used in place. Values are
+// stored in the byte order of the machine that wrote them; byte_order
+// lets readers reject snapshots of the other order. User pointers are
+// written as the positions of their elements, see GeoSnapshotPositions;
+// version 1 wrote them as they were.
+#define GEO_SNAPSHOT_VERSION 2
+#define GEO_SNAPSHOT_ALIGNMENT 128
+#define GEO_SNAPSHOT_MAX_SECTIONS 8
+
+struct GeoSnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t file_size;
+	uint64_t offsets[GEO_SNAPSHOT_MAX_SECTIONS];
+	uint64_t sizes[GEO_SNAPSHOT_MAX_SECTIONS];
+};
+
+// Writes a snapshot. header points to header_size bytes that start with a
+// GeoSnapshotHeader whose common fields are filled in here. Returns 0 on
+// success and -1 on failure.
+int GeoSnapshotWrite(const char *path, const char *magic,
+	void *header, size_t header_size,
+	const void *const *sections, const uint64_t *sizes, int num_sections);
+// Maps a snapshot read-only after checking its magic, version, byte order
+// and that the header and the sections lie within the file. Returns null
+// on failure.
+const void *GeoSnapshotMap(const char *path, const char *magic,
+	size_t header_size, size_t *size);
+void GeoSnapshotUnmap(const void *mapping, size_t size);
+// A malloc'ed array of n pointers holding 0, ..., n - 1. Snapshots write
+// it in place of the user pointers of n elements, which are addresses
+// that mean nothing to the process that maps the snapshot.
+void **GeoSnapshotPositions(uint64_t n);
+
+#endif
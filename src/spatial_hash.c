@@ -1,29 +1,49 @@
 #include <spatial_hash.h>
+#include <geo_config.h>
 #include <math.h>
 #include <assert.h>
 #include <stdio.h>
 
+#if defined(GEO_HAVE_FUNCTION_MULTI_DISPATH) && defined(__x86_64__)
+#define GEO_HAVE_BMI2_CODEC
+#include <immintrin.h>
+#endif
+
 
 // We use 32 bit keys. That is large enough for 2**10 buckets
 // along each dimension.
-#define BITS_PER_DIM 10
+#define BITS_PER_DIM GEO_NODE_MAX_DEPTH
 #define NUM_LEAF_BUCKETS (1u << BITS_PER_DIM)
 
-static double clamp(double x, double min, double max)
+// The 64 bit keys have room for 2**21 buckets along each dimension. The
+// node keys need one extra bit for the level marker so 3 * 21 + 1 = 64
+// bits are used.
+#define BITS_PER_DIM_64 GEO_NODE_MAX_DEPTH_64
+#define NUM_LEAF_BUCKETS_64 (1u << BITS_PER_DIM_64)
+
+// Buckets are computed with the reciprocal of the bucket width so that the
+// batched kernels can hoist the division out of their loops. The scalar and
+// the batched code paths share ScaledBucket and therefore agree bit for bit.
+static double BucketScale(double min, double max, uint32_t num_buckets)
 {
-	assert(max >= min);
-	x = (x > min) ? x : min;
-	x = (x < max) ? x : max;
-	return x;
+	assert(max > min);
+	return num_buckets / (max - min);
+}
+
+static uint32_t ScaledBucket(double pos, double min, double scale,
+	double max_bucket)
+{
+	double t = (pos - min) * scale;
+	t = (t > 0.0) ? t : 0.0;
+	t = (t < max_bucket) ? t : max_bucket;
+	return (uint32_t)(int32_t)t;
 }
 
 static GeoSpatialHash ComputeBucket(double min, double max,
 	double pos, GeoSpatialHash num_buckets)
 {
-	assert(max > min);
-	pos = clamp(pos, min, max);
-	uint32_t bucket = num_buckets * (pos - min) / (max - min);
-	if (bucket == num_buckets) --bucket;
+	uint32_t bucket = ScaledBucket(pos, min,
+		BucketScale(min, max, num_buckets), num_buckets - 1);
 	assert(bucket < num_buckets);
 	return bucket;
 }
@@ -50,6 +70,28 @@ static uint32_t Compact1By2_32(uint32_t x)
 	return x;
 }
 
+static uint64_t Part1By2_64(uint64_t a)
+{
+	a &= 0x00000000001fffffull;
+	a = (a ^ (a << 32)) & 0x001f00000000ffffull;
+	a = (a ^ (a << 16)) & 0x001f0000ff0000ffull;
+	a = (a ^ (a <<  8)) & 0x100f00f00f00f00full;
+	a = (a ^ (a <<  4)) & 0x10c30c30c30c30c3ull;
+	a = (a ^ (a <<  2)) & 0x1249249249249249ull;
+	return a;
+}
+
+static uint64_t Compact1By2_64(uint64_t x)
+{
+	x &= 0x1249249249249249ull;
+	x = (x ^ (x >>  2)) & 0x10c30c30c30c30c3ull;
+	x = (x ^ (x >>  4)) & 0x100f00f00f00f00full;
+	x = (x ^ (x >>  8)) & 0x001f0000ff0000ffull;
+	x = (x ^ (x >> 16)) & 0x001f00000000ffffull;
+	x = (x ^ (x >> 32)) & 0x00000000001fffffull;
+	return x;
+}
+
 static uint32_t DecodeMorton3X(uint32_t code)
 {
 	return Compact1By2_32(code >> 0);
@@ -65,20 +107,232 @@ static uint32_t DecodeMorton3Z(uint32_t code)
 	return Compact1By2_32(code >> 2);
 }
 
+// The shift and mask codec. This is also used by the batched kernels
+// because it vectorizes well.
 static uint32_t MortonEncode_32(uint32_t a, uint32_t b, uint32_t c)
 {
 	return Part1By2_32(a) + (Part1By2_32(b) << 1) + (Part1By2_32(c) << 2);
 }
 
-static void MortonDecode_32(uint32_t code, int bits_per_dim,
+static void MortonDecodeShift_32(uint32_t code,
 	uint32_t *a, uint32_t *b, uint32_t *c)
 {
-	code &= (1u << (3 * bits_per_dim)) - 1u;
 	*a = DecodeMorton3X(code);
 	*b = DecodeMorton3Y(code);
 	*c = DecodeMorton3Z(code);
 }
 
+static uint64_t MortonEncode_64(uint64_t a, uint64_t b, uint64_t c)
+{
+	return Part1By2_64(a) + (Part1By2_64(b) << 1) + (Part1By2_64(c) << 2);
+}
+
+static void MortonDecodeShift_64(uint64_t code,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	*a = Compact1By2_64(code >> 0);
+	*b = Compact1By2_64(code >> 1);
+	*c = Compact1By2_64(code >> 2);
+}
+
+
+// The lookup table codec. The encode table spreads the bits of a byte so
+// that they are three positions apart. The decode table maps nine
+// interleaved bits to three bits per dimension packed as
+// a | (b << 3) | (c << 6).
+#define SPREAD_BYTE(n) ( \
+	(((n) & 0x01u) << 0) | (((n) & 0x02u) << 2) | \
+	(((n) & 0x04u) << 4) | (((n) & 0x08u) << 6) | \
+	(((n) & 0x10u) << 8) | (((n) & 0x20u) << 10) | \
+	(((n) & 0x40u) << 12) | (((n) & 0x80u) << 14))
+#define SE2(n) SPREAD_BYTE(n), SPREAD_BYTE(n + 1), \
+	SPREAD_BYTE(n + 2), SPREAD_BYTE(n + 3)
+#define SE4(n) SE2(n), SE2(n + 4), SE2(n + 8), SE2(n + 12)
+#define SE6(n) SE4(n), SE4(n + 16), SE4(n + 32), SE4(n + 48)
+#define SE8(n) SE6(n), SE6(n + 64), SE6(n + 128), SE6(n + 192)
+static const uint32_t spread_table[256] = { SE8(0u) };
+
+#define COMPACT_3(n) ( \
+	(((n) >> 0) & 0x1u) | (((n) >> 2) & 0x2u) | (((n) >> 4) & 0x4u))
+#define COMPACT_9(n) (uint16_t)( \
+	COMPACT_3(n) | (COMPACT_3((n) >> 1) << 3) | (COMPACT_3((n) >> 2) << 6))
+#define CD2(n) COMPACT_9(n), COMPACT_9(n + 1), \
+	COMPACT_9(n + 2), COMPACT_9(n + 3)
+#define CD4(n) CD2(n), CD2(n + 4), CD2(n + 8), CD2(n + 12)
+#define CD6(n) CD4(n), CD4(n + 16), CD4(n + 32), CD4(n + 48)
+#define CD9(n) CD6(n), CD6(n + 64), CD6(n + 128), CD6(n + 192), \
+	CD6(n + 256), CD6(n + 320), CD6(n + 384), CD6(n + 448)
+static const uint16_t compact_table[512] = { CD9(0u) };
+
+static uint64_t SpreadTable_64(uint64_t a)
+{
+	return (uint64_t)spread_table[a & 0xff] |
+		((uint64_t)spread_table[(a >> 8) & 0xff] << 24) |
+		((uint64_t)spread_table[(a >> 16) & 0xff] << 48);
+}
+
+static uint32_t MortonEncodeTable_32(uint32_t a, uint32_t b, uint32_t c)
+{
+	return (uint32_t)(SpreadTable_64(a) | (SpreadTable_64(b) << 1) |
+		(SpreadTable_64(c) << 2));
+}
+
+static uint64_t MortonEncodeTable_64(uint64_t a, uint64_t b, uint64_t c)
+{
+	return SpreadTable_64(a) | (SpreadTable_64(b) << 1) |
+		(SpreadTable_64(c) << 2);
+}
+
+static void MortonDecodeTable_64(uint64_t code,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	uint32_t x = 0, y = 0, z = 0;
+	for (int shift = 0; code != 0; code >>= 9, shift += 3) {
+		uint32_t t = compact_table[code & 0x1ff];
+		x |= (t & 0x7) << shift;
+		y |= ((t >> 3) & 0x7) << shift;
+		z |= (t >> 6) << shift;
+	}
+	*a = x;
+	*b = y;
+	*c = z;
+}
+
+static void MortonDecodeTable_32(uint32_t code,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	MortonDecodeTable_64(code, a, b, c);
+}
+
+
+#ifdef GEO_HAVE_BMI2_CODEC
+// The BMI2 codec deposits and extracts the bits of each dimension with a
+// single pdep or pext instruction.
+#define MORTON_MASK_X_32 0x09249249u
+#define MORTON_MASK_X_64 0x1249249249249249ull
+
+__attribute__((target("bmi2")))
+static uint32_t MortonEncodeBmi2_32(uint32_t a, uint32_t b, uint32_t c)
+{
+	return _pdep_u32(a, MORTON_MASK_X_32) |
+		_pdep_u32(b, MORTON_MASK_X_32 << 1) |
+		_pdep_u32(c, MORTON_MASK_X_32 << 2);
+}
+
+__attribute__((target("bmi2")))
+static void MortonDecodeBmi2_32(uint32_t code,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	*a = _pext_u32(code, MORTON_MASK_X_32);
+	*b = _pext_u32(code, MORTON_MASK_X_32 << 1);
+	*c = _pext_u32(code, MORTON_MASK_X_32 << 2);
+}
+
+__attribute__((target("bmi2")))
+static uint64_t MortonEncodeBmi2_64(uint64_t a, uint64_t b, uint64_t c)
+{
+	return _pdep_u64(a, MORTON_MASK_X_64) |
+		_pdep_u64(b, MORTON_MASK_X_64 << 1) |
+		_pdep_u64(c, MORTON_MASK_X_64 << 2);
+}
+
+__attribute__((target("bmi2")))
+static void MortonDecodeBmi2_64(uint64_t code,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	*a = _pext_u64(code, MORTON_MASK_X_64);
+	*b = _pext_u64(code, MORTON_MASK_X_64 << 1);
+	*c = _pext_u64(code, MORTON_MASK_X_64 << 2);
+}
+#endif
+
+
+struct MortonCodec {
+	uint32_t (*encode_32)(uint32_t a, uint32_t b, uint32_t c);
+	void (*decode_32)(uint32_t code, uint32_t *a, uint32_t *b, uint32_t *c);
+	uint64_t (*encode_64)(uint64_t a, uint64_t b, uint64_t c);
+	void (*decode_64)(uint64_t code, uint32_t *a, uint32_t *b, uint32_t *c);
+};
+
+static const struct MortonCodec codecs[] = {
+	{
+		MortonEncode_32, MortonDecodeShift_32,
+		MortonEncode_64, MortonDecodeShift_64
+	}, {
+		MortonEncodeTable_32, MortonDecodeTable_32,
+		MortonEncodeTable_64, MortonDecodeTable_64
+	},
+#ifdef GEO_HAVE_BMI2_CODEC
+	{
+		MortonEncodeBmi2_32, MortonDecodeBmi2_32,
+		MortonEncodeBmi2_64, MortonDecodeBmi2_64
+	},
+#endif
+};
+
+static enum GeoMortonCodec active_codec_id = GEO_MORTON_CODEC_SHIFT;
+static const struct MortonCodec *active_codec = &codecs[0];
+
+int GeoMortonCodecSupported(enum GeoMortonCodec codec)
+{
+	switch (codec) {
+	case GEO_MORTON_CODEC_SHIFT:
+	case GEO_MORTON_CODEC_TABLE:
+		return 1;
+	case GEO_MORTON_CODEC_BMI2:
+#ifdef GEO_HAVE_BMI2_CODEC
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("bmi2");
+#else
+		return 0;
+#endif
+	}
+	return 0;
+}
+
+int GeoSetMortonCodec(enum GeoMortonCodec codec)
+{
+	if (!GeoMortonCodecSupported(codec)) return 0;
+	active_codec_id = codec;
+	active_codec = &codecs[codec];
+	return 1;
+}
+
+enum GeoMortonCodec GeoGetMortonCodec()
+{
+	return active_codec_id;
+}
+
+// Pick the codec once when the library is loaded. pdep and pext are
+// microcoded on AMD processors before Zen 3 and much slower than the
+// lookup tables there.
+__attribute__((constructor))
+static void SelectMortonCodec()
+{
+	int slow_bmi2 = 0;
+#ifdef GEO_HAVE_BMI2_CODEC
+	__builtin_cpu_init();
+	slow_bmi2 = __builtin_cpu_is("znver1") || __builtin_cpu_is("znver2");
+#endif
+	if (slow_bmi2 || !GeoSetMortonCodec(GEO_MORTON_CODEC_BMI2)) {
+		GeoSetMortonCodec(GEO_MORTON_CODEC_TABLE);
+	}
+}
+
+static void MortonDecode_32(uint32_t code, int bits_per_dim,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	code &= (1u << (3 * bits_per_dim)) - 1u;
+	active_codec->decode_32(code, a, b, c);
+}
+
+static void MortonDecode_64(uint64_t code, int bits_per_dim,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	code &= (1ull << (3 * bits_per_dim)) - 1ull;
+	active_codec->decode_64(code, a, b, c);
+}
+
 GeoSpatialHash GeoComputeHash(const struct GeoBoundingBox* bbox,
 	const struct GeoPoint* p)
 {
@@ -86,7 +340,39 @@ GeoSpatialHash GeoComputeHash(const struct GeoBoundingBox* bbox,
 	a = ComputeBucket(bbox->min.x, bbox->max.x, p->x, NUM_LEAF_BUCKETS);
 	b = ComputeBucket(bbox->min.y, bbox->max.y, p->y, NUM_LEAF_BUCKETS);
 	c = ComputeBucket(bbox->min.z, bbox->max.z, p->z, NUM_LEAF_BUCKETS);
-	return MortonEncode_32(a, b, c);
+	return active_codec->encode_32(a, b, c);
+}
+
+
+#ifdef GEO_HAVE_FUNCTION_MULTI_DISPATH
+__attribute__((target_clones("avx512f","avx2","default")))
+#endif
+static void compute_hashes_32(const double *x, const double *y,
+	const double *z, int n, const double min[3], const double scale[3],
+	GeoSpatialHash *hashes)
+{
+	const double *restrict x0 = __builtin_assume_aligned(x, GEO_VA_ALIGNMENT);
+	const double *restrict x1 = __builtin_assume_aligned(y, GEO_VA_ALIGNMENT);
+	const double *restrict x2 = __builtin_assume_aligned(z, GEO_VA_ALIGNMENT);
+	GeoSpatialHash *restrict h = hashes;
+	const double max_bucket = NUM_LEAF_BUCKETS - 1;
+	for (int i = 0; i < n; ++i) {
+		uint32_t a = ScaledBucket(x0[i], min[0], scale[0], max_bucket);
+		uint32_t b = ScaledBucket(x1[i], min[1], scale[1], max_bucket);
+		uint32_t c = ScaledBucket(x2[i], min[2], scale[2], max_bucket);
+		h[i] = MortonEncode_32(a, b, c);
+	}
+}
+
+void GeoComputeHashes(const struct GeoBoundingBox* bbox,
+	const struct GeoVertexArray *va, GeoSpatialHash *hashes)
+{
+	double min[3] = {bbox->min.x, bbox->min.y, bbox->min.z};
+	double scale[3] = {
+		BucketScale(bbox->min.x, bbox->max.x, NUM_LEAF_BUCKETS),
+		BucketScale(bbox->min.y, bbox->max.y, NUM_LEAF_BUCKETS),
+		BucketScale(bbox->min.z, bbox->max.z, NUM_LEAF_BUCKETS)};
+	compute_hashes_32(va->x, va->y, va->z, va->size, min, scale, hashes);
 }
 
 
@@ -156,55 +442,164 @@ void GeoComputeChildBoxes(
 	}
 }
 
-int GeoNodeValidKey(GeoNodeKey key)
+void GeoNodePrint(GeoNodeKey key)
 {
-	if (key & (1u << (BITS_PER_DIM * 3 + 1))) return 0;
-	GeoNodeKey m = 1u << (BITS_PER_DIM * 3);
-	while (m > 0) {
-		if (key & m) return 1;
-		for (int i = 0; i < 3; ++i, m >>= 1) {
-			if (key & m) return 0;
+	for (int i = 31; i >= 0; --i) {
+		if (key & (1u << i)) {
+			printf("1");
+		} else {
+			printf("0");
 		}
+		if (i % 3 == 0) printf(" ");
 	}
-	return 0;
 }
 
-int GeoNodeLevel(GeoNodeKey key)
+// Adding to one dimension of an interleaved code: the bits of the other
+// dimensions are set to 1 so carries ripple through them, for subtraction
+// they are cleared so borrows do. mask selects the bits of the dimension.
+static uint32_t DilatedStep_32(uint32_t code, uint32_t mask, int delta)
 {
-	int level = BITS_PER_DIM;
-	while (level > 0) {
-		if (key & (1u << (level * 3))) return level;
-		--level;
+	uint32_t axis = code & mask;
+	if (delta > 0) {
+		axis = ((axis | ~mask) + 1) & mask;
+	} else if (delta < 0) {
+		axis = (axis - 1) & mask;
 	}
-	return level;
+	return (code & ~mask) | axis;
 }
 
-GeoNodeKey GeoNodeParent(GeoNodeKey key)
+int GeoNodeComputeNeighborKeys(GeoNodeKey key, GeoNodeKey *neighbor_keys)
 {
-	return key >> 3;
+	int level = GeoNodeLevel(key);
+	GeoNodeKey marker = 1u << (3 * level);
+	uint32_t code = key & (marker - 1);
+	uint32_t masks[3] = {
+		0x09249249u & (marker - 1),
+		(0x09249249u << 1) & (marker - 1),
+		(0x09249249u << 2) & (marker - 1)};
+	int num_valid = 0;
+	int m = 0;
+	for (int dz = -1; dz <= 1; ++dz) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			for (int dx = -1; dx <= 1; ++dx) {
+				if (dx == 0 && dy == 0 && dz == 0) continue;
+				int delta[3] = {dx, dy, dz};
+				uint32_t neighbor = code;
+				int valid = 1;
+				for (int i = 0; i < 3; ++i) {
+					uint32_t axis = code & masks[i];
+					if ((delta[i] > 0 && axis == masks[i]) ||
+						(delta[i] < 0 && axis == 0)) {
+						valid = 0;
+					}
+					neighbor = DilatedStep_32(neighbor, masks[i],
+						delta[i]);
+				}
+				neighbor_keys[m++] = valid ? (neighbor | marker) : 0;
+				num_valid += valid;
+			}
+		}
+	}
+	return num_valid;
 }
 
-GeoSpatialHash GeoNodeBegin(GeoNodeKey key)
+GeoSpatialHash64 GeoComputeHash64(const struct GeoBoundingBox* bbox,
+	const struct GeoPoint* p)
 {
-	int level = GeoNodeLevel(key);
-	GeoSpatialHash begin = key ^ (1u << (3 * level));
-	begin <<= 3 * (BITS_PER_DIM - level);
-	return begin;
+	uint64_t a, b, c;
+	a = ComputeBucket(bbox->min.x, bbox->max.x, p->x, NUM_LEAF_BUCKETS_64);
+	b = ComputeBucket(bbox->min.y, bbox->max.y, p->y, NUM_LEAF_BUCKETS_64);
+	c = ComputeBucket(bbox->min.z, bbox->max.z, p->z, NUM_LEAF_BUCKETS_64);
+	return active_codec->encode_64(a, b, c);
 }
 
-GeoSpatialHash GeoNodeEnd(GeoNodeKey key)
+#ifdef GEO_HAVE_FUNCTION_MULTI_DISPATH
+__attribute__((target_clones("avx512f","avx2","default")))
+#endif
+static void compute_hashes_64(const double *x, const double *y,
+	const double *z, int n, const double min[3], const double scale[3],
+	GeoSpatialHash64 *hashes)
 {
-	int level = GeoNodeLevel(key);
-	GeoSpatialHash end = key ^ (1u << (3 * level));
-	++end;
-	end <<= 3 * (BITS_PER_DIM - level);
-	return end;
+	const double *restrict x0 = __builtin_assume_aligned(x, GEO_VA_ALIGNMENT);
+	const double *restrict x1 = __builtin_assume_aligned(y, GEO_VA_ALIGNMENT);
+	const double *restrict x2 = __builtin_assume_aligned(z, GEO_VA_ALIGNMENT);
+	GeoSpatialHash64 *restrict h = hashes;
+	const double max_bucket = NUM_LEAF_BUCKETS_64 - 1;
+	for (int i = 0; i < n; ++i) {
+		uint64_t a = ScaledBucket(x0[i], min[0], scale[0], max_bucket);
+		uint64_t b = ScaledBucket(x1[i], min[1], scale[1], max_bucket);
+		uint64_t c = ScaledBucket(x2[i], min[2], scale[2], max_bucket);
+		h[i] = MortonEncode_64(a, b, c);
+	}
 }
 
-void GeoNodePrint(GeoNodeKey key)
+void GeoComputeHashes64(const struct GeoBoundingBox* bbox,
+	const struct GeoVertexArray *va, GeoSpatialHash64 *hashes)
 {
-	for (int i = 31; i >= 0; --i) {
-		if (key & (1u << i)) {
+	double min[3] = {bbox->min.x, bbox->min.y, bbox->min.z};
+	double scale[3] = {
+		BucketScale(bbox->min.x, bbox->max.x, NUM_LEAF_BUCKETS_64),
+		BucketScale(bbox->min.y, bbox->max.y, NUM_LEAF_BUCKETS_64),
+		BucketScale(bbox->min.z, bbox->max.z, NUM_LEAF_BUCKETS_64)};
+	compute_hashes_64(va->x, va->y, va->z, va->size, min, scale, hashes);
+}
+
+GeoNodeKey64 GeoNodeRoot64()
+{
+	return 1ull;
+}
+
+int GeoNodeMaxDepth64()
+{
+	return BITS_PER_DIM_64;
+}
+
+struct GeoBoundingBox GeoNodeBox64(GeoNodeKey64 key,
+	const struct GeoBoundingBox *bbox)
+{
+	uint32_t a, b, c;
+	int level = GeoNodeLevel64(key);
+	MortonDecode_64(key, level, &a, &b, &c);
+	double dx = (bbox->max.x - bbox->min.x) / (1u << level);
+	double dy = (bbox->max.y - bbox->min.y) / (1u << level);
+	double dz = (bbox->max.z - bbox->min.z) / (1u << level);
+	struct GeoBoundingBox this_box = {{
+		bbox->min.x + a * dx,
+		bbox->min.y + b * dy,
+		bbox->min.z + c * dz
+		}, {
+		bbox->min.x + (a + 1) * dx,
+		bbox->min.y + (b + 1) * dy,
+		bbox->min.z + (c + 1) * dz
+		}};
+	return this_box;
+}
+
+GeoNodeKey64 GeoNodeFromCoordinates64(int level,
+	uint32_t a, uint32_t b, uint32_t c)
+{
+	assert(level >= 0 && level <= BITS_PER_DIM_64);
+	return active_codec->encode_64(a, b, c) | (1ull << (3 * level));
+}
+
+void GeoNodeCoordinates64(GeoNodeKey64 key,
+	uint32_t *a, uint32_t *b, uint32_t *c)
+{
+	MortonDecode_64(key, GeoNodeLevel64(key), a, b, c);
+}
+
+void GeoNodeComputeChildKeys64(GeoNodeKey64 key, GeoNodeKey64 *child_keys)
+{
+	GeoNodeKey64 first_child = key << 3;
+	for (int i = 0; i < 8; ++i) {
+		child_keys[i] = first_child + i;
+	}
+}
+
+void GeoNodePrint64(GeoNodeKey64 key)
+{
+	for (int i = 63; i >= 0; --i) {
+		if (key & (1ull << i)) {
 			printf("1");
 		} else {
 			printf("0");
@@ -213,16 +608,202 @@ void GeoNodePrint(GeoNodeKey key)
 	}
 }
 
-GeoNodeKey GeoNodeSmallestContaining(const struct GeoBoundingBox* root_box,
-	const struct GeoBoundingBox *b)
+static uint64_t DilatedStep_64(uint64_t code, uint64_t mask, int delta)
+{
+	uint64_t axis = code & mask;
+	if (delta > 0) {
+		axis = ((axis | ~mask) + 1) & mask;
+	} else if (delta < 0) {
+		axis = (axis - 1) & mask;
+	}
+	return (code & ~mask) | axis;
+}
+
+int GeoNodeComputeNeighborKeys64(GeoNodeKey64 key,
+	GeoNodeKey64 *neighbor_keys)
+{
+	int level = GeoNodeLevel64(key);
+	GeoNodeKey64 marker = 1ull << (3 * level);
+	uint64_t code = key & (marker - 1);
+	uint64_t masks[3] = {
+		0x1249249249249249ull & (marker - 1),
+		(0x1249249249249249ull << 1) & (marker - 1),
+		(0x1249249249249249ull << 2) & (marker - 1)};
+	int num_valid = 0;
+	int m = 0;
+	for (int dz = -1; dz <= 1; ++dz) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			for (int dx = -1; dx <= 1; ++dx) {
+				if (dx == 0 && dy == 0 && dz == 0) continue;
+				int delta[3] = {dx, dy, dz};
+				uint64_t neighbor = code;
+				int valid = 1;
+				for (int i = 0; i < 3; ++i) {
+					uint64_t axis = code & masks[i];
+					if ((delta[i] > 0 && axis == masks[i]) ||
+						(delta[i] < 0 && axis == 0)) {
+						valid = 0;
+					}
+					neighbor = DilatedStep_64(neighbor, masks[i],
+						delta[i]);
+				}
+				neighbor_keys[m++] = valid ? (neighbor | marker) : 0;
+				num_valid += valid;
+			}
+		}
+	}
+	return num_valid;
+}
+
+// Conversion between Morton and Hilbert order following J. Skilling,
+// "Programming the Hilbert curve", AIP Conf. Proc. 707 (2004). The
+// coordinates are transformed in place into the "transposed" Hilbert index
+// whose bits are then interleaved with x[0] as the most significant bit of
+// every triple. The top bits of the index only depend on the top bits of
+// the coordinates, so the index of a cell at a coarser level is a prefix of
+// the indices of all cells inside of it.
+static void AxesToTranspose(uint32_t x[3], int bits)
+{
+	if (bits == 0) return;
+	uint32_t m = 1u << (bits - 1);
+	for (uint32_t q = m; q > 1; q >>= 1) {
+		uint32_t p = q - 1;
+		for (int i = 0; i < 3; ++i) {
+			if (x[i] & q) {
+				x[0] ^= p;
+			} else {
+				uint32_t t = (x[0] ^ x[i]) & p;
+				x[0] ^= t;
+				x[i] ^= t;
+			}
+		}
+	}
+	x[1] ^= x[0];
+	x[2] ^= x[1];
+	uint32_t t = 0;
+	for (uint32_t q = m; q > 1; q >>= 1) {
+		if (x[2] & q) t ^= q - 1;
+	}
+	for (int i = 0; i < 3; ++i) {
+		x[i] ^= t;
+	}
+}
+
+static void TransposeToAxes(uint32_t x[3], int bits)
+{
+	if (bits == 0) return;
+	uint32_t n = 2u << (bits - 1);
+	uint32_t t = x[2] >> 1;
+	x[2] ^= x[1];
+	x[1] ^= x[0];
+	x[0] ^= t;
+	for (uint32_t q = 2; q != n; q <<= 1) {
+		uint32_t p = q - 1;
+		for (int i = 2; i >= 0; --i) {
+			if (x[i] & q) {
+				x[0] ^= p;
+			} else {
+				t = (x[0] ^ x[i]) & p;
+				x[0] ^= t;
+				x[i] ^= t;
+			}
+		}
+	}
+}
+
+static uint64_t HilbertIndex_64(uint32_t a, uint32_t b, uint32_t c,
+	int bits)
+{
+	uint32_t x[3] = {a, b, c};
+	AxesToTranspose(x, bits);
+	return active_codec->encode_64(x[2], x[1], x[0]);
+}
+
+GeoSpatialHash64 GeoComputeHilbertHash64(const struct GeoBoundingBox* bbox,
+	const struct GeoPoint* p)
+{
+	uint32_t a, b, c;
+	a = ComputeBucket(bbox->min.x, bbox->max.x, p->x, NUM_LEAF_BUCKETS_64);
+	b = ComputeBucket(bbox->min.y, bbox->max.y, p->y, NUM_LEAF_BUCKETS_64);
+	c = ComputeBucket(bbox->min.z, bbox->max.z, p->z, NUM_LEAF_BUCKETS_64);
+	return HilbertIndex_64(a, b, c, BITS_PER_DIM_64);
+}
+
+void GeoComputeHilbertHashes64(const struct GeoBoundingBox* bbox,
+	const struct GeoVertexArray *va, GeoSpatialHash64 *hashes)
+{
+	double min[3] = {bbox->min.x, bbox->min.y, bbox->min.z};
+	double scale[3] = {
+		BucketScale(bbox->min.x, bbox->max.x, NUM_LEAF_BUCKETS_64),
+		BucketScale(bbox->min.y, bbox->max.y, NUM_LEAF_BUCKETS_64),
+		BucketScale(bbox->min.z, bbox->max.z, NUM_LEAF_BUCKETS_64)};
+	const double max_bucket = NUM_LEAF_BUCKETS_64 - 1;
+	for (int i = 0; i < va->size; ++i) {
+		uint32_t a = ScaledBucket(va->x[i], min[0], scale[0], max_bucket);
+		uint32_t b = ScaledBucket(va->y[i], min[1], scale[1], max_bucket);
+		uint32_t c = ScaledBucket(va->z[i], min[2], scale[2], max_bucket);
+		hashes[i] = HilbertIndex_64(a, b, c, BITS_PER_DIM_64);
+	}
+}
+
+GeoNodeKey64 GeoNodeMortonToHilbert64(GeoNodeKey64 key)
+{
+	int level = GeoNodeLevel64(key);
+	uint32_t a, b, c;
+	MortonDecode_64(key, level, &a, &b, &c);
+	return HilbertIndex_64(a, b, c, level) | (1ull << (3 * level));
+}
+
+GeoNodeKey64 GeoNodeHilbertToMorton64(GeoNodeKey64 key)
+{
+	int level = GeoNodeLevel64(key);
+	uint32_t x[3];
+	MortonDecode_64(key, level, &x[2], &x[1], &x[0]);
+	TransposeToAxes(x, level);
+	return active_codec->encode_64(x[0], x[1], x[2]) |
+		(1ull << (3 * level));
+}
+
+// Generated from GeoNodeMortonToHilbert64 by converting the children of
+// nodes at every level and grouping the nodes by the order of their
+// children's digits.
+const uint8_t GeoHilbertDigits[GEO_HILBERT_NUM_STATES][8] = {
+	{0, 7, 3, 4, 1, 6, 2, 5}, {0, 3, 1, 2, 7, 4, 6, 5},
+	{4, 7, 5, 6, 3, 0, 2, 1}, {6, 7, 5, 4, 1, 0, 2, 3},
+	{0, 1, 3, 2, 7, 6, 4, 5}, {0, 3, 7, 4, 1, 2, 6, 5},
+	{4, 7, 3, 0, 5, 6, 2, 1}, {0, 1, 7, 6, 3, 2, 4, 5},
+	{6, 5, 1, 2, 7, 4, 0, 3}, {0, 7, 1, 6, 3, 4, 2, 5},
+	{4, 5, 3, 2, 7, 6, 0, 1}, {4, 3, 5, 2, 7, 0, 6, 1},
+	{2, 1, 5, 6, 3, 0, 4, 7}, {6, 7, 1, 0, 5, 4, 2, 3},
+	{2, 3, 5, 4, 1, 0, 6, 7}, {6, 1, 5, 2, 7, 0, 4, 3},
+	{6, 5, 7, 4, 1, 2, 0, 3}, {4, 5, 7, 6, 3, 2, 0, 1},
+	{4, 3, 7, 0, 5, 2, 6, 1}, {2, 1, 3, 0, 5, 6, 4, 7},
+	{2, 3, 1, 0, 5, 4, 6, 7}, {6, 1, 7, 0, 5, 2, 4, 3},
+	{2, 5, 1, 6, 3, 4, 0, 7}, {2, 5, 3, 4, 1, 6, 0, 7}};
+
+const uint8_t GeoHilbertChildStates[GEO_HILBERT_NUM_STATES][8] = {
+	{1, 2, 3, 4, 5, 6, 0, 0}, {7, 8, 9, 1, 10, 5, 11, 1},
+	{12, 13, 2, 9, 6, 14, 2, 11}, {13, 9, 3, 15, 14, 11, 3, 0},
+	{9, 7, 15, 4, 11, 10, 0, 4}, {4, 16, 17, 1, 0, 5, 18, 5},
+	{19, 3, 2, 20, 6, 0, 6, 18}, {0, 4, 18, 17, 21, 7, 9, 7},
+	{15, 8, 22, 8, 4, 16, 17, 1}, {5, 6, 1, 2, 13, 7, 9, 9},
+	{23, 10, 11, 10, 15, 4, 22, 17}, {14, 10, 11, 11, 8, 12, 1, 2},
+	{12, 15, 12, 22, 19, 3, 2, 20}, {3, 0, 20, 18, 13, 21, 13, 9},
+	{14, 23, 14, 11, 3, 15, 20, 22}, {8, 12, 15, 15, 1, 2, 3, 4},
+	{21, 16, 7, 8, 23, 16, 10, 5}, {22, 17, 21, 7, 18, 17, 23, 10},
+	{20, 17, 16, 19, 18, 18, 5, 6}, {19, 21, 12, 13, 19, 23, 6, 14},
+	{20, 22, 13, 21, 20, 18, 14, 23}, {16, 19, 5, 6, 21, 21, 13, 7},
+	{22, 22, 8, 12, 20, 17, 16, 19}, {23, 23, 14, 10, 16, 19, 8, 12}};
+
+GeoNodeKey64 GeoNodeMortonToHilbertState64(GeoNodeKey64 key, int *state)
 {
-	GeoSpatialHash min = GeoComputeHash(root_box, &b->min);
-	GeoSpatialHash max = GeoComputeHash(root_box, &b->max);
-	int level = GeoNodeMaxDepth();
-	while (min != max) {
-		min >>= 3;
-		max >>= 3;
-		--level;
+	GeoNodeKey64 hilbert = GeoNodeRoot64();
+	int s = 0;
+	for (int shift = 3 * (GeoNodeLevel64(key) - 1); shift >= 0; shift -= 3) {
+		int i = (key >> shift) & 7;
+		hilbert = (hilbert << 3) | GeoHilbertDigits[s][i];
+		s = GeoHilbertChildStates[s][i];
 	}
-	return min | (1u << (3 * level));
+	*state = s;
+	return hilbert;
 }
@@ -1,4 +1,5 @@
 #include <transformation.h>
+#include <geo_config.h>
 #include <assert.h>
 
 
@@ -97,6 +98,34 @@ static void apply_transform_inplace(double T[3][4], double **x, int n)
 	}
 }
 
+// The coordinates of a chunk are all read before any is written, so x and
+// y may be the same arrays.
+#ifdef GEO_HAVE_FUNCTION_MULTI_DISPATH
+__attribute__((target_clones("avx2","avx","sse4.2","default")))
+#endif
+static void apply_transform_float(double T[3][4], const float **x, float **y,
+	int n)
+{
+	for (int i = 0; i < n; i += MY_CHUNK_SIZE) {
+		int m = n - i < MY_CHUNK_SIZE ? n - i : MY_CHUNK_SIZE;
+		const float *x0 = x[0] + i;
+		const float *x1 = x[1] + i;
+		const float *x2 = x[2] + i;
+		double tmp[3][MY_CHUNK_SIZE];
+		for (int k = 0; k < 3; ++k) {
+			for (int j = 0; j < m; ++j) {
+				tmp[k][j] = T[k][0] * x0[j] + T[k][1] * x1[j] +
+					T[k][2] * x2[j] + T[k][3];
+			}
+		}
+		for (int k = 0; k < 3; ++k) {
+			for (int j = 0; j < m; ++j) {
+				y[k][i + j] = (float)tmp[k][j];
+			}
+		}
+	}
+}
+
 
 void GeoApplyTransform(double T[3][4], const struct GeoVertexArray *a,
 	struct GeoVertexArray *b)
@@ -112,3 +141,18 @@ void GeoApplyTransformInplace(double T[3][4], struct GeoVertexArray *a)
 	double *x[3] = {a->x, a->y, a->z};
 	apply_transform_inplace(T, x, a->size);
 }
+
+void GeoApplyTransformFloat(double T[3][4],
+	const float *x, const float *y, const float *z,
+	float *tx, float *ty, float *tz, int n)
+{
+	const float *src[3] = {x, y, z};
+	float *dst[3] = {tx, ty, tz};
+	apply_transform_float(T, src, dst, n);
+}
+
+void GeoApplyTransformFloatInplace(double T[3][4],
+	float *x, float *y, float *z, int n)
+{
+	GeoApplyTransformFloat(T, x, y, z, x, y, z, n);
+}
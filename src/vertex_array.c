@@ -1,4 +1,5 @@
 #include <vertex_array.h>
+#include <geo_config.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -9,6 +9,7 @@ void GeoVSInitialize(struct GeoVertexSet *vs, struct GeoBoundingBox bbox,
 	double epsilon)
 {
 	GeoHOInitialize(&vs->octree, bbox);
+	GeoHOSetGrowBoundingBox(&vs->octree, 1);
 	GeoVAInitialize(&vs->short_list);
 	vs->size = 0;
 	vs->capacity = 32;
@@ -155,7 +156,6 @@ struct GeoVertex GeoVSGetVertex(struct GeoVertexSet *vs, GeoVertexId id,
 
 void GeoVSOptimize(struct GeoVertexSet *vs)
 {
-	// TODO: Find bounding box of short list and grow octree as needed.
 	GeoHOInsert(&vs->octree, &vs->short_list);
 	GeoVAClear(&vs->short_list);
 	GeoHTClear(&vs->id_map);
@@ -0,0 +1,200 @@
+#include <hashed_octree.h>
+#include <test_utilities.h>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_vertices;
+  int num_queries;
+  int depth;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+extern "C" {
+
+static int count_hits(struct GeoVertexArray *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+static int count_block_hits(struct GeoVertexArray *, const int *, int n,
+                            void *ctx) {
+  *static_cast<int*>(ctx) += n;
+  return 1;
+}
+
+struct FilterCtx {
+  struct GeoBoundingBox box;
+  int hits;
+};
+
+static int count_hits_in_box(struct GeoVertexArray *va, int i, void *ctx) {
+  FilterCtx *filter = static_cast<FilterCtx*>(ctx);
+  const struct GeoBoundingBox &b = filter->box;
+  filter->hits += b.min.x <= va->x[i] && va->x[i] <= b.max.x &&
+      b.min.y <= va->y[i] && va->y[i] <= b.max.y &&
+      b.min.z <= va->z[i] && va->z[i] <= b.max.z;
+  return 1;
+}
+
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  struct GeoHashedOctree tree;
+  GeoHOInitializeWithDepth(&tree, UnitCube(), conf.depth);
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, conf.num_vertices);
+  std::vector<int> indices(conf.num_vertices);
+  struct GeoBoundingBox bbox = UnitCube();
+  FillWithRandomItems(&va, &bbox, conf.num_vertices, &indices[0]);
+  GeoHOInsert(&tree, &va);
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_queries\": " << conf.num_queries << ",\n";
+  std::cout << "  \"depth\": " << conf.depth << ",\n";
+  std::cout << "  \"boxes\": [\n";
+  // Cubes, a slab and a rod. The near query runs on the smallest cube
+  // around the box and filters the vertices in the visitor, which is how
+  // boxes were queried before GeoHOVisitVerticesInBox.
+  const struct GeoPoint sizes[] = {
+      {1.0e-2, 1.0e-2, 1.0e-2}, {5.0e-2, 5.0e-2, 5.0e-2},
+      {2.0e-1, 2.0e-1, 2.0e-1}, {4.0e-1, 4.0e-1, 1.0e-2},
+      {1.0e-2, 1.0e-2, 4.0e-1}};
+  const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  std::mt19937 gen(42);
+  for (int s = 0; s < num_sizes; ++s) {
+    struct GeoPoint half = {
+        0.5 * sizes[s].x, 0.5 * sizes[s].y, 0.5 * sizes[s].z};
+    double eps = std::max(half.x, std::max(half.y, half.z));
+    std::uniform_real_distribution<> dist(eps, 1.0 - eps);
+    std::vector<struct GeoPoint> centers(conf.num_queries);
+    for (auto &c : centers) c = {dist(gen), dist(gen), dist(gen)};
+
+    int box_hits = 0;
+    uint64_t start = rdtsc();
+    for (const auto &c : centers) {
+      struct GeoBoundingBox box = {
+          {c.x - half.x, c.y - half.y, c.z - half.z},
+          {c.x + half.x, c.y + half.y, c.z + half.z}};
+      GeoHOVisitVerticesInBox(&tree, &box, count_hits, &box_hits);
+    }
+    uint64_t end = rdtsc();
+    double box_cycles = (double)(end - start) / conf.num_queries;
+
+    int block_hits = 0;
+    start = rdtsc();
+    for (const auto &c : centers) {
+      struct GeoBoundingBox box = {
+          {c.x - half.x, c.y - half.y, c.z - half.z},
+          {c.x + half.x, c.y + half.y, c.z + half.z}};
+      GeoHOVisitVertexBlocksInBox(&tree, &box, count_block_hits, &block_hits);
+    }
+    end = rdtsc();
+    double block_cycles = (double)(end - start) / conf.num_queries;
+    if (block_hits != box_hits) {
+      std::cerr << "Error: Block query found " << block_hits <<
+          " instead of " << box_hits << " vertices." << std::endl;
+    }
+
+    int near_hits = 0;
+    start = rdtsc();
+    for (const auto &c : centers) {
+      FilterCtx filter = {{{c.x - half.x, c.y - half.y, c.z - half.z},
+                           {c.x + half.x, c.y + half.y, c.z + half.z}}, 0};
+      GeoHOVisitNearVertices(&tree, &c, eps, count_hits_in_box, &filter);
+      near_hits += filter.hits;
+    }
+    end = rdtsc();
+    double near_cycles = (double)(end - start) / conf.num_queries;
+
+    std::cout << "    {\n";
+    std::cout << "      \"size\":         [" << sizes[s].x << ", " <<
+        sizes[s].y << ", " << sizes[s].z << "],\n";
+    std::cout << "      \"hits\":         " <<
+        (double)box_hits / conf.num_queries << ",\n";
+    std::cout << "      \"near_hits\":    " <<
+        (double)near_hits / conf.num_queries << ",\n";
+    std::cout << "      \"box_cycles\":   " << box_cycles << ",\n";
+    std::cout << "      \"block_cycles\": " << block_cycles << ",\n";
+    std::cout << "      \"near_cycles\":  " << near_cycles << "\n";
+    std::cout << "    }" << (s < num_sizes - 1 ? "," : "") << "\n";
+  }
+  std::cout << "  ]\n";
+  std::cout << "}\n";
+
+  GeoVADestroy(&va);
+  GeoHODestroy(&tree);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: box_query_test "
+    "[--num_vertices num_vertices] "
+    "[--num_queries num_queries] "
+    "[--depth depth] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_vertices = 1000000;
+  conf.num_queries = 1000;
+  conf.depth = GeoNodeMaxDepth();
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_vertices", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of vertices parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_vertices = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_queries", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of queries parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_queries = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--depth", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Depth parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.depth = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
@@ -0,0 +1,225 @@
+#include <hashed_octree.h>
+#include <test_utilities.h>
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_vertices;
+  int num_queries;
+  double epsilon;
+  double cluster_width;
+  int leaf_capacity;
+};
+
+struct TreeStats {
+  double insert_cycles;
+  double cluster_query_cycles;
+  double query_cycles;
+  int hits;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+extern "C" {
+
+static int count_hits(struct GeoVertexArray *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+}
+
+static double time_queries(struct GeoHashedOctree *tree,
+                           const std::vector<struct GeoPoint> &queries,
+                           double eps, int *hits) {
+  uint64_t start = rdtsc();
+  for (const auto &p : queries) {
+    GeoHOVisitNearVertices(tree, &p, eps, count_hits, hits);
+  }
+  uint64_t end = rdtsc();
+  return (double)(end - start) / queries.size();
+}
+
+// depth 0 stands for an adaptive tree.
+static TreeStats run_tree(int depth, const Configuration &conf,
+                          const struct GeoVertexArray &va,
+                          const std::vector<struct GeoPoint> &cluster_queries,
+                          const std::vector<struct GeoPoint> &queries) {
+  struct GeoHashedOctree tree;
+  if (depth == 0) {
+    GeoHOInitializeAdaptive(&tree, UnitCube(), conf.leaf_capacity);
+  } else {
+    GeoHOInitializeWithDepth(&tree, UnitCube(), depth);
+  }
+  TreeStats stats;
+  uint64_t start = rdtsc();
+  GeoHOInsert(&tree, &va);
+  uint64_t end = rdtsc();
+  stats.insert_cycles = (double)(end - start);
+  stats.hits = 0;
+  stats.cluster_query_cycles =
+      time_queries(&tree, cluster_queries, conf.epsilon, &stats.hits);
+  stats.query_cycles = time_queries(&tree, queries, conf.epsilon, &stats.hits);
+  GeoHODestroy(&tree);
+  return stats;
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  // 90% of the vertices are in 10 clusters of size cluster_width, the
+  // others are spread over the unit cube.
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  std::uniform_real_distribution<> offset(-0.5 * conf.cluster_width,
+                                          0.5 * conf.cluster_width);
+  std::vector<struct GeoPoint> centers(10);
+  for (auto &c : centers) c = {dist(gen), dist(gen), dist(gen)};
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, conf.num_vertices);
+  for (int i = 0; i < conf.num_vertices; ++i) {
+    if (i % 10 == 0) {
+      va.x[i] = dist(gen);
+      va.y[i] = dist(gen);
+      va.z[i] = dist(gen);
+    } else {
+      const struct GeoPoint &c = centers[i % centers.size()];
+      va.x[i] = c.x + offset(gen);
+      va.y[i] = c.y + offset(gen);
+      va.z[i] = c.z + offset(gen);
+    }
+    va.ptrs[i] = 0;
+  }
+
+  std::vector<struct GeoPoint> cluster_queries(conf.num_queries);
+  for (int q = 0; q < conf.num_queries; ++q) {
+    const struct GeoPoint &c = centers[q % centers.size()];
+    cluster_queries[q] = {c.x + offset(gen), c.y + offset(gen),
+                          c.z + offset(gen)};
+  }
+  std::vector<struct GeoPoint> queries(conf.num_queries);
+  for (auto &p : queries) p = {dist(gen), dist(gen), dist(gen)};
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_queries\": " << conf.num_queries << ",\n";
+  std::cout << "  \"epsilon\": " << conf.epsilon << ",\n";
+  std::cout << "  \"cluster_width\": " << conf.cluster_width << ",\n";
+  std::cout << "  \"leaf_capacity\": " << conf.leaf_capacity << ",\n";
+  std::cout << "  \"trees\": {\n";
+  const int depths[] = {GeoNodeMaxDepth(), GeoNodeMaxDepth64(), 0};
+  const char *names[] = {"fixed", "deep", "adaptive"};
+  int hits = -1;
+  for (int i = 0; i < 3; ++i) {
+    TreeStats stats = run_tree(depths[i], conf, va, cluster_queries, queries);
+    if (hits >= 0 && stats.hits != hits) {
+      std::cerr << "Error: " << names[i] << " tree found " << stats.hits <<
+          " instead of " << hits << " vertices." << std::endl;
+    }
+    hits = stats.hits;
+    std::cout << "    \"" << names[i] << "\": {\n";
+    std::cout << "      \"insert_cycles\":        " << stats.insert_cycles <<
+        ",\n";
+    std::cout << "      \"cluster_query_cycles\": " <<
+        stats.cluster_query_cycles << ",\n";
+    std::cout << "      \"query_cycles\":         " << stats.query_cycles <<
+        "\n";
+    std::cout << "    }" << (i < 2 ? "," : "") << "\n";
+  }
+  std::cout << "  }\n";
+  std::cout << "}\n";
+
+  GeoVADestroy(&va);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: clustered_query_test "
+    "[--num_vertices num_vertices] "
+    "[--num_queries num_queries] "
+    "[--epsilon epsilon] "
+    "[--cluster_width width] "
+    "[--leaf_capacity capacity] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_vertices = 1000000;
+  conf.num_queries = 10000;
+  conf.epsilon = 1.0e-4;
+  conf.cluster_width = 1.0e-2;
+  conf.leaf_capacity = 32;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_vertices", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of vertices parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_vertices = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_queries", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of queries parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_queries = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--epsilon", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: epsilon missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.epsilon = std::stod(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--cluster_width", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Cluster width missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.cluster_width = std::stod(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--leaf_capacity", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Leaf capacity missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.leaf_capacity = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
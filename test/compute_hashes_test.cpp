@@ -0,0 +1,138 @@
+#include <spatial_hash.h>
+#include <vertex_array.h>
+#include <test_utilities.h>
+#include <string>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+
+struct Configuration {
+  int num_vertices;
+  int num_iter;
+};
+
+struct TimingResults {
+  double scalar;
+  double batched;
+  double batched64;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  TimingResults results = {0, 0, 0};
+
+  struct GeoBoundingBox bbox = UnitCube();
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, conf.num_vertices);
+  std::vector<int> indices(conf.num_vertices);
+  FillWithRandomItems(&va, &bbox, conf.num_vertices, &indices[0]);
+  std::vector<GeoSpatialHash> hashes(conf.num_vertices);
+  std::vector<GeoSpatialHash64> hashes64(conf.num_vertices);
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
+  for (int i = 0; i < conf.num_iter; ++i) {
+
+    std::cout << "  \"iteration " << i << "\": {\n";
+
+    std::cout << "    \"timings\": {\n";
+
+    uint64_t start, end;
+    start = rdtsc();
+    for (int j = 0; j < va.size; ++j) {
+      struct GeoPoint p = {va.x[j], va.y[j], va.z[j]};
+      hashes[j] = GeoComputeHash(&bbox, &p);
+    }
+    end = rdtsc();
+    std::cout << "      \"scalar\":    " << (end - start) / 1.0e6 << ",\n";
+    results.scalar += (end - start) / 1.0e6;
+
+    start = rdtsc();
+    GeoComputeHashes(&bbox, &va, &hashes[0]);
+    end = rdtsc();
+    std::cout << "      \"batched\":   " << (end - start) / 1.0e6 << ",\n";
+    results.batched += (end - start) / 1.0e6;
+
+    start = rdtsc();
+    GeoComputeHashes64(&bbox, &va, &hashes64[0]);
+    end = rdtsc();
+    std::cout << "      \"batched64\": " << (end - start) / 1.0e6 << "\n";
+    results.batched64 += (end - start) / 1.0e6;
+
+    std::cout << "    }\n  }," << std::endl;
+  }
+
+  std::cout << "  \"totals\": {\n";
+  std::cout << "    \"scalar\":      " << results.scalar << ",\n";
+  std::cout << "    \"batched\":     " << results.batched << ",\n";
+  std::cout << "    \"batched64\":   " << results.batched64 << "\n";
+  std::cout << "  },\n";
+
+  std::cout << "  \"averages\": {\n";
+  std::cout << "    \"scalar\":      " << results.scalar / conf.num_iter << ",\n";
+  std::cout << "    \"batched\":     " << results.batched / conf.num_iter << ",\n";
+  std::cout << "    \"batched64\":   " << results.batched64 / conf.num_iter << "\n";
+  std::cout << "  }\n";
+  std::cout << "}\n";
+
+  GeoVADestroy(&va);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: compute_hashes_test "
+    "[--num_vertices num_vertices] "
+    "[--num_iter num_iter] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_vertices = 100;
+  conf.num_iter = 10;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_vertices", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of vertices parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_vertices = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_iter", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of iterations parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_iter = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
@@ -0,0 +1,203 @@
+#include <hashed_octree.h>
+#include <transformation.h>
+#include <test_utilities.h>
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_vertices;
+  int num_queries;
+  double epsilon;
+};
+
+struct TreeStats {
+  double bytes_per_vertex;
+  double build_cycles;
+  double query_cycles;
+  double update_cycles;
+  int hits;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+extern "C" {
+
+static int count_hits(struct GeoVertexArray *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+}
+
+static double time_queries(struct GeoHashedOctree *tree,
+                           const std::vector<struct GeoPoint> &queries,
+                           double eps, int *hits) {
+  uint64_t start = rdtsc();
+  for (const auto &p : queries) {
+    GeoHOVisitNearVertices(tree, &p, eps, count_hits, hits);
+  }
+  uint64_t end = rdtsc();
+  return (double)(end - start) / queries.size();
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+  int n = conf.num_vertices;
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> fx(n), fy(n), fz(n);
+  for (int i = 0; i < n; ++i) {
+    fx[i] = dist(gen);
+    fy[i] = dist(gen);
+    fz[i] = dist(gen);
+  }
+  // The same vertices in double precision so that all trees find the
+  // same hits.
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, n);
+  for (int i = 0; i < n; ++i) {
+    va.x[i] = fx[i];
+    va.y[i] = fy[i];
+    va.z[i] = fz[i];
+    va.ptrs[i] = 0;
+  }
+  std::vector<struct GeoPoint> queries(conf.num_queries);
+  for (auto &p : queries) p = {dist(gen), dist(gen), dist(gen)};
+  // A small shift that moves few vertices out of their leaf.
+  double T[3][4] = {
+      {1, 0, 0, 1.0e-7},
+      {0, 1, 0, 1.0e-7},
+      {0, 0, 1, 1.0e-7}};
+
+  const char *names[] = {"stored", "attached", "float"};
+  // Coordinates, ptrs and hashes of stored trees; hashes and the
+  // permutation of attached trees plus the caller's coordinates.
+  const double bytes[] = {40, 36, 24};
+  TreeStats stats[3];
+  for (int t = 0; t < 3; ++t) {
+    struct GeoHashedOctree tree;
+    GeoHOInitialize(&tree, UnitCube());
+    uint64_t start = rdtsc();
+    if (t == 0) {
+      GeoHOInsert(&tree, &va);
+    } else if (t == 1) {
+      GeoHOAttach(&tree, va.x, va.y, va.z, n);
+    } else {
+      GeoHOAttachFloat(&tree, fx.data(), fy.data(), fz.data(), n);
+    }
+    uint64_t end = rdtsc();
+    stats[t].bytes_per_vertex = bytes[t];
+    stats[t].build_cycles = (double)(end - start);
+    stats[t].hits = 0;
+    stats[t].query_cycles =
+        time_queries(&tree, queries, conf.epsilon, &stats[t].hits);
+    stats[t].update_cycles = 0;
+    if (t > 0) {
+      start = rdtsc();
+      if (t == 1) {
+        GeoApplyTransformInplace(T, &va);
+      } else {
+        GeoApplyTransformFloatInplace(T, fx.data(), fy.data(), fz.data(), n);
+      }
+      GeoHOUpdate(&tree);
+      end = rdtsc();
+      stats[t].update_cycles = (double)(end - start);
+    }
+    GeoHODestroy(&tree);
+    if (stats[t].hits != stats[0].hits) {
+      std::cerr << "Error: " << names[t] << " tree found " << stats[t].hits <<
+          " instead of " << stats[0].hits << " vertices." << std::endl;
+    }
+  }
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_queries\": " << conf.num_queries << ",\n";
+  std::cout << "  \"epsilon\": " << conf.epsilon << ",\n";
+  std::cout << "  \"trees\": {\n";
+  for (int t = 0; t < 3; ++t) {
+    std::cout << "    \"" << names[t] << "\": {\n";
+    std::cout << "      \"bytes_per_vertex\": " << stats[t].bytes_per_vertex <<
+        ",\n";
+    std::cout << "      \"build_cycles\":     " << stats[t].build_cycles <<
+        ",\n";
+    std::cout << "      \"query_cycles\":     " << stats[t].query_cycles <<
+        ",\n";
+    std::cout << "      \"update_cycles\":    " << stats[t].update_cycles <<
+        "\n";
+    std::cout << "    }" << (t < 2 ? "," : "") << "\n";
+  }
+  std::cout << "  }\n";
+  std::cout << "}\n";
+
+  GeoVADestroy(&va);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: float_attach_test "
+    "[--num_vertices num_vertices] "
+    "[--num_queries num_queries] "
+    "[--epsilon epsilon] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_vertices = 1000000;
+  conf.num_queries = 10000;
+  conf.epsilon = 1.0e-2;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_vertices", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of vertices parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_vertices = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_queries", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of queries parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_queries = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--epsilon", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: epsilon missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.epsilon = std::stod(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
 #include <hashed_bvh.h>
+#include <hashed_octree.h>
+#include <snapshot.h>
 #include <test_utilities.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
 
 
 struct HashedBvh : public ::testing::Test {
@@ -156,3 +161,187 @@ TEST_F(HashedBvh, VisitLargeVolumeIntersection) {
       GeoHBVisitIntersectingVolumes(
           &bvh, &v, CountTraversedNodes, &ctx));
 }
+
+static bool overlap(const struct GeoBoundingBox &a,
+                    const struct GeoBoundingBox &b) {
+  return a.max.x >= b.min.x && b.max.x >= a.min.x &&
+         a.max.y >= b.min.y && b.max.y >= a.min.y &&
+         a.max.z >= b.min.z && b.max.z >= a.min.z;
+}
+
+extern "C" int CollectDataBlock(struct GeoBoundingBox *, void **data,
+                                const int *indices, int n, void *ctx) {
+  EXPECT_LT(0, n);
+  EXPECT_GE(128, n);
+  for (int j = 0; j < n; ++j) {
+    static_cast<std::vector<void*>*>(ctx)->push_back(data[indices[j]]);
+  }
+  return 1;
+}
+
+static void CheckAgainstBruteForce(struct GeoHashedBvh *bvh, double size) {
+  int n = 200;
+  std::vector<struct GeoBoundingBox> volumes(n);
+  std::vector<void*> data(n);
+  std::vector<int> indices(n);
+  FillWithRandomVolumes(&volumes[0], &data[0], n, &bvh->bbox, &indices[0]);
+  // Shrink the volumes so that they end up at all levels of the tree.
+  for (int i = 0; i < n; ++i) {
+    double s = size * (i % 10) / 10.0;
+    volumes[i].max.x = volumes[i].min.x + s * (volumes[i].max.x - volumes[i].min.x);
+    volumes[i].max.y = volumes[i].min.y + s * (volumes[i].max.y - volumes[i].min.y);
+    volumes[i].max.z = volumes[i].min.z + s * (volumes[i].max.z - volumes[i].min.z);
+  }
+  GeoHBInsert(bvh, n, &volumes[0], &data[0]);
+  for (int i = 0; i < n; i += 7) {
+    struct CountIntersectingVolumesCtx ctx;
+    ctx.count = 0;
+    GeoHBVisitIntersectingVolumes(bvh, &volumes[i], CountTraversedNodes, &ctx);
+    int expected = 0;
+    for (int j = 0; j < n; ++j) {
+      if (overlap(volumes[i], volumes[j])) ++expected;
+    }
+    EXPECT_EQ(expected, ctx.count) << ">>> i == " << i;
+    std::vector<void*> visited;
+    GeoHBVisitIntersectingVolumeBlocks(bvh, &volumes[i], CollectDataBlock,
+                                       &visited);
+    EXPECT_EQ(expected, (int)visited.size()) << ">>> i == " << i;
+  }
+}
+
+TEST_F(HashedBvh, AgreesWithBruteForce) {
+  CheckAgainstBruteForce(&bvh, 1.0e-2);
+}
+
+TEST_F(HashedBvh, AgreesWithBruteForceTinyVolumes) {
+  CheckAgainstBruteForce(&bvh, 1.0e-5);
+}
+
+TEST_F(HashedBvh, DeepBvhAgreesWithBruteForce) {
+  GeoHBDestroy(&bvh);
+  GeoHBInitializeWithDepth(&bvh, {{0.2, 1.3, -5.2}, {4.0, 2.5, 1.0}},
+                           GEO_HASHED_BVH_MAX_DEPTH_64);
+  CheckAgainstBruteForce(&bvh, 1.0e-5);
+}
+
+TEST_F(HashedBvh, HilbertBvhAgreesWithBruteForce) {
+  GeoHBSetKeyOrder(&bvh, GEO_KEY_ORDER_HILBERT);
+  CheckAgainstBruteForce(&bvh, 1.0e-2);
+}
+
+TEST_F(HashedBvh, DeepHilbertBvhAgreesWithBruteForce) {
+  GeoHBDestroy(&bvh);
+  GeoHBInitializeWithDepth(&bvh, {{0.2, 1.3, -5.2}, {4.0, 2.5, 1.0}},
+                           GEO_HASHED_BVH_MAX_DEPTH_64);
+  GeoHBSetKeyOrder(&bvh, GEO_KEY_ORDER_HILBERT);
+  CheckAgainstBruteForce(&bvh, 1.0e-5);
+}
+
+extern "C" int CollectData(struct GeoBoundingBox *, void **data, int i,
+                           void *ctx) {
+  static_cast<std::vector<void*>*>(ctx)->push_back(data[i]);
+  return 1;
+}
+
+extern "C" int StopAtFirstBlock(struct GeoBoundingBox *, void **,
+                                const int *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 0;
+}
+
+TEST_F(HashedBvh, BlockVisitorAgreesWithVolumeVisitor) {
+  int n = 1000;
+  std::vector<struct GeoBoundingBox> volumes(n);
+  std::vector<void*> data(n);
+  std::vector<int> indices(n);
+  FillWithRandomVolumes(&volumes[0], &data[0], n, &bvh.bbox, &indices[0]);
+  for (int i = 0; i < n; ++i) data[i] = &indices[i];
+  GeoHBInsert(&bvh, n, &volumes[0], &data[0]);
+  struct GeoBoundingBox queries[2] = {bvh.bbox, volumes[0]};
+  scale_bbox(&queries[1], 0.5);
+  for (const auto &q : queries) {
+    std::vector<void*> expected, visited;
+    GeoHBVisitIntersectingVolumes(&bvh, &q, CollectData, &expected);
+    GeoHBVisitIntersectingVolumeBlocks(&bvh, &q, CollectDataBlock, &visited);
+    std::sort(expected.begin(), expected.end());
+    std::sort(visited.begin(), visited.end());
+    EXPECT_EQ(expected, visited);
+    int blocks = 0;
+    GeoHBVisitIntersectingVolumeBlocks(&bvh, &q, StopAtFirstBlock, &blocks);
+    EXPECT_EQ(expected.empty() ? 0 : 1, blocks);
+  }
+}
+
+TEST_F(HashedBvh, MappedSnapshotEqualsSavedBvh) {
+  std::string path = "hashed_bvh_test.geohb";
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    GeoHBDestroy(&bvh);
+    GeoHBInitialize(&bvh, {{0.2, 1.3, -5.2}, {4.0, 2.5, 1.0}});
+    GeoHBSetKeyOrder(&bvh, order);
+    int n = 300;
+    std::vector<struct GeoBoundingBox> volumes(n);
+    std::vector<void*> data(n);
+    std::vector<int> indices(n);
+    FillWithRandomVolumes(&volumes[0], &data[0], n, &bvh.bbox, &indices[0]);
+    for (int i = 0; i < n; ++i) {
+      double s = 1.0e-2 * (i % 10) / 10.0;
+      volumes[i].max.x = volumes[i].min.x + s * (volumes[i].max.x - volumes[i].min.x);
+      volumes[i].max.y = volumes[i].min.y + s * (volumes[i].max.y - volumes[i].min.y);
+      volumes[i].max.z = volumes[i].min.z + s * (volumes[i].max.z - volumes[i].min.z);
+      data[i] = (void*)(uintptr_t)i;
+    }
+    GeoHBInsert(&bvh, n / 2, &volumes[0], &data[0]);
+    GeoHBInsert(&bvh, n - n / 2, &volumes[n / 2], &data[n / 2]);
+    ASSERT_EQ(0, GeoHBSave(&bvh, path.c_str()));
+
+    struct GeoHashedBvh mapped;
+    ASSERT_EQ(0, GeoHBMap(&mapped, path.c_str()));
+    EXPECT_EQ(bvh.num_nodes, mapped.num_nodes);
+    for (int i = 0; i < n; i += 7) {
+      std::vector<void*> expected, found;
+      GeoHBVisitIntersectingVolumes(&bvh, &volumes[i], CollectData, &expected);
+      GeoHBVisitIntersectingVolumes(&mapped, &volumes[i], CollectData, &found);
+      EXPECT_FALSE(found.empty());
+      // The snapshot refers to the data by index into bvh.data.
+      for (auto &d : found) d = bvh.data[(uintptr_t)d];
+      EXPECT_EQ(expected, found);
+    }
+    GeoHBDestroy(&mapped);
+  }
+  std::remove(path.c_str());
+}
+
+TEST_F(HashedBvh, MappingAnInvalidSnapshotFails) {
+  std::string path = "hashed_bvh_test.geohb";
+  struct GeoHashedBvh mapped;
+  std::remove(path.c_str());
+  EXPECT_EQ(-1, GeoHBMap(&mapped, path.c_str()));
+  // An octree snapshot isn't a bvh snapshot.
+  struct GeoHashedOctree octree;
+  GeoHOInitialize(&octree, bvh.bbox);
+  ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+  GeoHODestroy(&octree);
+  EXPECT_EQ(-1, GeoHBMap(&mapped, path.c_str()));
+
+  // A node whose child is past the nodes.
+  int n = 50;
+  std::vector<struct GeoBoundingBox> volumes(n);
+  std::vector<void*> data(n);
+  std::vector<int> indices(n);
+  FillWithRandomVolumes(&volumes[0], &data[0], n, &bvh.bbox, &indices[0]);
+  GeoHBInsert(&bvh, n, &volumes[0], &data[0]);
+  ASSERT_LT(0, bvh.num_nodes);
+  ASSERT_EQ(0, GeoHBSave(&bvh, path.c_str()));
+  FILE *f = fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, f);
+  struct GeoSnapshotHeader header;
+  ASSERT_EQ(1u, fread(&header, sizeof(header), 1, f));
+  // The nodes are the fourth section; the first child of the first node
+  // follows its size.
+  fseek(f, header.offsets[3] + sizeof(int32_t), SEEK_SET);
+  int32_t child = bvh.num_nodes;
+  ASSERT_EQ(1u, fwrite(&child, sizeof(child), 1, f));
+  fclose(f);
+  EXPECT_EQ(-1, GeoHBMap(&mapped, path.c_str()));
+  std::remove(path.c_str());
+}
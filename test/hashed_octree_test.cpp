@@ -1,7 +1,16 @@
 #include <gtest/gtest.h>
 #include <hashed_octree.h>
+#include <snapshot.h>
 #include <test_utilities.h>
+#include <transformation.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
 #include <random>
+#include <string>
+#include <tuple>
+#include <vector>
 
 
 namespace {
@@ -347,4 +356,1603 @@ TEST_F(HashedOctree, CanDealWithManyDuplicates) {
   EXPECT_EQ(0, count_close_pairs(&octree.vertices, my_eps));
 }
 
+TEST_F(HashedOctree, DeepTreeVisitsNearbyVertex) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}},
+                           GeoNodeMaxDepth64());
+  int num_vertices = 100;
+  GeoVAResize(&vertex_array, num_vertices);
+  indices.resize(num_vertices);
+  FillWithRandomItems(&vertex_array, &octree.bbox, num_vertices, &indices[0]);
+  vertex_array.x[0] = 0.5 - 0.2 * eps;
+  vertex_array.y[0] = 0.2;
+  vertex_array.z[0] = 0.3;
+  vertex_array.x[1] = 0.5 + 0.2 * eps;
+  vertex_array.y[1] = vertex_array.y[0];
+  vertex_array.z[1] = vertex_array.z[0];
+
+  GeoHOInsert(&octree, &vertex_array);
+  for (int i = 0; i < num_vertices - 1; ++i) {
+    EXPECT_LE(octree.hashes[i], octree.hashes[i + 1]) <<
+        ">>> i == " << i;
+  }
+
+  struct CountVisitsCtx ctx = {&indices[0], 0};
+  struct GeoPoint p = {
+    vertex_array.x[0], vertex_array.y[0], vertex_array.z[0]};
+  GeoHOVisitNearVertices(&octree, &p, eps,
+                         CountVisits, &ctx);
+  EXPECT_GT(ctx.visits, 0);
+}
+
+TEST_F(HashedOctree, NoDuplicatesAfterDeduplicateDeepTree) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}},
+                           GeoNodeMaxDepth64());
+  int num_vertices = 500;
+  GeoVAResize(&vertex_array, num_vertices);
+  indices.resize(num_vertices);
+  FillWithRandomItems(&vertex_array, &octree.bbox, num_vertices, &indices[0]);
+  GeoHOInsert(&octree, &vertex_array);
+  double my_eps = 1.0e-2;
+  GeoHODeleteDuplicates(&octree, my_eps, TrivialDtor, 0);
+  EXPECT_EQ(0, count_close_pairs(&octree.vertices, my_eps));
+}
+
+extern "C" {
+
+int CountAll(struct GeoVertexArray *, int, void* ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+}
+
+int count_near(const struct GeoVertexArray *va, const struct GeoPoint *p,
+               double my_eps) {
+  int n = 0;
+  for (int i = 0; i < va->size; ++i) {
+    if (fabs(va->x[i] - p->x) <= my_eps &&
+        fabs(va->y[i] - p->y) <= my_eps &&
+        fabs(va->z[i] - p->z) <= my_eps) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+int count_in_ball(const struct GeoVertexArray *va, const struct GeoPoint *p,
+                  double radius) {
+  int n = 0;
+  for (int i = 0; i < va->size; ++i) {
+    double dx = va->x[i] - p->x, dy = va->y[i] - p->y, dz = va->z[i] - p->z;
+    if (dx * dx + dy * dy + dz * dz <= radius * radius) ++n;
+  }
+  return n;
+}
+
+extern "C" int StopAtFirst(struct GeoVertexArray *, int, void* ctx) {
+  ++*static_cast<int*>(ctx);
+  return 0;
+}
+
+extern "C" int CountBlockHits(struct GeoVertexArray *, const int *, int n,
+                              void *ctx) {
+  EXPECT_LT(0, n);
+  EXPECT_GE(128, n);
+  *static_cast<int*>(ctx) += n;
+  return 1;
+}
+
+extern "C" int StopAtFirstBlock(struct GeoVertexArray *, const int *, int,
+                                void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 0;
+}
+
+bool in_box(const struct GeoPoint &p, const struct GeoBoundingBox &b) {
+  return b.min.x <= p.x && p.x <= b.max.x &&
+      b.min.y <= p.y && p.y <= b.max.y &&
+      b.min.z <= p.z && p.z <= b.max.z;
+}
+
+int count_in_box(const struct GeoVertexArray *va,
+                 const struct GeoBoundingBox &b) {
+  int n = 0;
+  for (int i = 0; i < va->size; ++i) {
+    if (in_box({va->x[i], va->y[i], va->z[i]}, b)) ++n;
+  }
+  return n;
+}
+
+void CheckQueriesAgainstBruteForce(struct GeoHashedOctree *octree,
+                                   struct GeoVertexArray *vertex_array,
+                                   std::vector<int> *indices) {
+  int num_vertices = 1000;
+  GeoVAResize(vertex_array, num_vertices);
+  indices->resize(num_vertices);
+  FillWithRandomItems(vertex_array, &octree->bbox, num_vertices,
+                      &(*indices)[0]);
+  GeoHOInsert(octree, vertex_array);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  for (double my_eps : {1.0e-3, 3.0e-2, 2.0e-1}) {
+    for (int i = 0; i < 100; ++i) {
+      struct GeoPoint p = {dist(gen), dist(gen), dist(gen)};
+      int visits = 0;
+      GeoHOVisitNearVertices(octree, &p, my_eps, CountAll, &visits);
+      int expected = count_near(&octree->vertices, &p, my_eps);
+      EXPECT_EQ(expected, visits);
+      int ball_visits = 0;
+      GeoHOVisitVerticesInBall(octree, &p, my_eps, CountAll, &ball_visits);
+      EXPECT_EQ(count_in_ball(&octree->vertices, &p, my_eps), ball_visits);
+      int stopped_visits = 0;
+      GeoHOVisitNearVertices(octree, &p, my_eps, StopAtFirst,
+                             &stopped_visits);
+      EXPECT_EQ(std::min(expected, 1), stopped_visits);
+    }
+  }
+}
+
+TEST_F(HashedOctree, QueriesAgreeWithBruteForce) {
+  CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+}
+
+TEST_F(HashedOctree, HilbertQueriesAgreeWithBruteForce) {
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+}
+
+TEST_F(HashedOctree, DeepHilbertQueriesAgreeWithBruteForce) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}},
+                           GeoNodeMaxDepth64());
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+}
+
+TEST_F(HashedOctree, AdaptiveQueriesAgreeWithBruteForce) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (int capacity : {1, 16}) {
+      GeoHODestroy(&octree);
+      GeoHOInitializeAdaptive(&octree, {{0, 0, 0}, {1, 1, 1}}, capacity);
+      GeoHOSetKeyOrder(&octree, order);
+      CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+    }
+  }
+}
+
+// Most vertices lie in two small clusters, the others are spread out.
+const struct GeoPoint cluster_centers[] = {{0.3, 0.3, 0.3}, {0.71, 0.52, 0.9}};
+
+void FillClustered(struct GeoVertexArray *va, int n) {
+  GeoVAResize(va, n);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  std::uniform_real_distribution<> cluster(-1.0e-3, 1.0e-3);
+  for (int i = 0; i < n; ++i) {
+    if (i % 10 == 0) {
+      va->x[i] = dist(gen);
+      va->y[i] = dist(gen);
+      va->z[i] = dist(gen);
+    } else {
+      const struct GeoPoint &c = cluster_centers[i % 2];
+      va->x[i] = c.x + cluster(gen);
+      va->y[i] = c.y + cluster(gen);
+      va->z[i] = c.z + cluster(gen);
+    }
+    va->ptrs[i] = 0;
+  }
+}
+
+// Queries are near the clusters or anywhere.
+void CheckClusteredQueries(struct GeoHashedOctree *octree,
+                           const struct GeoVertexArray *va) {
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  std::uniform_real_distribution<> cluster(-1.0e-3, 1.0e-3);
+  for (double my_eps : {1.0e-5, 1.0e-4, 3.0e-2}) {
+    for (int q = 0; q < 60; ++q) {
+      struct GeoPoint p = {dist(gen), dist(gen), dist(gen)};
+      if (q % 3 != 0) {
+        const struct GeoPoint &c = cluster_centers[q % 2];
+        p = {c.x + cluster(gen), c.y + cluster(gen), c.z + cluster(gen)};
+      }
+      int visits = 0;
+      GeoHOVisitNearVertices(octree, &p, my_eps, CountAll, &visits);
+      EXPECT_EQ(count_near(va, &p, my_eps), visits);
+      int ball_visits = 0;
+      GeoHOVisitVerticesInBall(octree, &p, my_eps, CountAll, &ball_visits);
+      EXPECT_EQ(count_in_ball(va, &p, my_eps), ball_visits);
+    }
+  }
+}
+
+TEST_F(HashedOctree, AdaptiveClusteredQueriesAgreeWithBruteForce) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (auto mode : {GEO_INSERT_MERGE, GEO_INSERT_RUNS}) {
+      GeoHODestroy(&octree);
+      GeoHOInitializeAdaptive(&octree, {{0, 0, 0}, {1, 1, 1}}, 32);
+      GeoHOSetKeyOrder(&octree, order);
+      GeoHOSetInsertMode(&octree, mode);
+      // Two insertions so that there are runs.
+      FillClustered(&vertex_array, 20000);
+      GeoHOInsert(&octree, &vertex_array);
+      struct GeoVertexArray all = GeoVACopy(&vertex_array);
+      FillClustered(&vertex_array, 15000);
+      GeoHOInsert(&octree, &vertex_array);
+      GeoVAResize(&all, 35000);
+      for (int i = 0; i < 15000; ++i) {
+        all.x[20000 + i] = vertex_array.x[i];
+        all.y[20000 + i] = vertex_array.y[i];
+        all.z[20000 + i] = vertex_array.z[i];
+      }
+      CheckClusteredQueries(&octree, &all);
+      // The capacity only affects queries.
+      GeoHOSetLeafCapacity(&octree, 0);
+      CheckClusteredQueries(&octree, &all);
+      GeoVADestroy(&all);
+    }
+  }
+}
+
+TEST_F(HashedOctree, QueriesAgreeWithBruteForceForAllDirectorySizes) {
+  for (int bits : {0, 1, 7, GEO_HO_MAX_DIRECTORY_BITS}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetDirectoryBits(&octree, bits);
+    CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+    EXPECT_LE(octree.directory_bits, bits);
+  }
+}
+
+TEST_F(HashedOctree, AdaptiveQueriesAgreeWithBruteForceForAllDirectorySizes) {
+  for (int bits : {0, 1, 7, GEO_HO_MAX_DIRECTORY_BITS}) {
+    GeoHODestroy(&octree);
+    GeoHOInitializeAdaptive(&octree, {{0, 0, 0}, {1, 1, 1}}, 4);
+    GeoHOSetDirectoryBits(&octree, bits);
+    CheckQueriesAgainstBruteForce(&octree, &vertex_array, &indices);
+  }
+}
+
+TEST_F(HashedOctree, DirectoryIsBoundedByNumberOfVertices) {
+  EXPECT_EQ(0, octree.directory_bits);
+  int num_vertices = 100;
+  GeoVAResize(&vertex_array, num_vertices);
+  indices.resize(num_vertices);
+  FillWithRandomItems(&vertex_array, &octree.bbox, num_vertices, &indices[0]);
+  GeoHOInsert(&octree, &vertex_array);
+  EXPECT_EQ(7, octree.directory_bits);
+  int n = 1 << octree.directory_bits;
+  for (int b = 0; b < n; ++b) {
+    int shift = 3 * octree.depth - octree.directory_bits;
+    for (uint32_t i = octree.directory[b]; i < octree.directory[b + 1]; ++i) {
+      EXPECT_EQ(b, octree.hashes[i] >> shift);
+    }
+  }
+  EXPECT_EQ(num_vertices, octree.directory[n]);
+}
+
+TEST_F(HashedOctree, QueriesAgreeWithBruteForceAfterDeduplication) {
+  int num_vertices = 3000;
+  GeoVAResize(&vertex_array, num_vertices);
+  indices.resize(num_vertices);
+  FillWithRandomItems(&vertex_array, &octree.bbox, num_vertices, &indices[0]);
+  GeoHOInsert(&octree, &vertex_array);
+  GeoHODeleteDuplicates(&octree, 3.0e-2, TrivialDtor, 0);
+  ASSERT_LT(octree.vertices.size, num_vertices);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  for (int i = 0; i < 100; ++i) {
+    struct GeoPoint p = {dist(gen), dist(gen), dist(gen)};
+    int visits = 0;
+    GeoHOVisitNearVertices(&octree, &p, 1.0e-1, CountAll, &visits);
+    EXPECT_EQ(count_near(&octree.vertices, &p, 1.0e-1), visits);
+  }
+}
+
+// In an elongated box the volume criterion stops at nodes that are much
+// smaller than epsilon along x and y so a query touches many nodes.
+TEST_F(HashedOctree, QueriesTouchingManyNodesAgreeWithBruteForce) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    GeoHODestroy(&octree);
+    struct GeoBoundingBox bbox = {{0, 0, 0}, {1, 1, 1000}};
+    GeoHOInitializeWithDepth(&octree, bbox, GeoNodeMaxDepth64());
+    GeoHOSetKeyOrder(&octree, order);
+    int num_vertices = 2000;
+    GeoVAResize(&vertex_array, num_vertices);
+    indices.resize(num_vertices);
+    FillWithRandomItems(&vertex_array, &bbox, num_vertices, &indices[0]);
+    GeoHOInsert(&octree, &vertex_array);
+    double my_eps = 5.0e-2;
+    for (int i = 0; i < 100; ++i) {
+      struct GeoPoint p = {
+        octree.vertices.x[i], octree.vertices.y[i], octree.vertices.z[i]};
+      int visits = 0;
+      GeoHOVisitNearVertices(&octree, &p, my_eps, CountAll, &visits);
+      EXPECT_EQ(count_near(&octree.vertices, &p, my_eps), visits);
+    }
+  }
+}
+
+// Large enough for the threaded insertion. Half of the second batch are
+// copies of vertices of the first batch. On ties the new vertices go first
+// and vertices of the same batch keep their input order.
+// Some vertices lie outside of the tree's box and some boxes have faces
+// through vertices or no extent at all.
+void CheckBoxQueriesAgainstBruteForce(struct GeoHashedOctree *octree,
+                                      struct GeoVertexArray *vertex_array) {
+  int num_vertices = 3000;
+  struct GeoBoundingBox fill_box = {{-0.1, -0.1, -0.1}, {1.1, 1.1, 1.1}};
+  std::vector<int> indices(num_vertices);
+  GeoVAResize(vertex_array, num_vertices);
+  FillWithRandomItems(vertex_array, &fill_box, num_vertices, &indices[0]);
+  GeoHOInsert(octree, vertex_array);
+  const struct GeoVertexArray *va = &octree->vertices;
+  std::uniform_real_distribution<> dist(-0.2, 1.2);
+  std::uniform_int_distribution<> vertex(0, num_vertices - 1);
+  for (int q = 0; q < 300; ++q) {
+    double a[3] = {dist(gen), dist(gen), dist(gen)};
+    double b[3] = {dist(gen), dist(gen), dist(gen)};
+    for (int k = 0; k < 3; ++k) {
+      if (q % 3 == 1) {
+        // Shrink to a tenth of the size.
+        b[k] = a[k] + 0.1 * (b[k] - a[k]);
+      }
+      if (a[k] > b[k]) std::swap(a[k], b[k]);
+    }
+    struct GeoBoundingBox box = {{a[0], a[1], a[2]}, {b[0], b[1], b[2]}};
+    if (q % 5 == 2) {
+      int i = vertex(gen);
+      box.min.x = va->x[i];
+      box.max.y = va->y[i];
+      box.min.z = box.max.z = va->z[i];
+      if (box.max.x < box.min.x) box.max.x = box.min.x;
+      if (box.min.y > box.max.y) box.min.y = box.max.y;
+    }
+    int expected = count_in_box(va, box);
+    int visits = 0;
+    GeoHOVisitVerticesInBox(octree, &box, CountAll, &visits);
+    EXPECT_EQ(expected, visits);
+    int stopped_visits = 0;
+    GeoHOVisitVerticesInBox(octree, &box, StopAtFirst, &stopped_visits);
+    EXPECT_EQ(std::min(expected, 1), stopped_visits);
+    int block_hits = 0;
+    GeoHOVisitVertexBlocksInBox(octree, &box, CountBlockHits, &block_hits);
+    EXPECT_EQ(expected, block_hits);
+    int stopped_blocks = 0;
+    GeoHOVisitVertexBlocksInBox(octree, &box, StopAtFirstBlock,
+                                &stopped_blocks);
+    EXPECT_EQ(std::min(expected, 1), stopped_blocks);
+  }
+  struct GeoBoundingBox everything = {{-2, -2, -2}, {2, 2, 2}};
+  int visits = 0;
+  GeoHOVisitVerticesInBox(octree, &everything, CountAll, &visits);
+  EXPECT_EQ(num_vertices, visits);
+  visits = 0;
+  GeoHOVisitVertexBlocksInBox(octree, &everything, CountBlockHits, &visits);
+  EXPECT_EQ(num_vertices, visits);
+  struct GeoBoundingBox inverted = {{0.6, 0, 0}, {0.4, 1, 1}};
+  visits = 0;
+  GeoHOVisitVerticesInBox(octree, &inverted, CountAll, &visits);
+  EXPECT_EQ(0, visits);
+}
+
+TEST_F(HashedOctree, BoxQueriesAgreeWithBruteForce) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (int depth : {1, GeoNodeMaxDepth(), GeoNodeMaxDepth64()}) {
+      GeoHODestroy(&octree);
+      GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}}, depth);
+      GeoHOSetKeyOrder(&octree, order);
+      CheckBoxQueriesAgainstBruteForce(&octree, &vertex_array);
+    }
+  }
+}
+
+TEST_F(HashedOctree, BoxQueryInEmptyTree) {
+  struct GeoBoundingBox box = {{0, 0, 0}, {1, 1, 1}};
+  int visits = 0;
+  GeoHOVisitVerticesInBox(&octree, &box, CountAll, &visits);
+  EXPECT_EQ(0, visits);
+}
+
+TEST_F(HashedOctree, LargeInsertionsKeepOrderOfTies) {
+  int n = 100000;
+  GeoVAResize(&vertex_array, n);
+  indices.resize(n);
+  FillWithRandomItems(&vertex_array, &octree.bbox, n, &indices[0]);
+  GeoHOInsert(&octree, &vertex_array);
+
+  struct GeoVertexArray va2;
+  GeoVAInitialize(&va2);
+  GeoVAResize(&va2, n);
+  std::vector<int> indices2(n);
+  FillWithRandomItems(&va2, &octree.bbox, n, &indices2[0]);
+  for (int i = 0; i < n; i += 2) {
+    va2.x[i] = vertex_array.x[i];
+    va2.y[i] = vertex_array.y[i];
+    va2.z[i] = vertex_array.z[i];
+  }
+  GeoHOInsert(&octree, &va2);
+  ASSERT_EQ(2 * n, octree.vertices.size);
+
+  int shift = 3 * (GeoNodeMaxDepth64() - octree.depth);
+  std::vector<std::tuple<uint64_t, int, int, void*>> expected;
+  for (int batch = 0; batch < 2; ++batch) {
+    struct GeoVertexArray *va = batch == 0 ? &va2 : &vertex_array;
+    for (int i = 0; i < n; ++i) {
+      struct GeoPoint p = {va->x[i], va->y[i], va->z[i]};
+      expected.push_back(std::make_tuple(
+          GeoComputeHash64(&octree.bbox, &p) >> shift, batch, i,
+          va->ptrs[i]));
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  for (int i = 0; i < 2 * n; ++i) {
+    ASSERT_EQ(std::get<0>(expected[i]), octree.hashes[i]);
+    ASSERT_EQ(std::get<3>(expected[i]), octree.vertices.ptrs[i]);
+  }
+  GeoVADestroy(&va2);
+}
+
+void CountDtor(void *, void *ctx) {
+  ++*static_cast<int*>(ctx);
+}
+
+// Large enough for the threaded deduplication. A vertex survives if and
+// only if no vertex before it in the tree is within epsilon.
+void CheckDeduplicationKeepsFirstVertexOfEachCluster(
+    struct GeoHashedOctree *octree, GeoDedupMode mode, double my_eps) {
+  int n = 6000;
+  struct GeoVertexArray vertex_array;
+  GeoVAInitialize(&vertex_array);
+  GeoVAResize(&vertex_array, n);
+  std::vector<int> indices(n);
+  FillWithRandomItems(&vertex_array, &octree->bbox, n, &indices[0]);
+  std::uniform_real_distribution<> jitter(-1.0e-3, 1.0e-3);
+  auto near = [&](double x) {
+    return std::min(1.0, std::max(0.0, x + jitter(gen)));
+  };
+  for (int i = 1; i < n; i += 3) {
+    vertex_array.x[i] = near(vertex_array.x[i - 1]);
+    vertex_array.y[i] = near(vertex_array.y[i - 1]);
+    vertex_array.z[i] = near(vertex_array.z[i - 1]);
+  }
+  // Some exact duplicates.
+  for (int i = 2; i < n; i += 9) {
+    vertex_array.x[i] = vertex_array.x[i - 2];
+    vertex_array.y[i] = vertex_array.y[i - 2];
+    vertex_array.z[i] = vertex_array.z[i - 2];
+  }
+  GeoHOInsert(octree, &vertex_array);
+  GeoVADestroy(&vertex_array);
+  std::vector<void*> expected;
+  const struct GeoVertexArray *va = &octree->vertices;
+  for (int i = 0; i < n; ++i) {
+    bool duplicate = false;
+    for (int j = 0; j < i && !duplicate; ++j) {
+      duplicate = fabs(va->x[i] - va->x[j]) <= my_eps &&
+          fabs(va->y[i] - va->y[j]) <= my_eps &&
+          fabs(va->z[i] - va->z[j]) <= my_eps;
+    }
+    if (!duplicate) expected.push_back(va->ptrs[i]);
+  }
+  ASSERT_LT(expected.size(), (size_t)n);
+
+  int num_destroyed = 0;
+  GeoHODeleteDuplicatesWithMode(octree, my_eps, mode, CountDtor,
+                                &num_destroyed);
+  EXPECT_EQ(n - (int)expected.size(), num_destroyed);
+  ASSERT_EQ((int)expected.size(), octree->vertices.size);
+  for (int i = 0; i < octree->vertices.size; ++i) {
+    EXPECT_EQ(expected[i], octree->vertices.ptrs[i]);
+  }
+
+  // The hashes are compacted along with the vertices.
+  for (int i = 0; i < octree->vertices.size; ++i) {
+    struct GeoPoint p = {va->x[i], va->y[i], va->z[i]};
+    int visits = 0;
+    GeoHOVisitNearVertices(octree, &p, 0.0, CountAll, &visits);
+    EXPECT_EQ(1, visits);
+  }
+}
+
+TEST_F(HashedOctree, DeduplicationKeepsFirstVertexOfEachCluster) {
+  CheckDeduplicationKeepsFirstVertexOfEachCluster(&octree, GEO_DEDUP_TREE,
+                                                  1.0e-3);
+}
+
+TEST_F(HashedOctree, GridDeduplicationKeepsFirstVertexOfEachCluster) {
+  CheckDeduplicationKeepsFirstVertexOfEachCluster(&octree, GEO_DEDUP_GRID,
+                                                  1.0e-3);
+}
+
+TEST_F(HashedOctree, GridDeduplicationOfExactDuplicates) {
+  CheckDeduplicationKeepsFirstVertexOfEachCluster(&octree, GEO_DEDUP_GRID,
+                                                  0.0);
+}
+
+TEST_F(HashedOctree, GridDeduplicationWithLargeEpsilon) {
+  CheckDeduplicationKeepsFirstVertexOfEachCluster(&octree, GEO_DEDUP_GRID,
+                                                  3.0e-2);
+}
+
+// Trees that don't grow their box accept vertices of any size. The grid
+// deletes exactly the vertices that have an earlier vertex within eps and
+// never deletes non-finite vertices, just as the tree mode.
+TEST_F(HashedOctree, GridDeduplicationOfNonFiniteAndFarVertices) {
+  const double inf = std::numeric_limits<double>::infinity();
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const std::vector<struct GeoPoint> points = {
+      {0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}, {1e300, 1e300, 1e300},
+      {1e300, 1e300, 1e300}, {nan, 0.5, 0.5}, {nan, 0.5, 0.5},
+      {-1e300, 0.5, 0.5}, {-inf, 0.5, 0.5}, {-inf, 0.5, 0.5},
+      {1e10, -1e10, 0.5}, {1e10, -1e10, 0.5}, {0.5, inf, nan}};
+  const double my_eps = 1.0e-3;
+  std::vector<void*> expected;
+  for (size_t i = 0; i < points.size(); ++i) {
+    bool duplicate = false;
+    for (size_t j = 0; j < i && !duplicate; ++j) {
+      duplicate = fabs(points[i].x - points[j].x) <= my_eps &&
+          fabs(points[i].y - points[j].y) <= my_eps &&
+          fabs(points[i].z - points[j].z) <= my_eps;
+    }
+    if (!duplicate) expected.push_back((void*)(uintptr_t)i);
+  }
+  ASSERT_EQ(points.size() - 3, expected.size());
+  for (auto mode : {GEO_DEDUP_TREE, GEO_DEDUP_GRID}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoVAResize(&vertex_array, points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+      vertex_array.x[i] = points[i].x;
+      vertex_array.y[i] = points[i].y;
+      vertex_array.z[i] = points[i].z;
+      vertex_array.ptrs[i] = (void*)(uintptr_t)i;
+    }
+    GeoHOInsert(&octree, &vertex_array);
+    GeoHODeleteDuplicatesWithMode(&octree, my_eps, mode, 0, 0);
+    std::vector<void*> kept(octree.vertices.ptrs,
+                            octree.vertices.ptrs + octree.vertices.size);
+    std::sort(kept.begin(), kept.end());
+    if (mode == GEO_DEDUP_GRID) {
+      EXPECT_EQ(expected, kept);
+    } else {
+      // Tree queries only reach vertices whose eps box overlaps the
+      // tree's box, so the far duplicates stay.
+      for (int i : {4, 5, 7, 8, 11}) {
+        EXPECT_TRUE(std::binary_search(kept.begin(), kept.end(),
+                                       (void*)(uintptr_t)i));
+      }
+    }
+  }
+}
+
+struct BatchResults {
+  std::vector<std::vector<int>> visits;
+  bool first_only;
+};
+
+extern "C" int RecordBatchVisit(struct GeoVertexArray *, int query, int i,
+                                void *ctx) {
+  BatchResults *results = static_cast<BatchResults*>(ctx);
+  results->visits[query].push_back(i);
+  return !results->first_only;
+}
+
+extern "C" int RecordVisit(struct GeoVertexArray *, int i, void *ctx) {
+  static_cast<std::vector<int>*>(ctx)->push_back(i);
+  return 1;
+}
+
+extern "C" int RecordBlockVisit(struct GeoVertexArray *, const int *indices,
+                                int n, void *ctx) {
+  static_cast<std::vector<int>*>(ctx)->insert(
+      static_cast<std::vector<int>*>(ctx)->end(), indices, indices + n);
+  return 1;
+}
+
+void CheckBatchAgreesWithSingleQueries(struct GeoHashedOctree *octree) {
+  int n = 3000;
+  struct GeoVertexArray vertex_array;
+  GeoVAInitialize(&vertex_array);
+  GeoVAResize(&vertex_array, n);
+  std::vector<int> indices(n);
+  FillWithRandomItems(&vertex_array, &octree->bbox, n, &indices[0]);
+  GeoHOInsert(octree, &vertex_array);
+  GeoVADestroy(&vertex_array);
+
+  // Some queries lie outside of the bounding box.
+  std::uniform_real_distribution<> dist(-0.05, 1.05);
+  int num_queries = 2000;
+  std::vector<struct GeoPoint> points(num_queries);
+  for (auto &p : points) p = {dist(gen), dist(gen), dist(gen)};
+  for (double my_eps : {0.0, 1.0e-3, 3.0e-2, 1.0e-1, 3.0e-1}) {
+    BatchResults results = {
+      std::vector<std::vector<int>>(num_queries), false};
+    GeoHOVisitNearVerticesBatch(octree, points.data(), num_queries, my_eps,
+                                RecordBatchVisit, &results);
+    for (int q = 0; q < num_queries; ++q) {
+      std::vector<int> expected;
+      GeoHOVisitNearVertices(octree, &points[q], my_eps, RecordVisit,
+                             &expected);
+      std::sort(expected.begin(), expected.end());
+      std::sort(results.visits[q].begin(), results.visits[q].end());
+      EXPECT_EQ(expected, results.visits[q]);
+    }
+
+    // Stopping a query doesn't stop the others.
+    BatchResults first = {std::vector<std::vector<int>>(num_queries), true};
+    GeoHOVisitNearVerticesBatch(octree, points.data(), num_queries, my_eps,
+                                RecordBatchVisit, &first);
+    for (int q = 0; q < num_queries; ++q) {
+      EXPECT_EQ(std::min<size_t>(1, results.visits[q].size()),
+                first.visits[q].size());
+    }
+  }
+}
+
+TEST_F(HashedOctree, BatchQueriesAgreeWithSingleQueries) {
+  CheckBatchAgreesWithSingleQueries(&octree);
+}
+
+TEST_F(HashedOctree, AdaptiveBatchQueriesAgreeWithSingleQueries) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeAdaptive(&octree, {{0, 0, 0}, {1, 1, 1}}, 8);
+  CheckBatchAgreesWithSingleQueries(&octree);
+}
+
+TEST_F(HashedOctree, DeepHilbertBatchQueriesAgreeWithSingleQueries) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}},
+                           GeoNodeMaxDepth64());
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  CheckBatchAgreesWithSingleQueries(&octree);
+}
+
+void CheckKNearestAgainstBruteForce(struct GeoHashedOctree *octree, int n) {
+  struct GeoVertexArray vertex_array;
+  GeoVAInitialize(&vertex_array);
+  GeoVAResize(&vertex_array, n);
+  std::vector<int> indices(n);
+  FillWithRandomItems(&vertex_array, &octree->bbox, n, &indices[0]);
+  GeoHOInsert(octree, &vertex_array);
+  GeoVADestroy(&vertex_array);
+
+  // Some queries lie outside of the bounding box.
+  std::uniform_real_distribution<> dist(-0.2, 1.2);
+  int num_queries = 300;
+  std::vector<struct GeoPoint> points(num_queries);
+  for (auto &p : points) p = {dist(gen), dist(gen), dist(gen)};
+  const struct GeoVertexArray *va = &octree->vertices;
+  std::vector<std::vector<std::tuple<double, int>>> nearest(num_queries);
+  for (int q = 0; q < num_queries; ++q) {
+    const struct GeoPoint &p = points[q];
+    for (int i = 0; i < va->size; ++i) {
+      double dx = va->x[i] - p.x, dy = va->y[i] - p.y, dz = va->z[i] - p.z;
+      nearest[q].emplace_back(dx * dx + dy * dy + dz * dz, i);
+    }
+    std::partial_sort(nearest[q].begin(),
+                      nearest[q].begin() + std::min(40, n), nearest[q].end());
+  }
+  for (int k : {1, 5, 40}) {
+    std::vector<int> batch_indices(num_queries * k, -1);
+    std::vector<double> batch_dist2(num_queries * k);
+    int num_found = GeoHOFindKNearestBatch(octree, points.data(),
+                                           num_queries, k, &batch_indices[0],
+                                           &batch_dist2[0]);
+    int expected_found = std::min(k, n);
+    EXPECT_EQ(expected_found, num_found);
+    for (int q = 0; q < num_queries; ++q) {
+      std::vector<int> found(k);
+      std::vector<double> dist2(k);
+      ASSERT_EQ(expected_found, GeoHOFindKNearest(octree, &points[q], k,
+                                                  &found[0], &dist2[0]));
+      for (int j = 0; j < expected_found; ++j) {
+        EXPECT_EQ(std::get<1>(nearest[q][j]), found[j]);
+        EXPECT_EQ(std::get<0>(nearest[q][j]), dist2[j]);
+        EXPECT_EQ(found[j], batch_indices[q * k + j]);
+        EXPECT_EQ(dist2[j], batch_dist2[q * k + j]);
+      }
+    }
+  }
+}
+
+TEST_F(HashedOctree, KNearestAgreesWithBruteForce) {
+  CheckKNearestAgainstBruteForce(&octree, 2000);
+}
+
+TEST_F(HashedOctree, HilbertKNearestAgreesWithBruteForce) {
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  CheckKNearestAgainstBruteForce(&octree, 2000);
+}
+
+TEST_F(HashedOctree, DeepHilbertKNearestAgreesWithBruteForce) {
+  GeoHODestroy(&octree);
+  GeoHOInitializeWithDepth(&octree, {{0, 0, 0}, {1, 1, 1}},
+                           GeoNodeMaxDepth64());
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  CheckKNearestAgainstBruteForce(&octree, 20000);
+}
+
+TEST_F(HashedOctree, KNearestReturnsAllVerticesOfSmallTrees) {
+  CheckKNearestAgainstBruteForce(&octree, 7);
+}
+
+TEST_F(HashedOctree, KNearestInEmptyTree) {
+  struct GeoPoint p = {0.5, 0.5, 0.5};
+  int i = -1;
+  double dist2 = -1.0;
+  EXPECT_EQ(0, GeoHOFindKNearest(&octree, &p, 1, &i, &dist2));
+  EXPECT_EQ(-1, i);
+}
+
+// Inserts num_batches batches of batch_size random vertices into both
+// trees. Every other batch repeats a few vertices of the one before so
+// that there are ties. ptrs hold the number of the vertex.
+void InsertBatches(struct GeoHashedOctree *a, struct GeoHashedOctree *b,
+                   int num_batches, int batch_size) {
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, batch_size);
+  std::vector<int> indices(batch_size);
+  std::vector<struct GeoPoint> previous;
+  for (int batch = 0; batch < num_batches; ++batch) {
+    FillWithRandomItems(&va, &a->bbox, batch_size, &indices[0]);
+    for (int i = 0; i < batch_size; ++i) {
+      if (batch % 2 == 1 && i % 10 == 0) {
+        va.x[i] = previous[i].x;
+        va.y[i] = previous[i].y;
+        va.z[i] = previous[i].z;
+      }
+      va.ptrs[i] = (void*)(uintptr_t)(batch * batch_size + i);
+    }
+    previous.clear();
+    for (int i = 0; i < batch_size; ++i) {
+      previous.push_back({va.x[i], va.y[i], va.z[i]});
+    }
+    GeoHOInsert(a, &va);
+    if (b) GeoHOInsert(b, &va);
+  }
+  GeoVADestroy(&va);
+}
+
+TEST_F(HashedOctree, RunsHaveGeometricallyDecreasingSizes) {
+  GeoHOSetInsertMode(&octree, GEO_INSERT_RUNS);
+  InsertBatches(&octree, 0, 300, 100);
+  EXPECT_EQ(30000, GeoHONumVertices(&octree));
+  EXPECT_GT(octree.num_runs, 0);
+  EXPECT_LE(octree.num_runs, 9);
+  int size = octree.vertices.size;
+  for (int r = 0; r < octree.num_runs; ++r) {
+    EXPECT_GT(size, 2 * octree.runs[r].vertices.size);
+    size = octree.runs[r].vertices.size;
+  }
+}
+
+TEST_F(HashedOctree, CompactedRunsEqualMergedInsertions) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    struct GeoHashedOctree runs;
+    GeoHOInitialize(&runs, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetKeyOrder(&runs, order);
+    GeoHOSetInsertMode(&runs, GEO_INSERT_RUNS);
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetKeyOrder(&octree, order);
+    InsertBatches(&runs, &octree, 37, 150);
+    GeoHOCompact(&runs);
+    EXPECT_EQ(0, runs.num_runs);
+    ASSERT_EQ(octree.vertices.size, runs.vertices.size);
+    for (int i = 0; i < octree.vertices.size; ++i) {
+      EXPECT_EQ(octree.hashes[i], runs.hashes[i]);
+      EXPECT_EQ(octree.vertices.ptrs[i], runs.vertices.ptrs[i]);
+      EXPECT_EQ(octree.vertices.x[i], runs.vertices.x[i]);
+    }
+    GeoHODestroy(&runs);
+  }
+}
+
+extern "C" int CollectPtrs(struct GeoVertexArray *va, int i, void *ctx) {
+  static_cast<std::vector<void*>*>(ctx)->push_back(va->ptrs[i]);
+  return 1;
+}
+
+extern "C" int CollectBlockPtrs(struct GeoVertexArray *va, const int *indices,
+                                int n, void *ctx) {
+  EXPECT_GE(128, n);
+  for (int j = 0; j < n; ++j) {
+    static_cast<std::vector<void*>*>(ctx)->push_back(va->ptrs[indices[j]]);
+  }
+  return 1;
+}
+
+extern "C" int CollectBatchPtrs(struct GeoVertexArray *va, int query, int i,
+                                void *ctx) {
+  (*static_cast<std::vector<std::vector<void*>>*>(ctx))[query].push_back(
+      va->ptrs[i]);
+  return 1;
+}
+
+TEST_F(HashedOctree, QueriesSearchAllRuns) {
+  struct GeoHashedOctree merged;
+  GeoHOInitialize(&merged, {{0, 0, 0}, {1, 1, 1}});
+  GeoHOSetInsertMode(&octree, GEO_INSERT_RUNS);
+  InsertBatches(&octree, &merged, 45, 100);
+  ASSERT_GT(octree.num_runs, 1);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  int num_queries = 200;
+  std::vector<struct GeoPoint> points(num_queries);
+  for (auto &p : points) p = {dist(gen), dist(gen), dist(gen)};
+  double my_eps = 5.0e-2;
+  std::vector<std::vector<void*>> batch(num_queries);
+  GeoHOVisitNearVerticesBatch(&octree, points.data(), num_queries, my_eps,
+                              CollectBatchPtrs, &batch);
+  BatchResults first = {std::vector<std::vector<int>>(num_queries), true};
+  GeoHOVisitNearVerticesBatch(&octree, points.data(), num_queries, my_eps,
+                              RecordBatchVisit, &first);
+  int k = 10;
+  for (int q = 0; q < num_queries; ++q) {
+    const struct GeoPoint *p = &points[q];
+    std::vector<void*> expected, found;
+    GeoHOVisitNearVertices(&merged, p, my_eps, CollectPtrs, &expected);
+    GeoHOVisitNearVertices(&octree, p, my_eps, CollectPtrs, &found);
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(expected, found);
+    std::sort(batch[q].begin(), batch[q].end());
+    EXPECT_EQ(expected, batch[q]);
+
+    int visits = 0;
+    GeoHOVisitNearVertices(&octree, p, my_eps, StopAtFirst, &visits);
+    EXPECT_EQ(std::min<int>(1, expected.size()), visits);
+    EXPECT_EQ(std::min<size_t>(1, expected.size()), first.visits[q].size());
+
+    expected.clear();
+    found.clear();
+    GeoHOVisitVerticesInBall(&merged, p, my_eps, CollectPtrs, &expected);
+    GeoHOVisitVerticesInBall(&octree, p, my_eps, CollectPtrs, &found);
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(expected, found);
+
+    std::vector<int> merged_indices(k), indices(k);
+    std::vector<double> merged_dist2(k), dist2(k);
+    ASSERT_EQ(k, GeoHOFindKNearest(&merged, p, k, &merged_indices[0],
+                                   &merged_dist2[0]));
+    ASSERT_EQ(k, GeoHOFindKNearest(&octree, p, k, &indices[0], &dist2[0]));
+    for (int j = 0; j < k; ++j) {
+      EXPECT_EQ(merged_dist2[j], dist2[j]);
+      int i = indices[j];
+      struct GeoVertexArray *va = GeoHOLocateVertex(&octree, &i);
+      double dx = va->x[i] - p->x, dy = va->y[i] - p->y, dz = va->z[i] - p->z;
+      EXPECT_EQ(dist2[j], dx * dx + dy * dy + dz * dz);
+    }
+  }
+  GeoHODestroy(&merged);
+}
+
+TEST_F(HashedOctree, DeduplicationCompactsRuns) {
+  GeoHOSetInsertMode(&octree, GEO_INSERT_RUNS);
+  InsertBatches(&octree, 0, 20, 100);
+  ASSERT_GT(octree.num_runs, 0);
+  int num_deleted = 0;
+  GeoHODeleteDuplicates(&octree, 0.0, CountDtor, &num_deleted);
+  EXPECT_EQ(0, octree.num_runs);
+  // Every other batch repeats 10 vertices of the batch before.
+  EXPECT_EQ(100, num_deleted);
+  EXPECT_EQ(1900, octree.vertices.size);
+}
+
+// Compares queries against a brute force search over the vertices that
+// haven't been removed, identified by their ptrs.
+void CheckQueriesSkipRemovedVertices(struct GeoHashedOctree *octree) {
+  std::vector<std::tuple<void*, struct GeoPoint>> live;
+  for (int r = 0; r <= octree->num_runs; ++r) {
+    struct GeoHashedOctree *run = r == 0 ? octree : &octree->runs[r - 1];
+    const struct GeoVertexArray *va = &run->vertices;
+    for (int i = 0; i < va->size; ++i) {
+      if (run->removed && (run->removed[i / 64] >> (i % 64)) & 1) continue;
+      live.emplace_back(va->ptrs[i],
+                        GeoPoint{va->x[i], va->y[i], va->z[i]});
+    }
+  }
+  EXPECT_EQ((int)live.size(), GeoHONumVertices(octree));
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  double my_eps = 5.0e-2;
+  int num_queries = 100;
+  std::vector<struct GeoPoint> points(num_queries);
+  for (auto &p : points) p = {dist(gen), dist(gen), dist(gen)};
+  std::vector<std::vector<void*>> batch(num_queries);
+  GeoHOVisitNearVerticesBatch(octree, points.data(), num_queries, my_eps,
+                              CollectBatchPtrs, &batch);
+  std::uniform_real_distribution<> extent(0.0, 0.3);
+  int k = 5;
+  for (int q = 0; q < num_queries; ++q) {
+    const struct GeoPoint &p = points[q];
+    struct GeoBoundingBox query_box = {
+        {p.x - extent(gen), p.y - extent(gen), p.z - extent(gen)},
+        {p.x + extent(gen), p.y + extent(gen), p.z + extent(gen)}};
+    std::vector<void*> expected_box, expected_ball, expected_in_box;
+    std::vector<double> expected_dist2;
+    for (const auto &v : live) {
+      const struct GeoPoint &x = std::get<1>(v);
+      double dx = x.x - p.x, dy = x.y - p.y, dz = x.z - p.z;
+      if (fabs(dx) <= my_eps && fabs(dy) <= my_eps && fabs(dz) <= my_eps) {
+        expected_box.push_back(std::get<0>(v));
+      }
+      if (in_box(x, query_box)) expected_in_box.push_back(std::get<0>(v));
+      double d2 = dx * dx + dy * dy + dz * dz;
+      if (d2 <= my_eps * my_eps) expected_ball.push_back(std::get<0>(v));
+      expected_dist2.push_back(d2);
+    }
+    std::sort(expected_box.begin(), expected_box.end());
+    std::sort(expected_ball.begin(), expected_ball.end());
+    std::sort(expected_in_box.begin(), expected_in_box.end());
+    std::sort(expected_dist2.begin(), expected_dist2.end());
+
+    std::vector<void*> box, ball, in_query_box;
+    GeoHOVisitNearVertices(octree, &p, my_eps, CollectPtrs, &box);
+    GeoHOVisitVerticesInBall(octree, &p, my_eps, CollectPtrs, &ball);
+    GeoHOVisitVerticesInBox(octree, &query_box, CollectPtrs, &in_query_box);
+    std::vector<void*> box_blocks, ball_blocks, in_query_box_blocks;
+    GeoHOVisitNearVertexBlocks(octree, &p, my_eps, CollectBlockPtrs,
+                               &box_blocks);
+    GeoHOVisitVertexBlocksInBall(octree, &p, my_eps, CollectBlockPtrs,
+                                 &ball_blocks);
+    GeoHOVisitVertexBlocksInBox(octree, &query_box, CollectBlockPtrs,
+                                &in_query_box_blocks);
+    std::sort(box.begin(), box.end());
+    std::sort(ball.begin(), ball.end());
+    std::sort(in_query_box.begin(), in_query_box.end());
+    std::sort(box_blocks.begin(), box_blocks.end());
+    std::sort(ball_blocks.begin(), ball_blocks.end());
+    std::sort(in_query_box_blocks.begin(), in_query_box_blocks.end());
+    std::sort(batch[q].begin(), batch[q].end());
+    EXPECT_EQ(expected_box, box);
+    EXPECT_EQ(expected_ball, ball);
+    EXPECT_EQ(expected_in_box, in_query_box);
+    EXPECT_EQ(expected_box, box_blocks);
+    EXPECT_EQ(expected_ball, ball_blocks);
+    EXPECT_EQ(expected_in_box, in_query_box_blocks);
+    EXPECT_EQ(expected_box, batch[q]);
+
+    std::vector<int> indices(k);
+    std::vector<double> dist2(k);
+    int expected_found = std::min<int>(k, live.size());
+    ASSERT_EQ(expected_found,
+              GeoHOFindKNearest(octree, &p, k, &indices[0], &dist2[0]));
+    for (int j = 0; j < expected_found; ++j) {
+      EXPECT_EQ(expected_dist2[j], dist2[j]);
+    }
+  }
+}
+
+extern "C" int IdIsEven(struct GeoVertexArray *va, int i, void *) {
+  return (uintptr_t)va->ptrs[i] % 2 == 0;
+}
+
+TEST_F(HashedOctree, QueriesSkipRemovedVertices) {
+  GeoHOSetMaxRemovedRatio(&octree, 1.0);
+  InsertBatches(&octree, 0, 1, 2000);
+  std::vector<int> removed;
+  for (int i = 0; i < 2000; i += 3) removed.push_back(i);
+  // Removing a vertex twice has no effect.
+  removed.push_back(3);
+  GeoHORemove(&octree, removed.data(), removed.size());
+  EXPECT_EQ(667, octree.num_removed);
+  EXPECT_EQ(2000 - 667, GeoHONumVertices(&octree));
+  CheckQueriesSkipRemovedVertices(&octree);
+}
+
+TEST_F(HashedOctree, RemovalCompactsPastTheMaximumRatio) {
+  InsertBatches(&octree, 0, 1, 2000);
+  std::vector<int> removed = {5, 17, 1999};
+  int num_odd_removed = 0;
+  for (int i : removed) {
+    num_odd_removed += (uintptr_t)octree.vertices.ptrs[i] % 2;
+  }
+  GeoHORemove(&octree, removed.data(), removed.size());
+  EXPECT_EQ(3, octree.num_removed);
+  EXPECT_EQ(2000, octree.vertices.size);
+  GeoHORemoveIf(&octree, IdIsEven, 0);
+  EXPECT_EQ(0, octree.num_removed);
+  EXPECT_EQ(1000 - num_odd_removed, octree.vertices.size);
+  for (int i = 0; i < octree.vertices.size; ++i) {
+    EXPECT_EQ(1u, (uintptr_t)octree.vertices.ptrs[i] % 2);
+  }
+  CheckQueriesSkipRemovedVertices(&octree);
+}
+
+extern "C" int IdIsBelow(struct GeoVertexArray *va, int i, void *ctx) {
+  return (uintptr_t)va->ptrs[i] < *static_cast<uintptr_t*>(ctx);
+}
+
+// A sliding window: every frame retires the oldest vertices and appends a
+// new batch.
+TEST_F(HashedOctree, RemovalFromRunsWithInsertions) {
+  for (auto mode : {GEO_INSERT_MERGE, GEO_INSERT_RUNS}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetInsertMode(&octree, mode);
+    int batch_size = 200;
+    struct GeoVertexArray va;
+    GeoVAInitialize(&va);
+    GeoVAResize(&va, batch_size);
+    std::vector<int> indices(batch_size);
+    for (int frame = 0; frame < 30; ++frame) {
+      FillWithRandomItems(&va, &octree.bbox, batch_size, &indices[0]);
+      for (int i = 0; i < batch_size; ++i) {
+        va.ptrs[i] = (void*)(uintptr_t)(frame * batch_size + i);
+      }
+      GeoHOInsert(&octree, &va);
+      uintptr_t oldest = frame < 9 ? 0 : (frame - 9) * batch_size;
+      GeoHORemoveIf(&octree, IdIsBelow, &oldest);
+      if (frame % 7 == 6) CheckQueriesSkipRemovedVertices(&octree);
+    }
+    EXPECT_EQ(10 * batch_size, GeoHONumVertices(&octree));
+    GeoHOCompact(&octree);
+    EXPECT_EQ(0, octree.num_removed);
+    EXPECT_EQ(10 * batch_size, octree.vertices.size);
+    CheckQueriesSkipRemovedVertices(&octree);
+    GeoVADestroy(&va);
+  }
+}
+
+TEST_F(HashedOctree, MappedSnapshotEqualsSavedTree) {
+  std::string path = "hashed_octree_test.geoho";
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetKeyOrder(&octree, order);
+    GeoHOSetInsertMode(&octree, GEO_INSERT_RUNS);
+    GeoHOSetMaxRemovedRatio(&octree, 1.0);
+    InsertBatches(&octree, 0, 13, 150);
+    uintptr_t oldest = 100;
+    GeoHORemoveIf(&octree, IdIsBelow, &oldest);
+    ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+    // Saving compacts the tree.
+    EXPECT_EQ(0, octree.num_runs);
+    EXPECT_EQ(0, octree.num_removed);
+
+    struct GeoHashedOctree mapped;
+    ASSERT_EQ(0, GeoHOMap(&mapped, path.c_str()));
+    EXPECT_EQ(octree.depth, mapped.depth);
+    EXPECT_EQ(octree.order, mapped.order);
+    EXPECT_EQ(octree.directory_bits, mapped.directory_bits);
+    ASSERT_EQ(octree.vertices.size, mapped.vertices.size);
+    for (int i = 0; i < octree.vertices.size; ++i) {
+      EXPECT_EQ(octree.hashes[i], mapped.hashes[i]);
+      EXPECT_EQ(octree.vertices.x[i], mapped.vertices.x[i]);
+      // The snapshot refers to the ptrs by index.
+      EXPECT_EQ((void*)(uintptr_t)i, mapped.vertices.ptrs[i]);
+    }
+    CheckQueriesSkipRemovedVertices(&mapped);
+    GeoHODestroy(&mapped);
+  }
+  std::remove(path.c_str());
+}
+
+TEST_F(HashedOctree, MappingAnInvalidSnapshotFails) {
+  std::string path = "hashed_octree_test.geoho";
+  struct GeoHashedOctree mapped;
+  std::remove(path.c_str());
+  EXPECT_EQ(-1, GeoHOMap(&mapped, path.c_str()));
+
+  InsertBatches(&octree, 0, 1, 100);
+  ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+  FILE *f = fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, f);
+  fputc('X', f);
+  fclose(f);
+  EXPECT_EQ(-1, GeoHOMap(&mapped, path.c_str()));
+
+  // A truncated snapshot.
+  ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+  f = fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, f);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  ASSERT_EQ(0, truncate(path.c_str(), size - 8));
+  EXPECT_EQ(-1, GeoHOMap(&mapped, path.c_str()));
+
+  // A directory entry past the vertices.
+  ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+  f = fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, f);
+  struct GeoSnapshotHeader header;
+  ASSERT_EQ(1u, fread(&header, sizeof(header), 1, f));
+  // The directory is the sixth section.
+  fseek(f, header.offsets[5], SEEK_SET);
+  uint32_t entry = 0xffffffffu;
+  ASSERT_EQ(1u, fwrite(&entry, sizeof(entry), 1, f));
+  fclose(f);
+  EXPECT_EQ(-1, GeoHOMap(&mapped, path.c_str()));
+  std::remove(path.c_str());
+}
+
+TEST_F(HashedOctree, MappedEmptyTree) {
+  std::string path = "hashed_octree_test.geoho";
+  ASSERT_EQ(0, GeoHOSave(&octree, path.c_str()));
+  struct GeoHashedOctree mapped;
+  ASSERT_EQ(0, GeoHOMap(&mapped, path.c_str()));
+  EXPECT_EQ(0, mapped.vertices.size);
+  struct GeoPoint p = {0.5, 0.5, 0.5};
+  int visits = 0;
+  GeoHOVisitNearVertices(&mapped, &p, 0.5, StopAtFirst, &visits);
+  EXPECT_EQ(0, visits);
+  GeoHODestroy(&mapped);
+  std::remove(path.c_str());
+}
+
+// Compares the queries of a tree attached to x, y and z against a brute
+// force search over the caller's arrays.
+void CheckAttachedTree(struct GeoHashedOctree *octree, const double *x,
+                       const double *y, const double *z, int n) {
+  std::uniform_real_distribution<> dist(-0.05, 1.05);
+  double my_eps = 5.0e-2;
+  int num_queries = 100;
+  std::vector<struct GeoPoint> points(num_queries);
+  for (auto &p : points) p = {dist(gen), dist(gen), dist(gen)};
+  BatchResults batch = {std::vector<std::vector<int>>(num_queries), false};
+  GeoHOVisitNearVerticesBatch(octree, points.data(), num_queries, my_eps,
+                              RecordBatchVisit, &batch);
+  std::uniform_real_distribution<> extent(0.0, 0.3);
+  int k = 5;
+  for (int q = 0; q < num_queries; ++q) {
+    const struct GeoPoint &p = points[q];
+    struct GeoBoundingBox query_box = {
+        {p.x - extent(gen), p.y - extent(gen), p.z - extent(gen)},
+        {p.x + extent(gen), p.y + extent(gen), p.z + extent(gen)}};
+    std::vector<int> expected_box, expected_ball, expected_in_box;
+    std::vector<std::tuple<double, int>> expected_nearest;
+    for (int i = 0; i < n; ++i) {
+      double dx = x[i] - p.x, dy = y[i] - p.y, dz = z[i] - p.z;
+      if (fabs(dx) <= my_eps && fabs(dy) <= my_eps && fabs(dz) <= my_eps) {
+        expected_box.push_back(i);
+      }
+      if (in_box({x[i], y[i], z[i]}, query_box)) expected_in_box.push_back(i);
+      double d2 = dx * dx + dy * dy + dz * dz;
+      if (d2 <= my_eps * my_eps) expected_ball.push_back(i);
+      expected_nearest.emplace_back(d2, i);
+    }
+    std::sort(expected_nearest.begin(), expected_nearest.end());
+
+    std::vector<int> box, ball, in_query_box;
+    GeoHOVisitNearVertices(octree, &p, my_eps, RecordVisit, &box);
+    GeoHOVisitVerticesInBall(octree, &p, my_eps, RecordVisit, &ball);
+    GeoHOVisitVerticesInBox(octree, &query_box, RecordVisit, &in_query_box);
+    std::vector<int> box_blocks, ball_blocks, in_query_box_blocks;
+    GeoHOVisitNearVertexBlocks(octree, &p, my_eps, RecordBlockVisit,
+                               &box_blocks);
+    GeoHOVisitVertexBlocksInBall(octree, &p, my_eps, RecordBlockVisit,
+                                 &ball_blocks);
+    GeoHOVisitVertexBlocksInBox(octree, &query_box, RecordBlockVisit,
+                                &in_query_box_blocks);
+    std::sort(box.begin(), box.end());
+    std::sort(ball.begin(), ball.end());
+    std::sort(in_query_box.begin(), in_query_box.end());
+    std::sort(box_blocks.begin(), box_blocks.end());
+    std::sort(ball_blocks.begin(), ball_blocks.end());
+    std::sort(in_query_box_blocks.begin(), in_query_box_blocks.end());
+    std::sort(batch.visits[q].begin(), batch.visits[q].end());
+    EXPECT_EQ(expected_box, box);
+    EXPECT_EQ(expected_ball, ball);
+    EXPECT_EQ(expected_in_box, in_query_box);
+    EXPECT_EQ(expected_box, box_blocks);
+    EXPECT_EQ(expected_ball, ball_blocks);
+    EXPECT_EQ(expected_in_box, in_query_box_blocks);
+    EXPECT_EQ(expected_box, batch.visits[q]);
+
+    std::vector<int> indices(k);
+    std::vector<double> dist2(k);
+    ASSERT_EQ(k, GeoHOFindKNearest(octree, &p, k, &indices[0], &dist2[0]));
+    for (int j = 0; j < k; ++j) {
+      EXPECT_EQ(std::get<0>(expected_nearest[j]), dist2[j]);
+      EXPECT_EQ(std::get<1>(expected_nearest[j]), indices[j]);
+    }
+  }
+}
+
+extern "C" int CheckCallerArrays(struct GeoVertexArray *va, int, void *ctx) {
+  EXPECT_EQ(static_cast<const double*>(ctx), va->x);
+  EXPECT_EQ(nullptr, va->ptrs);
+  return 1;
+}
+
+TEST_F(HashedOctree, AttachedTreeAgreesWithBruteForce) {
+  int n = 3000;
+  // One more element so that the arrays can be misaligned.
+  std::vector<double> x(n + 1), y(n + 1), z(n + 1);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  for (int i = 0; i <= n; ++i) {
+    x[i] = dist(gen);
+    y[i] = dist(gen);
+    z[i] = dist(gen);
+  }
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (int offset : {0, 1}) {
+      GeoHODestroy(&octree);
+      GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+      GeoHOSetKeyOrder(&octree, order);
+      const double *px = &x[offset], *py = &y[offset], *pz = &z[offset];
+      GeoHOAttach(&octree, px, py, pz, n);
+      EXPECT_EQ(n, GeoHONumVertices(&octree));
+      CheckAttachedTree(&octree, px, py, pz, n);
+      struct GeoPoint p = {0.5, 0.5, 0.5};
+      GeoHOVisitNearVertices(&octree, &p, 0.1, CheckCallerArrays,
+                             (void*)px);
+    }
+  }
+}
+
+TEST_F(HashedOctree, AttachedTreeOverVertexArray) {
+  int n = 2000;
+  GeoVAResize(&vertex_array, n);
+  std::vector<int> indices(n);
+  FillWithRandomItems(&vertex_array, &octree.bbox, n, &indices[0]);
+  GeoHOAttach(&octree, vertex_array.x, vertex_array.y, vertex_array.z, n);
+  CheckAttachedTree(&octree, vertex_array.x, vertex_array.y, vertex_array.z,
+                    n);
+  // The hashes are those that inserting the vertices would give.
+  struct GeoHashedOctree stored;
+  GeoHOInitialize(&stored, octree.bbox);
+  GeoHOInsert(&stored, &vertex_array);
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(stored.hashes[i], octree.hashes[i]);
+  }
+  GeoHODestroy(&stored);
+}
+
+TEST_F(HashedOctree, UpdateResortsMovedVertices) {
+  int n = 3000;
+  std::vector<double> x(n), y(n), z(n);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  for (int i = 0; i < n; ++i) {
+    x[i] = dist(gen);
+    y[i] = dist(gen);
+    z[i] = dist(gen);
+  }
+  GeoHOAttach(&octree, x.data(), y.data(), z.data(), n);
+  // No vertex moved.
+  GeoHOUpdate(&octree);
+  CheckAttachedTree(&octree, x.data(), y.data(), z.data(), n);
+  std::uniform_real_distribution<> step(-1.0e-2, 1.0e-2);
+  for (int frame = 0; frame < 3; ++frame) {
+    for (int i = 0; i < n; ++i) {
+      x[i] = std::min(1.0, std::max(0.0, x[i] + step(gen)));
+      y[i] = std::min(1.0, std::max(0.0, y[i] + step(gen)));
+      z[i] = std::min(1.0, std::max(0.0, z[i] + step(gen)));
+    }
+    GeoHOUpdate(&octree);
+    for (int i = 0; i < n - 1; ++i) {
+      ASSERT_LE(octree.hashes[i], octree.hashes[i + 1]);
+    }
+    CheckAttachedTree(&octree, x.data(), y.data(), z.data(), n);
+  }
+  // An attached tree can be attached to other arrays.
+  GeoHOAttach(&octree, x.data(), y.data(), z.data(), n / 2);
+  CheckAttachedTree(&octree, x.data(), y.data(), z.data(), n / 2);
+}
+
+// Checks that side[k] holds the ptr of stored vertex k.
+void CheckSideArray(struct GeoHashedOctree *octree,
+                    const std::vector<uintptr_t> &side) {
+  ASSERT_EQ((size_t)GeoHONumStoredVertices(octree), side.size());
+  for (int k = 0; k < (int)side.size(); ++k) {
+    int i = k;
+    struct GeoVertexArray *va = GeoHOLocateVertex(octree, &i);
+    EXPECT_EQ((uintptr_t)va->ptrs[i], side[k]);
+  }
+}
+
+TEST_F(HashedOctree, InsertionPermutationKeepsSideArraysInOrder) {
+  for (auto mode : {GEO_INSERT_MERGE, GEO_INSERT_RUNS}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetInsertMode(&octree, mode);
+    // Removal only marks the vertices, compacting would renumber them.
+    GeoHOSetMaxRemovedRatio(&octree, 1.0);
+    int batch_size = 300;
+    GeoVAResize(&vertex_array, batch_size);
+    std::vector<int> indices(batch_size);
+    std::vector<uintptr_t> side;
+    for (int batch = 0; batch < 12; ++batch) {
+      FillWithRandomItems(&vertex_array, &octree.bbox, batch_size,
+                          &indices[0]);
+      std::vector<uintptr_t> src = side;
+      for (int i = 0; i < batch_size; ++i) {
+        uintptr_t id = batch * batch_size + i;
+        vertex_array.ptrs[i] = (void*)id;
+        src.push_back(id);
+      }
+      std::vector<int> permutation(src.size());
+      GeoHOInsertWithPermutation(&octree, &vertex_array, &permutation[0]);
+      side.assign(GeoHONumStoredVertices(&octree), 0);
+      GeoHOApplyPermutation(&permutation[0], permutation.size(), &src[0],
+                            sizeof(src[0]), &side[0], sizeof(side[0]),
+                            sizeof(side[0]));
+      CheckSideArray(&octree, side);
+      // Removed vertices are dropped by later insertions.
+      uintptr_t oldest = batch * batch_size / 2;
+      GeoHORemoveIf(&octree, IdIsBelow, &oldest);
+      CheckSideArray(&octree, side);
+    }
+    CheckQueriesSkipRemovedVertices(&octree);
+  }
+}
+
+extern "C" void CollectDeleted(void *ptr, void *ctx) {
+  static_cast<std::vector<uintptr_t>*>(ctx)->push_back((uintptr_t)ptr);
+}
+
+TEST_F(HashedOctree, DeduplicationPermutationKeepsSideArraysInOrder) {
+  for (auto mode : {GEO_DEDUP_TREE, GEO_DEDUP_GRID}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetInsertMode(&octree, GEO_INSERT_RUNS);
+    InsertBatches(&octree, 0, 10, 100);
+    int num_stored = GeoHONumStoredVertices(&octree);
+    std::vector<uintptr_t> src;
+    for (int k = 0; k < num_stored; ++k) {
+      int i = k;
+      struct GeoVertexArray *va = GeoHOLocateVertex(&octree, &i);
+      src.push_back((uintptr_t)va->ptrs[i]);
+    }
+    std::vector<int> permutation(num_stored);
+    std::vector<uintptr_t> deleted;
+    GeoHODeleteDuplicatesWithPermutation(&octree, 0.0, mode, CollectDeleted,
+                                         &deleted, &permutation[0]);
+    // Every other batch repeats 10 vertices of the batch before.
+    EXPECT_EQ(50u, deleted.size());
+    std::vector<uintptr_t> side(GeoHONumStoredVertices(&octree));
+    GeoHOApplyPermutation(&permutation[0], num_stored, &src[0],
+                          sizeof(src[0]), &side[0], sizeof(side[0]),
+                          sizeof(side[0]));
+    CheckSideArray(&octree, side);
+    std::vector<uintptr_t> dropped;
+    for (int k = 0; k < num_stored; ++k) {
+      if (permutation[k] < 0) dropped.push_back(src[k]);
+    }
+    std::sort(deleted.begin(), deleted.end());
+    std::sort(dropped.begin(), dropped.end());
+    EXPECT_EQ(deleted, dropped);
+  }
+}
+
+TEST(ApplyPermutation, CopiesStridedElements) {
+  struct Attributes {
+    float color[3];
+    int id;
+    double weight;
+  };
+  int n = 1000;
+  std::vector<int> permutation(n);
+  for (int i = 0; i < n; ++i) permutation[i] = i % 3 == 0 ? -1 : n - 1 - i;
+  std::vector<Attributes> src(n), dst(n);
+  for (int i = 0; i < n; ++i) {
+    src[i] = {{1.0f * i, 2.0f * i, 3.0f * i}, i, 0.5 * i};
+    dst[i] = {{0, 0, 0}, -1, 0};
+  }
+  // The colors, then the ids and the weights.
+  GeoHOApplyPermutation(&permutation[0], n, &src[0].color, sizeof(src[0]),
+                        &dst[0].color, sizeof(dst[0]), sizeof(src[0].color));
+  GeoHOApplyPermutation(&permutation[0], n, &src[0].id, sizeof(src[0]),
+                        &dst[0].id, sizeof(dst[0]), sizeof(src[0].id));
+  std::vector<double> weights(n);
+  GeoHOApplyPermutation(&permutation[0], n, &src[0].weight, sizeof(src[0]),
+                        &weights[0], sizeof(weights[0]), sizeof(weights[0]));
+  for (int i = 0; i < n; ++i) {
+    int j = n - 1 - i;
+    if (i % 3 == 0) {
+      EXPECT_EQ(-1, dst[j].id);
+      EXPECT_EQ(0.0, weights[j]);
+      continue;
+    }
+    EXPECT_EQ(i, dst[j].id);
+    EXPECT_EQ(3.0f * i, dst[j].color[2]);
+    EXPECT_EQ(0.5 * i, weights[j]);
+  }
+}
+
+// Inserts batches of vertices that spread further and further out of the
+// unit cube. ptrs hold the number of the vertex.
+void InsertSpreadingBatches(struct GeoHashedOctree *octree,
+                            struct GeoVertexArray *all) {
+  int batch_size = 500;
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, batch_size);
+  for (int batch = 0; batch < 4; ++batch) {
+    double spread = 1 << batch;
+    // The box has to grow down in x, both ways in y and up in z.
+    std::uniform_real_distribution<> dist_x(0.5 - spread, 0.6);
+    std::uniform_real_distribution<> dist_y(0.5 - spread, 0.5 + 0.7 * spread);
+    std::uniform_real_distribution<> dist_z(0.4, 0.5 + spread);
+    for (int i = 0; i < batch_size; ++i) {
+      va.x[i] = dist_x(gen);
+      va.y[i] = dist_y(gen);
+      va.z[i] = dist_z(gen);
+      va.ptrs[i] = (void*)(uintptr_t)(batch * batch_size + i);
+      int j = all->size;
+      GeoVAResize(all, j + 1);
+      all->x[j] = va.x[i];
+      all->y[j] = va.y[i];
+      all->z[j] = va.z[i];
+      all->ptrs[j] = va.ptrs[i];
+    }
+    GeoHOInsert(octree, &va);
+    const struct GeoBoundingBox &b = octree->bbox;
+    for (int i = 0; i < all->size; ++i) {
+      EXPECT_TRUE(b.min.x <= all->x[i] && all->x[i] <= b.max.x &&
+                  b.min.y <= all->y[i] && all->y[i] <= b.max.y &&
+                  b.min.z <= all->z[i] && all->z[i] <= b.max.z);
+    }
+  }
+  GeoVADestroy(&va);
+}
+
+TEST_F(HashedOctree, GrowingBoxRemapsHashes) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    GeoHODestroy(&octree);
+    GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+    GeoHOSetKeyOrder(&octree, order);
+    GeoHOSetGrowBoundingBox(&octree, 1);
+    struct GeoVertexArray all;
+    GeoVAInitialize(&all);
+    InsertSpreadingBatches(&octree, &all);
+    // The box doubled at least twice and is still a cube.
+    EXPECT_GE(octree.bbox.max.x - octree.bbox.min.x, 4.0);
+    EXPECT_EQ(octree.bbox.max.x - octree.bbox.min.x,
+              octree.bbox.max.z - octree.bbox.min.z);
+    // The remapped hashes equal those of vertices inserted into the grown
+    // box directly.
+    struct GeoHashedOctree direct;
+    GeoHOInitialize(&direct, octree.bbox);
+    GeoHOSetKeyOrder(&direct, order);
+    GeoHOInsert(&direct, &all);
+    ASSERT_EQ(direct.vertices.size, octree.vertices.size);
+    std::vector<GeoSpatialHash64> expected(direct.hashes,
+                                           direct.hashes + all.size);
+    std::vector<GeoSpatialHash64> found(octree.hashes,
+                                        octree.hashes + all.size);
+    EXPECT_EQ(expected, found);
+    GeoHODestroy(&direct);
+    GeoVADestroy(&all);
+  }
+}
+
+TEST_F(HashedOctree, QueriesAgreeWithBruteForceInGrowingBox) {
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (auto mode : {GEO_INSERT_MERGE, GEO_INSERT_RUNS}) {
+      GeoHODestroy(&octree);
+      GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+      GeoHOSetKeyOrder(&octree, order);
+      GeoHOSetInsertMode(&octree, mode);
+      GeoHOSetGrowBoundingBox(&octree, 1);
+      GeoHOSetMaxRemovedRatio(&octree, 1.0);
+      // Removed vertices stay removed when the box grows.
+      InsertBatches(&octree, 0, 3, 300);
+      std::vector<int> removed;
+      for (int i = 0; i < 900; i += 4) removed.push_back(i);
+      GeoHORemove(&octree, removed.data(), removed.size());
+      struct GeoVertexArray all;
+      GeoVAInitialize(&all);
+      InsertSpreadingBatches(&octree, &all);
+      EXPECT_EQ(4 * 500 + 900 - 225, GeoHONumVertices(&octree));
+      CheckQueriesSkipRemovedVertices(&octree);
+      GeoVADestroy(&all);
+    }
+  }
+}
+
+TEST_F(HashedOctree, AttachedTreeGrowsBox) {
+  int n = 2000;
+  std::vector<double> x(n), y(n), z(n);
+  std::uniform_real_distribution<> dist(-2.0, 3.0);
+  for (int i = 0; i < n; ++i) {
+    x[i] = dist(gen);
+    y[i] = dist(gen);
+    z[i] = dist(gen);
+  }
+  GeoHOSetGrowBoundingBox(&octree, 1);
+  GeoHOAttach(&octree, x.data(), y.data(), z.data(), n);
+  EXPECT_EQ(-3.0, octree.bbox.min.x);
+  EXPECT_EQ(5.0, octree.bbox.max.x);
+  CheckAttachedTree(&octree, x.data(), y.data(), z.data(), n);
+  x[0] = 7.0;
+  GeoHOUpdate(&octree);
+  EXPECT_EQ(13.0, octree.bbox.max.x);
+  CheckAttachedTree(&octree, x.data(), y.data(), z.data(), n);
+}
+
+extern "C" int CheckNoCoordinates(struct GeoVertexArray *va, int, void *) {
+  EXPECT_EQ(nullptr, va->x);
+  EXPECT_EQ(nullptr, va->ptrs);
+  return 1;
+}
+
+TEST_F(HashedOctree, FloatAttachedTreeAgreesWithBruteForce) {
+  int n = 3000;
+  // One more element so that the arrays can be misaligned.
+  std::vector<float> x(n + 1), y(n + 1), z(n + 1);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  for (int i = 0; i <= n; ++i) {
+    x[i] = dist(gen);
+    y[i] = dist(gen);
+    z[i] = dist(gen);
+  }
+  for (auto order : {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT}) {
+    for (int offset : {0, 1}) {
+      GeoHODestroy(&octree);
+      GeoHOInitialize(&octree, {{0, 0, 0}, {1, 1, 1}});
+      GeoHOSetKeyOrder(&octree, order);
+      GeoHOAttachFloat(&octree, &x[offset], &y[offset], &z[offset], n);
+      EXPECT_EQ(n, GeoHONumVertices(&octree));
+      // The queries compare the coordinates converted to double.
+      std::vector<double> dx(&x[offset], &x[offset] + n);
+      std::vector<double> dy(&y[offset], &y[offset] + n);
+      std::vector<double> dz(&z[offset], &z[offset] + n);
+      CheckAttachedTree(&octree, dx.data(), dy.data(), dz.data(), n);
+      struct GeoPoint p = {0.5, 0.5, 0.5};
+      GeoHOVisitNearVertices(&octree, &p, 0.1, CheckNoCoordinates, 0);
+    }
+  }
+  // A tree attached to floats can be attached to doubles and back.
+  std::vector<double> dx(x.begin(), x.end() - 1);
+  std::vector<double> dy(y.begin(), y.end() - 1);
+  std::vector<double> dz(z.begin(), z.end() - 1);
+  GeoHOAttach(&octree, dx.data(), dy.data(), dz.data(), n);
+  EXPECT_EQ(nullptr, octree.float_x);
+  CheckAttachedTree(&octree, dx.data(), dy.data(), dz.data(), n);
+  GeoHOAttachFloat(&octree, x.data(), y.data(), z.data(), n / 2);
+  EXPECT_EQ(nullptr, octree.vertices.x);
+  CheckAttachedTree(&octree, dx.data(), dy.data(), dz.data(), n / 2);
+}
+
+TEST_F(HashedOctree, FloatAttachedTreeFollowsTransforms) {
+  int n = 2000;
+  std::vector<float> x(n), y(n), z(n);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  for (int i = 0; i < n; ++i) {
+    x[i] = dist(gen);
+    y[i] = dist(gen);
+    z[i] = dist(gen);
+  }
+  GeoHOSetGrowBoundingBox(&octree, 1);
+  GeoHOAttachFloat(&octree, x.data(), y.data(), z.data(), n);
+  // A rotation about the z axis and a shift that moves some of the
+  // vertices out of the box.
+  double T[3][4] = {
+      {0.6, -0.8, 0.0, 0.5},
+      {0.8, 0.6, 0.0, 0.0},
+      {0.0, 0.0, 1.0, 0.25}};
+  std::vector<float> tx(n), ty(n), tz(n);
+  GeoApplyTransformFloat(T, x.data(), y.data(), z.data(), tx.data(),
+                         ty.data(), tz.data(), n);
+  GeoApplyTransformFloatInplace(T, x.data(), y.data(), z.data(), n);
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(tx[i], x[i]);
+    EXPECT_EQ(ty[i], y[i]);
+    EXPECT_EQ(tz[i], z[i]);
+  }
+  GeoHOUpdate(&octree);
+  EXPECT_EQ(-1.0, octree.bbox.min.x);
+  std::vector<double> dx(x.begin(), x.end());
+  std::vector<double> dy(y.begin(), y.end());
+  std::vector<double> dz(z.begin(), z.end());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(in_box({dx[i], dy[i], dz[i]}, octree.bbox));
+  }
+  CheckAttachedTree(&octree, dx.data(), dy.data(), dz.data(), n);
+}
+
+TEST_F(HashedOctree, HilbertNoDuplicatesAfterDeduplicate) {
+  GeoHOSetKeyOrder(&octree, GEO_KEY_ORDER_HILBERT);
+  int num_vertices = 500;
+  GeoVAResize(&vertex_array, num_vertices);
+  indices.resize(num_vertices);
+  FillWithRandomItems(&vertex_array, &octree.bbox, num_vertices, &indices[0]);
+  GeoHOInsert(&octree, &vertex_array);
+  double my_eps = 1.0e-2;
+  GeoHODeleteDuplicates(&octree, my_eps, TrivialDtor, 0);
+  EXPECT_EQ(0, count_close_pairs(&octree.vertices, my_eps));
+}
+
 }
@@ -0,0 +1,329 @@
+#include <hashed_octree.h>
+#include <test_utilities.h>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+
+struct Configuration {
+  int num_vertices;
+  int num_queries;
+  double epsilon;
+  int depth;
+  int directory_bits;
+};
+
+struct QueryStats {
+  double ranges;
+  double cycles;
+  double cache_misses;
+  double batch_cycles;
+  double ball_cycles;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+// Returns a file descriptor for a cache miss counter of this process or -1
+// if performance counters aren't available.
+static int open_cache_miss_counter() {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void start_counter(int fd) {
+#ifdef __linux__
+  if (fd < 0) return;
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+static long long stop_counter(int fd) {
+#ifdef __linux__
+  if (fd < 0) return -1;
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  long long count;
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+  return count;
+#else
+  return -1;
+#endif
+}
+
+// Same node selection as GeoHOVisitNearVertices.
+static void find_nodes(GeoNodeKey64 node, int depth,
+                       const struct GeoBoundingBox &bbox,
+                       const struct GeoBoundingBox &p_bbox, double eps,
+                       std::vector<GeoNodeKey64> *nodes) {
+  if (p_bbox.max.x < bbox.min.x || bbox.max.x < p_bbox.min.x ||
+      p_bbox.max.y < bbox.min.y || bbox.max.y < p_bbox.min.y ||
+      p_bbox.max.z < bbox.min.z || bbox.max.z < p_bbox.min.z) {
+    return;
+  }
+  double volume = (bbox.max.x - bbox.min.x) * (bbox.max.y - bbox.min.y) *
+      (bbox.max.z - bbox.min.z);
+  if (GeoNodeLevel64(node) == depth || volume < 8 * eps * eps * eps) {
+    nodes->push_back(node);
+    return;
+  }
+  GeoNodeKey64 children[8];
+  GeoNodeComputeChildKeys64(node, children);
+  struct GeoBoundingBox child_boxes[8];
+  GeoComputeChildBoxes(&bbox, child_boxes);
+  for (int i = 0; i < 8; ++i) {
+    find_nodes(children[i], depth, child_boxes[i], p_bbox, eps, nodes);
+  }
+}
+
+// Number of contiguous, non-empty index ranges of the hashes array that a
+// query around p has to scan.
+static int count_ranges(const struct GeoHashedOctree &tree,
+                        const struct GeoPoint &p, double eps) {
+  struct GeoBoundingBox p_bbox = {
+    {p.x - eps, p.y - eps, p.z - eps}, {p.x + eps, p.y + eps, p.z + eps}};
+  GeoNodeKey64 node = GeoNodeSmallestContaining64(&tree.bbox, &p_bbox);
+  int level = GeoNodeLevel64(node);
+  if (level > tree.depth) node >>= 3 * (level - tree.depth);
+  std::vector<GeoNodeKey64> nodes;
+  find_nodes(node, tree.depth, GeoNodeBox64(node, &tree.bbox), p_bbox, eps,
+             &nodes);
+  int shift = 3 * (GeoNodeMaxDepth64() - tree.depth);
+  const GeoSpatialHash64 *begin = tree.hashes;
+  const GeoSpatialHash64 *end = tree.hashes + tree.vertices.size;
+  std::vector<std::pair<long, long>> ranges;
+  for (auto n : nodes) {
+    if (tree.order == GEO_KEY_ORDER_HILBERT) n = GeoNodeMortonToHilbert64(n);
+    long l = std::lower_bound(begin, end, GeoNodeBegin64(n) >> shift) - begin;
+    long h = std::lower_bound(begin, end, GeoNodeEnd64(n) >> shift) - begin;
+    if (l < h) ranges.push_back(std::make_pair(l, h));
+  }
+  std::sort(ranges.begin(), ranges.end());
+  int num_ranges = 0;
+  long last_end = -1;
+  for (auto r : ranges) {
+    if (r.first != last_end) ++num_ranges;
+    last_end = r.second;
+  }
+  return num_ranges;
+}
+
+extern "C" {
+
+static int count_hits(struct GeoVertexArray *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+static int count_batch_hits(struct GeoVertexArray *, int, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+}
+
+static QueryStats run_queries(GeoKeyOrder order, const Configuration &conf,
+                              const struct GeoVertexArray &va,
+                              const std::vector<struct GeoPoint> &queries,
+                              int counter) {
+  struct GeoHashedOctree tree;
+  GeoHOInitializeWithDepth(&tree, UnitCube(), conf.depth);
+  GeoHOSetKeyOrder(&tree, order);
+  GeoHOSetDirectoryBits(&tree, conf.directory_bits);
+  GeoHOInsert(&tree, &va);
+
+  QueryStats stats = {0, 0, 0, 0, 0};
+  for (const auto &p : queries) {
+    stats.ranges += count_ranges(tree, p, conf.epsilon);
+  }
+
+  int n = queries.size();
+  int hits = 0;
+  start_counter(counter);
+  uint64_t start = rdtsc();
+  for (const auto &p : queries) {
+    GeoHOVisitNearVertices(&tree, &p, conf.epsilon, count_hits, &hits);
+  }
+  uint64_t end = rdtsc();
+  long long misses = stop_counter(counter);
+  stats.ranges /= n;
+  stats.cycles = (double)(end - start) / n;
+  stats.cache_misses = misses < 0 ? -1.0 : (double)misses / n;
+
+  int batch_hits = 0;
+  start = rdtsc();
+  GeoHOVisitNearVerticesBatch(&tree, queries.data(), n, conf.epsilon,
+                              count_batch_hits, &batch_hits);
+  end = rdtsc();
+  stats.batch_cycles = (double)(end - start) / n;
+  if (batch_hits != hits) {
+    std::cerr << "Error: batched queries found " << batch_hits <<
+        " instead of " << hits << " vertices." << std::endl;
+  }
+
+  int ball_hits = 0;
+  start = rdtsc();
+  for (const auto &p : queries) {
+    GeoHOVisitVerticesInBall(&tree, &p, conf.epsilon, count_hits, &ball_hits);
+  }
+  end = rdtsc();
+  stats.ball_cycles = (double)(end - start) / n;
+
+  GeoHODestroy(&tree);
+  return stats;
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  struct GeoBoundingBox bbox = UnitCube();
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, conf.num_vertices);
+  std::vector<int> indices(conf.num_vertices);
+  FillWithRandomItems(&va, &bbox, conf.num_vertices, &indices[0]);
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  std::vector<struct GeoPoint> queries(conf.num_queries);
+  for (auto &p : queries) {
+    p = {dist(gen), dist(gen), dist(gen)};
+  }
+
+  int counter = open_cache_miss_counter();
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_queries\": " << conf.num_queries << ",\n";
+  std::cout << "  \"epsilon\": " << conf.epsilon << ",\n";
+  std::cout << "  \"depth\": " << conf.depth << ",\n";
+  std::cout << "  \"directory_bits\": " << conf.directory_bits << ",\n";
+  std::cout << "  \"per_query\": {\n";
+  const GeoKeyOrder orders[] = {GEO_KEY_ORDER_MORTON, GEO_KEY_ORDER_HILBERT};
+  const char *names[] = {"morton", "hilbert"};
+  for (int i = 0; i < 2; ++i) {
+    QueryStats stats = run_queries(orders[i], conf, va, queries, counter);
+    std::cout << "    \"" << names[i] << "\": {\n";
+    std::cout << "      \"ranges\":       " << stats.ranges << ",\n";
+    std::cout << "      \"cycles\":       " << stats.cycles << ",\n";
+    std::cout << "      \"cache_misses\": " << stats.cache_misses << ",\n";
+    std::cout << "      \"batch_cycles\": " << stats.batch_cycles << ",\n";
+    std::cout << "      \"ball_cycles\":  " << stats.ball_cycles << "\n";
+    std::cout << "    }" << (i == 0 ? "," : "") << "\n";
+  }
+  std::cout << "  }\n";
+  std::cout << "}\n";
+
+#ifdef __linux__
+  if (counter >= 0) close(counter);
+#endif
+  GeoVADestroy(&va);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: key_order_test "
+    "[--num_vertices num_vertices] "
+    "[--num_queries num_queries] "
+    "[--epsilon epsilon] "
+    "[--depth depth] "
+    "[--directory_bits bits] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_vertices = 100000;
+  conf.num_queries = 10000;
+  conf.epsilon = 1.0e-2;
+  conf.depth = GeoNodeMaxDepth();
+  conf.directory_bits = GEO_HO_DEFAULT_DIRECTORY_BITS;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_vertices", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of vertices parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_vertices = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_queries", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of queries parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_queries = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--epsilon", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: epsilon missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.epsilon = std::stod(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--depth", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: depth missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.depth = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--directory_bits", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: directory bits missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.directory_bits = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
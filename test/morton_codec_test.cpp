@@ -0,0 +1,172 @@
+#include <spatial_hash.h>
+#include <vertex_array.h>
+#include <test_utilities.h>
+#include <string>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_keys;
+  int num_iter;
+};
+
+struct TimingResults {
+  double encode;
+  double encode64;
+  double decode;
+  double decode64;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+static const char *codec_name(GeoMortonCodec codec) {
+  switch (codec) {
+    case GEO_MORTON_CODEC_SHIFT: return "shift";
+    case GEO_MORTON_CODEC_TABLE: return "table";
+    case GEO_MORTON_CODEC_BMI2: return "bmi2";
+  }
+  return "unknown";
+}
+
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  struct GeoBoundingBox bbox = UnitCube();
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, conf.num_keys);
+  std::vector<int> indices(conf.num_keys);
+  FillWithRandomItems(&va, &bbox, conf.num_keys, &indices[0]);
+
+  // Random node keys at all levels for the decode benchmarks.
+  std::mt19937 gen(42);
+  std::vector<GeoNodeKey> keys(conf.num_keys);
+  std::vector<GeoNodeKey64> keys64(conf.num_keys);
+  for (int i = 0; i < conf.num_keys; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    int level = gen() % (GeoNodeMaxDepth() + 1);
+    keys[i] = (GeoNodeKey)((bits | (1ull << 63)) >> (63 - 3 * level));
+    level = gen() % (GeoNodeMaxDepth64() + 1);
+    keys64[i] = (bits | (1ull << 63)) >> (63 - 3 * level);
+  }
+
+  GeoMortonCodec default_codec = GeoGetMortonCodec();
+  const GeoMortonCodec codecs[] = {
+    GEO_MORTON_CODEC_SHIFT, GEO_MORTON_CODEC_TABLE, GEO_MORTON_CODEC_BMI2};
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_keys\": " << conf.num_keys << ",\n";
+  std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
+  std::cout << "  \"default_codec\": \"" << codec_name(default_codec) <<
+      "\",\n";
+  std::cout << "  \"averages\": {\n";
+  bool first = true;
+  for (auto codec : codecs) {
+    if (!GeoSetMortonCodec(codec)) continue;
+    TimingResults results = {0, 0, 0, 0};
+    // Accumulate the results so the compiler can't drop the calls.
+    uint64_t checksum = 0;
+    for (int i = 0; i < conf.num_iter; ++i) {
+      uint64_t start, end;
+      start = rdtsc();
+      for (int j = 0; j < va.size; ++j) {
+        struct GeoPoint p = {va.x[j], va.y[j], va.z[j]};
+        checksum += GeoComputeHash(&bbox, &p);
+      }
+      end = rdtsc();
+      results.encode += (end - start) / 1.0e6;
+
+      start = rdtsc();
+      for (int j = 0; j < va.size; ++j) {
+        struct GeoPoint p = {va.x[j], va.y[j], va.z[j]};
+        checksum += GeoComputeHash64(&bbox, &p);
+      }
+      end = rdtsc();
+      results.encode64 += (end - start) / 1.0e6;
+
+      start = rdtsc();
+      for (int j = 0; j < conf.num_keys; ++j) {
+        checksum += GeoNodeBox(keys[j], &bbox).min.x;
+      }
+      end = rdtsc();
+      results.decode += (end - start) / 1.0e6;
+
+      start = rdtsc();
+      for (int j = 0; j < conf.num_keys; ++j) {
+        checksum += GeoNodeBox64(keys64[j], &bbox).min.x;
+      }
+      end = rdtsc();
+      results.decode64 += (end - start) / 1.0e6;
+    }
+    if (!first) std::cout << ",\n";
+    first = false;
+    std::cout << "    \"" << codec_name(codec) << "\": {\n";
+    std::cout << "      \"GeoComputeHash\":   " << results.encode / conf.num_iter << ",\n";
+    std::cout << "      \"GeoComputeHash64\": " << results.encode64 / conf.num_iter << ",\n";
+    std::cout << "      \"GeoNodeBox\":       " << results.decode / conf.num_iter << ",\n";
+    std::cout << "      \"GeoNodeBox64\":     " << results.decode64 / conf.num_iter << ",\n";
+    std::cout << "      \"checksum\":         " << checksum << "\n";
+    std::cout << "    }";
+  }
+  std::cout << "\n  }\n";
+  std::cout << "}\n";
+
+  GeoSetMortonCodec(default_codec);
+  GeoVADestroy(&va);
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: morton_codec_test "
+    "[--num_keys num_keys] "
+    "[--num_iter num_iter] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_keys = 100000;
+  conf.num_iter = 10;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_keys", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of keys parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_keys = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_iter", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of iterations parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_iter = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
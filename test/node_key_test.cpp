@@ -0,0 +1,185 @@
+#include <spatial_hash.h>
+#include <test_utilities.h>
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_keys;
+  int num_iter;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+// The loop based helpers the inline ones replaced. They serve as the
+// baseline for the timings.
+__attribute__((noinline))
+static int loop_level(GeoNodeKey64 key) {
+  int level = GeoNodeMaxDepth64();
+  while (level > 0) {
+    if (key & (1ull << (level * 3))) return level;
+    --level;
+  }
+  return level;
+}
+
+__attribute__((noinline))
+static int loop_valid_key(GeoNodeKey64 key) {
+  GeoNodeKey64 m = 1ull << (GeoNodeMaxDepth64() * 3);
+  while (m > 0) {
+    if (key & m) return 1;
+    for (int i = 0; i < 3; ++i, m >>= 1) {
+      if (key & m) return 0;
+    }
+  }
+  return 0;
+}
+
+__attribute__((noinline))
+static GeoSpatialHash64 loop_begin(GeoNodeKey64 key) {
+  int level = loop_level(key);
+  GeoSpatialHash64 begin = key ^ (1ull << (3 * level));
+  begin <<= 3 * (GeoNodeMaxDepth64() - level);
+  return begin;
+}
+
+__attribute__((noinline))
+static GeoNodeKey64 loop_common_prefix(GeoSpatialHash64 min,
+                                       GeoSpatialHash64 max) {
+  int level = GeoNodeMaxDepth64();
+  while (min != max) {
+    min >>= 3;
+    max >>= 3;
+    --level;
+  }
+  return min | (1ull << (3 * level));
+}
+
+static GeoNodeKey64 clz_common_prefix(GeoSpatialHash64 min,
+                                      GeoSpatialHash64 max) {
+  int bits = 63 - __builtin_clzll(((min ^ max) << 1) | 1ull);
+  int drop = (bits + 2) / 3;
+  return (min >> (3 * drop)) |
+      (1ull << (3 * (GeoNodeMaxDepth64() - drop)));
+}
+
+template <typename F>
+static double time_mcycles(const std::vector<GeoNodeKey64> &keys, F f,
+                           uint64_t *checksum) {
+  uint64_t start = rdtsc();
+  for (auto key : keys) {
+    *checksum += f(key);
+  }
+  uint64_t end = rdtsc();
+  return (end - start) / 1.0e6;
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  // Random node keys at all levels, half of the hash pairs share a long
+  // prefix so that the common prefix search has to do some work.
+  std::mt19937 gen(42);
+  std::vector<GeoNodeKey64> keys(conf.num_keys);
+  std::vector<GeoSpatialHash64> hashes(conf.num_keys);
+  for (int i = 0; i < conf.num_keys; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    int level = gen() % (GeoNodeMaxDepth64() + 1);
+    keys[i] = (bits | (1ull << 63)) >> (63 - 3 * level);
+    hashes[i] = bits >> 1;
+  }
+
+  const char *names[] = {"level", "valid_key", "begin", "common_prefix"};
+  double loop[4] = {0, 0, 0, 0};
+  double clz[4] = {0, 0, 0, 0};
+  // Accumulate the results so the compiler can't drop the calls.
+  uint64_t checksum_loop = 0;
+  uint64_t checksum_clz = 0;
+  for (int i = 0; i < conf.num_iter; ++i) {
+    loop[0] += time_mcycles(keys, loop_level, &checksum_loop);
+    clz[0] += time_mcycles(keys, GeoNodeLevel64, &checksum_clz);
+    loop[1] += time_mcycles(keys, loop_valid_key, &checksum_loop);
+    clz[1] += time_mcycles(keys, GeoNodeValidKey64, &checksum_clz);
+    loop[2] += time_mcycles(keys, loop_begin, &checksum_loop);
+    clz[2] += time_mcycles(keys, GeoNodeBegin64, &checksum_clz);
+    int j = 0;
+    loop[3] += time_mcycles(keys, [&](GeoNodeKey64 key) {
+        j = (j + 1) % conf.num_keys;
+        return loop_common_prefix(hashes[j], hashes[j] ^ (key >> 3));
+      }, &checksum_loop);
+    j = 0;
+    clz[3] += time_mcycles(keys, [&](GeoNodeKey64 key) {
+        j = (j + 1) % conf.num_keys;
+        return clz_common_prefix(hashes[j], hashes[j] ^ (key >> 3));
+      }, &checksum_clz);
+  }
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_keys\": " << conf.num_keys << ",\n";
+  std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
+  std::cout << "  \"checksums_agree\": " <<
+      (checksum_loop == checksum_clz ? "true" : "false") << ",\n";
+  std::cout << "  \"averages\": {\n";
+  for (int i = 0; i < 4; ++i) {
+    std::cout << "    \"" << names[i] << "\": {\n";
+    std::cout << "      \"loop\": " << loop[i] / conf.num_iter << ",\n";
+    std::cout << "      \"clz\":  " << clz[i] / conf.num_iter << "\n";
+    std::cout << "    }" << (i < 3 ? "," : "") << "\n";
+  }
+  std::cout << "  }\n";
+  std::cout << "}\n";
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: node_key_test "
+    "[--num_keys num_keys] "
+    "[--num_iter num_iter] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_keys = 1000000;
+  conf.num_iter = 10;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_keys", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of keys parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_keys = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_iter", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of iterations parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_iter = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
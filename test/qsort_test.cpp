@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+#include <qsort.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+
+namespace {
+
+void CheckRadixSortAgreesWithQsort(int n, int key_bits, uint64_t mask) {
+  std::mt19937 gen(n + key_bits);
+  std::vector<uint64_t> keys(n);
+  std::vector<uint32_t> tags(n);
+  uint64_t key_mask = key_bits < 64 ? (1ull << key_bits) - 1 : ~0ull;
+  for (int i = 0; i < n; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    keys[i] = bits & key_mask & mask;
+    tags[i] = i;
+  }
+  std::vector<uint64_t> expected_keys(keys);
+  std::vector<uint32_t> expected_tags(tags);
+  GeoQsortPairs(expected_keys.data(), expected_tags.data(), n);
+  GeoRadixSortPairs(keys.data(), tags.data(), n, key_bits);
+  EXPECT_EQ(expected_keys, keys);
+  EXPECT_EQ(expected_tags, tags);
+}
+
+TEST(RadixSortPairs, SortsSmallInputs) {
+  CheckRadixSortAgreesWithQsort(0, 30, ~0ull);
+  CheckRadixSortAgreesWithQsort(1, 30, ~0ull);
+  CheckRadixSortAgreesWithQsort(100, 30, ~0ull);
+}
+
+TEST(RadixSortPairs, SortsOctreeKeys) {
+  CheckRadixSortAgreesWithQsort(10000, 30, ~0ull);
+  CheckRadixSortAgreesWithQsort(100000, 30, ~0ull);
+  CheckRadixSortAgreesWithQsort(100000, 63, ~0ull);
+}
+
+TEST(RadixSortPairs, SortsBvhKeys) {
+  CheckRadixSortAgreesWithQsort(100000, 3 * 20 + 1, ~0ull);
+  CheckRadixSortAgreesWithQsort(100000, 1, ~0ull);
+}
+
+TEST(RadixSortPairs, KeepsTiesInTagOrder) {
+  // Few distinct keys so most keys are tied.
+  CheckRadixSortAgreesWithQsort(100000, 30, 0x7ull << 20);
+}
+
+// Tags in descending order, which the sort must keep among tied keys.
+void CheckRadixSortIsStable(int n) {
+  std::mt19937 gen(n);
+  std::vector<uint64_t> keys(n);
+  std::vector<uint32_t> tags(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = gen() % 16;
+    tags[i] = n - i;
+  }
+  std::vector<std::pair<uint64_t, uint32_t>> expected(n);
+  for (int i = 0; i < n; ++i) expected[i] = {keys[i], tags[i]};
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const std::pair<uint64_t, uint32_t> &a,
+                      const std::pair<uint64_t, uint32_t> &b) {
+                     return a.first < b.first;
+                   });
+  GeoRadixSortPairs(keys.data(), tags.data(), n, 4);
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(expected[i].first, keys[i]);
+    EXPECT_EQ(expected[i].second, tags[i]);
+  }
+}
+
+TEST(RadixSortPairs, IsStableForAllSizes) {
+  CheckRadixSortIsStable(100);
+  CheckRadixSortIsStable(100000);
+}
+
+TEST(RadixSortPairs, SkipsDigitsSharedByAllKeys) {
+  CheckRadixSortAgreesWithQsort(100000, 63, 0xffull << 30);
+  CheckRadixSortAgreesWithQsort(100000, 30, 0);
+}
+
+}
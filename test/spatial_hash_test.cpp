@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
 #include <spatial_hash.h>
 #include <basic_types.h>
+#include <vertex_array.h>
+#include <test_utilities.h>
+#include <cmath>
+#include <random>
+#include <vector>
 
 
 namespace {
@@ -82,3 +87,436 @@ TEST(GeoNodeKey, BeginSpotChecks) {
 
 }
 
+
+namespace {
+
+TEST(ComputeHash64, IsNullAtOrigin) {
+  struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  struct GeoPoint p{eps, eps, eps};
+  EXPECT_EQ(0u, GeoComputeHash64(&bbox, &p));
+}
+
+TEST(ComputeHash64, RefinesThe32BitHash) {
+  struct GeoBoundingBox bbox{{-1.0, 0.5, 2.0}, {3.0, 1.5, 7.0}};
+  struct GeoPoint points[] = {
+    {0.3, 0.7, 2.5}, {-0.99, 1.49, 6.99}, {2.0, 1.0, 4.5}, {3.0, 1.5, 7.0}};
+  for (const auto &p : points) {
+    GeoSpatialHash64 h64 = GeoComputeHash64(&bbox, &p);
+    int shift = 3 * (GeoNodeMaxDepth64() - GeoNodeMaxDepth());
+    EXPECT_EQ(GeoComputeHash(&bbox, &p), h64 >> shift);
+  }
+}
+
+TEST(ComputeHash64, ResolvesPointsThe32BitHashDoesNot) {
+  struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  struct GeoPoint p0{0.5, 0.5, 0.5};
+  struct GeoPoint p1{0.5 + 1.0e-5, 0.5, 0.5};
+  EXPECT_EQ(GeoComputeHash(&bbox, &p0), GeoComputeHash(&bbox, &p1));
+  EXPECT_NE(GeoComputeHash64(&bbox, &p0), GeoComputeHash64(&bbox, &p1));
+}
+
+TEST(GeoNodeKey64, ZeroIsNotValidNode) {
+  EXPECT_FALSE(GeoNodeValidKey64(0u));
+}
+
+TEST(GeoNodeKey64, RootNodeIsValid) {
+  EXPECT_TRUE(GeoNodeValidKey64(GeoNodeRoot64()));
+}
+
+TEST(GeoNodeKey64, FinestNodesAreValid) {
+  EXPECT_TRUE(GeoNodeValidKey64(1ull << 63));
+  EXPECT_TRUE(GeoNodeValidKey64(~0ull));
+  EXPECT_EQ(GeoNodeMaxDepth64(), GeoNodeLevel64(~0ull));
+}
+
+TEST(GeoNodeKey64, ChildrenOfRootAreAtLevelOne) {
+  GeoNodeKey64 child_keys[8];
+  GeoNodeComputeChildKeys64(GeoNodeRoot64(), child_keys);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(1, GeoNodeLevel64(child_keys[i]));
+    EXPECT_EQ(GeoNodeRoot64(), GeoNodeParent64(child_keys[i]));
+  }
+}
+
+TEST(GeoNodeKey64, BeginAndEndOfRoot) {
+  EXPECT_EQ(0u, GeoNodeBegin64(GeoNodeRoot64()));
+  EXPECT_EQ(1ull << 63, GeoNodeEnd64(GeoNodeRoot64()));
+}
+
+TEST(GeoNodeKey64, BeginSpotChecks) {
+  EXPECT_EQ(1ull << (3 * 20), GeoNodeBegin64(9u));
+  EXPECT_EQ(3ull << (3 * 20), GeoNodeBegin64(11u));
+  EXPECT_EQ(10ull << (3 * 19), GeoNodeBegin64(74u));
+}
+
+TEST(GeoNodeKey64, NodeBoxContainsPoint) {
+  struct GeoBoundingBox bbox{{-1.0, 0.5, 2.0}, {3.0, 1.5, 7.0}};
+  struct GeoPoint p{0.3, 0.7, 2.5};
+  GeoNodeKey64 key = GeoComputeHash64(&bbox, &p) |
+      (1ull << (3 * GeoNodeMaxDepth64()));
+  for (; key != 0; key = GeoNodeParent64(key)) {
+    struct GeoBoundingBox b = GeoNodeBox64(key, &bbox);
+    EXPECT_LE(b.min.x, p.x);
+    EXPECT_LE(b.min.y, p.y);
+    EXPECT_LE(b.min.z, p.z);
+    EXPECT_GE(b.max.x, p.x);
+    EXPECT_GE(b.max.y, p.y);
+    EXPECT_GE(b.max.z, p.z);
+  }
+}
+
+TEST(GeoNodeKey64, SmallestContainingOfTinyBoxIsDeep) {
+  struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  struct GeoBoundingBox b{{0.1, 0.1, 0.1}, {0.1 + 1.0e-7, 0.1, 0.1}};
+  GeoNodeKey64 key = GeoNodeSmallestContaining64(&bbox, &b);
+  EXPECT_GT(GeoNodeLevel64(key), GeoNodeMaxDepth());
+  EXPECT_LE(GeoNodeBegin64(key), GeoComputeHash64(&bbox, &b.min));
+  EXPECT_GT(GeoNodeEnd64(key), GeoComputeHash64(&bbox, &b.max));
+}
+
+TEST(GeoNodeKey64, RootHasNoNeighbors) {
+  GeoNodeKey64 neighbors[26];
+  EXPECT_EQ(0, GeoNodeComputeNeighborKeys64(GeoNodeRoot64(), neighbors));
+  for (int i = 0; i < 26; ++i) EXPECT_EQ(0u, neighbors[i]);
+}
+
+TEST(GeoNodeKey64, NeighborsOfChildrenOfRootAreSiblings) {
+  GeoNodeKey64 children[8];
+  GeoNodeComputeChildKeys64(GeoNodeRoot64(), children);
+  for (int i = 0; i < 8; ++i) {
+    GeoNodeKey64 neighbors[26];
+    EXPECT_EQ(7, GeoNodeComputeNeighborKeys64(children[i], neighbors));
+    for (int j = 0; j < 26; ++j) {
+      if (neighbors[j] == 0) continue;
+      EXPECT_EQ(GeoNodeRoot64(), GeoNodeParent64(neighbors[j]));
+      EXPECT_NE(children[i], neighbors[j]);
+    }
+  }
+}
+
+template <typename Key, typename F>
+static void check_neighbor_boxes(Key key, F compute_neighbors,
+                                 struct GeoBoundingBox (*box)(
+                                     Key, const struct GeoBoundingBox *)) {
+  struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  struct GeoBoundingBox b = box(key, &bbox);
+  double h = b.max.x - b.min.x;
+  Key neighbors[26];
+  int num_valid = compute_neighbors(key, neighbors);
+  int m = 0;
+  int num_inside = 0;
+  for (int dz = -1; dz <= 1; ++dz) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        if (dx == 0 && dy == 0 && dz == 0) continue;
+        struct GeoPoint c = {b.min.x + (dx + 0.5) * h,
+            b.min.y + (dy + 0.5) * h, b.min.z + (dz + 0.5) * h};
+        bool inside = c.x > 0 && c.x < 1 && c.y > 0 && c.y < 1 &&
+            c.z > 0 && c.z < 1;
+        Key n = neighbors[m++];
+        if (!inside) {
+          EXPECT_EQ(0u, n);
+          continue;
+        }
+        ++num_inside;
+        struct GeoBoundingBox nb = box(n, &bbox);
+        EXPECT_NEAR(c.x, 0.5 * (nb.min.x + nb.max.x), 1.0e-3 * h);
+        EXPECT_NEAR(c.y, 0.5 * (nb.min.y + nb.max.y), 1.0e-3 * h);
+        EXPECT_NEAR(c.z, 0.5 * (nb.min.z + nb.max.z), 1.0e-3 * h);
+      }
+    }
+  }
+  EXPECT_EQ(num_inside, num_valid);
+}
+
+TEST(GeoNodeKey64, NeighborsAreAdjacentBoxes) {
+  std::mt19937 gen(5);
+  for (int i = 0; i < 1000; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    // Bias towards the boundary of the root box.
+    if (i % 4 == 0) bits &= 0x36db6db6db6db6dbull;
+    if (i % 4 == 1) bits |= 0x1249249249249249ull;
+    int level = 1 + gen() % GeoNodeMaxDepth64();
+    GeoNodeKey64 key = (bits | (1ull << 63)) >> (63 - 3 * level);
+    check_neighbor_boxes(key, GeoNodeComputeNeighborKeys64, GeoNodeBox64);
+    level = 1 + gen() % GeoNodeMaxDepth();
+    GeoNodeKey key32 = (GeoNodeKey)((bits | (1ull << 63)) >> (63 - 3 * level));
+    check_neighbor_boxes(key32, GeoNodeComputeNeighborKeys, GeoNodeBox);
+  }
+}
+
+TEST(GeoNodeKey64, CoordinatesRoundTrip) {
+  std::mt19937 gen(7);
+  for (int i = 0; i < 1000; ++i) {
+    int level = gen() % (GeoNodeMaxDepth64() + 1);
+    uint32_t mask = (1u << level) - 1;
+    uint32_t a = gen() & mask, b = gen() & mask, c = gen() & mask;
+    GeoNodeKey64 key = GeoNodeFromCoordinates64(level, a, b, c);
+    ASSERT_TRUE(GeoNodeValidKey64(key));
+    EXPECT_EQ(level, GeoNodeLevel64(key));
+    uint32_t a2, b2, c2;
+    GeoNodeCoordinates64(key, &a2, &b2, &c2);
+    EXPECT_EQ(a, a2);
+    EXPECT_EQ(b, b2);
+    EXPECT_EQ(c, c2);
+    struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+    struct GeoBoundingBox box = GeoNodeBox64(key, &bbox);
+    EXPECT_DOUBLE_EQ(a / double(1u << level), box.min.x);
+    EXPECT_DOUBLE_EQ(c / double(1u << level), box.min.z);
+  }
+}
+
+TEST(GeoNodeKey64, KeysWithoutMarkerTripleAreInvalid) {
+  EXPECT_FALSE(GeoNodeValidKey64(2u));
+  EXPECT_FALSE(GeoNodeValidKey64(4u | 1u));
+  EXPECT_FALSE(GeoNodeValidKey64(1ull << 62));
+  EXPECT_FALSE(GeoNodeValidKey(1u << 31));
+  EXPECT_TRUE(GeoNodeValidKey(1u << 30));
+  EXPECT_EQ(GeoNodeMaxDepth(), GeoNodeLevel(1u << 30));
+}
+
+TEST(GeoNodeKey64, SmallestContainingIsTightest) {
+  struct GeoBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<> dist(-0.1, 1.1);
+  std::exponential_distribution<> size(1.0e3);
+  for (int i = 0; i < 10000; ++i) {
+    struct GeoPoint p = {dist(gen), dist(gen), dist(gen)};
+    struct GeoBoundingBox b{p, {p.x + size(gen), p.y + size(gen),
+        p.z + size(gen)}};
+    GeoSpatialHash64 min = GeoComputeHash64(&bbox, &b.min);
+    GeoSpatialHash64 max = GeoComputeHash64(&bbox, &b.max);
+    GeoNodeKey64 key = GeoNodeSmallestContaining64(&bbox, &b);
+    ASSERT_TRUE(GeoNodeValidKey64(key));
+    EXPECT_LE(GeoNodeBegin64(key), min);
+    EXPECT_GT(GeoNodeEnd64(key), max);
+    if (GeoNodeLevel64(key) < GeoNodeMaxDepth64()) {
+      // Neither of the children can contain both corners.
+      GeoNodeKey64 children[8];
+      GeoNodeComputeChildKeys64(key, children);
+      for (int j = 0; j < 8; ++j) {
+        EXPECT_FALSE(GeoNodeBegin64(children[j]) <= min &&
+                     max < GeoNodeEnd64(children[j]));
+      }
+    }
+
+    GeoNodeKey key32 = GeoNodeSmallestContaining(&bbox, &b);
+    ASSERT_TRUE(GeoNodeValidKey(key32));
+    EXPECT_LE(GeoNodeBegin(key32), GeoComputeHash(&bbox, &b.min));
+    EXPECT_GT(GeoNodeEnd(key32), GeoComputeHash(&bbox, &b.max));
+  }
+}
+
+}
+
+namespace {
+
+struct ComputeHashes : public ::testing::Test {
+  struct GeoVertexArray va;
+  std::vector<int> indices;
+  struct GeoBoundingBox bbox{{-1.0, 0.5, 2.0}, {3.0, 1.5, 7.0}};
+
+  void SetUp() override {
+    GeoVAInitialize(&va);
+    // Odd size so that the remainder loops get exercised too.
+    int n = 1001;
+    GeoVAResize(&va, n);
+    indices.resize(n);
+    struct GeoBoundingBox larger{{-2.0, 0.0, 1.0}, {4.0, 2.0, 8.0}};
+    FillWithRandomItems(&va, &larger, n, &indices[0]);
+    va.x[0] = bbox.min.x;
+    va.y[0] = bbox.min.y;
+    va.z[0] = bbox.min.z;
+    va.x[1] = bbox.max.x;
+    va.y[1] = bbox.max.y;
+    va.z[1] = bbox.max.z;
+  }
+  void TearDown() override {
+    GeoVADestroy(&va);
+  }
+};
+
+TEST_F(ComputeHashes, AgreesWithComputeHash) {
+  std::vector<GeoSpatialHash> hashes(va.size);
+  GeoComputeHashes(&bbox, &va, &hashes[0]);
+  for (int i = 0; i < va.size; ++i) {
+    struct GeoPoint p{va.x[i], va.y[i], va.z[i]};
+    EXPECT_EQ(GeoComputeHash(&bbox, &p), hashes[i]) << ">>> i == " << i;
+  }
+}
+
+TEST_F(ComputeHashes, AgreesWithComputeHash64) {
+  std::vector<GeoSpatialHash64> hashes(va.size);
+  GeoComputeHashes64(&bbox, &va, &hashes[0]);
+  for (int i = 0; i < va.size; ++i) {
+    struct GeoPoint p{va.x[i], va.y[i], va.z[i]};
+    EXPECT_EQ(GeoComputeHash64(&bbox, &p), hashes[i]) << ">>> i == " << i;
+  }
+}
+
+}
+
+namespace {
+
+const GeoMortonCodec all_codecs[] = {
+  GEO_MORTON_CODEC_SHIFT, GEO_MORTON_CODEC_TABLE, GEO_MORTON_CODEC_BMI2};
+
+struct MortonCodec : public ComputeHashes {
+  GeoMortonCodec default_codec;
+  void SetUp() override {
+    ComputeHashes::SetUp();
+    default_codec = GeoGetMortonCodec();
+  }
+  void TearDown() override {
+    GeoSetMortonCodec(default_codec);
+    ComputeHashes::TearDown();
+  }
+};
+
+TEST_F(MortonCodec, PortableCodecsAreSupported) {
+  EXPECT_TRUE(GeoMortonCodecSupported(GEO_MORTON_CODEC_SHIFT));
+  EXPECT_TRUE(GeoMortonCodecSupported(GEO_MORTON_CODEC_TABLE));
+  EXPECT_TRUE(GeoMortonCodecSupported(GeoGetMortonCodec()));
+}
+
+TEST_F(MortonCodec, AllCodecsAgreeOnHashes) {
+  ASSERT_TRUE(GeoSetMortonCodec(GEO_MORTON_CODEC_SHIFT));
+  std::vector<GeoSpatialHash> hashes(va.size);
+  GeoComputeHashes(&bbox, &va, &hashes[0]);
+  std::vector<GeoSpatialHash64> hashes64(va.size);
+  GeoComputeHashes64(&bbox, &va, &hashes64[0]);
+  for (auto codec : all_codecs) {
+    if (!GeoSetMortonCodec(codec)) continue;
+    for (int i = 0; i < va.size; ++i) {
+      struct GeoPoint p{va.x[i], va.y[i], va.z[i]};
+      EXPECT_EQ(hashes[i], GeoComputeHash(&bbox, &p)) <<
+          ">>> codec == " << codec << ", i == " << i;
+      EXPECT_EQ(hashes64[i], GeoComputeHash64(&bbox, &p)) <<
+          ">>> codec == " << codec << ", i == " << i;
+    }
+  }
+}
+
+static void ExpectSameBox(const struct GeoBoundingBox &a,
+                          const struct GeoBoundingBox &b) {
+  EXPECT_EQ(a.min.x, b.min.x);
+  EXPECT_EQ(a.min.y, b.min.y);
+  EXPECT_EQ(a.min.z, b.min.z);
+  EXPECT_EQ(a.max.x, b.max.x);
+  EXPECT_EQ(a.max.y, b.max.y);
+  EXPECT_EQ(a.max.z, b.max.z);
+}
+
+TEST_F(MortonCodec, AllCodecsAgreeOnNodeBoxes) {
+  ASSERT_TRUE(GeoSetMortonCodec(GEO_MORTON_CODEC_SHIFT));
+  std::vector<GeoSpatialHash64> hashes64(va.size);
+  GeoComputeHashes64(&bbox, &va, &hashes64[0]);
+  std::vector<GeoNodeKey> keys;
+  std::vector<GeoNodeKey64> keys64;
+  for (int i = 0; i < va.size; ++i) {
+    int level = i % (GeoNodeMaxDepth64() + 1);
+    keys64.push_back((hashes64[i] | (1ull << 63)) >>
+                     (3 * (GeoNodeMaxDepth64() - level)));
+    level = i % (GeoNodeMaxDepth() + 1);
+    keys.push_back((GeoNodeKey)((hashes64[i] | (1ull << 63)) >>
+                                (3 * (GeoNodeMaxDepth64() - level))));
+  }
+  std::vector<struct GeoBoundingBox> boxes;
+  std::vector<struct GeoBoundingBox> boxes64;
+  for (int i = 0; i < va.size; ++i) {
+    boxes.push_back(GeoNodeBox(keys[i], &bbox));
+    boxes64.push_back(GeoNodeBox64(keys64[i], &bbox));
+  }
+  for (auto codec : all_codecs) {
+    if (!GeoSetMortonCodec(codec)) continue;
+    for (int i = 0; i < va.size; ++i) {
+      ExpectSameBox(boxes[i], GeoNodeBox(keys[i], &bbox));
+      ExpectSameBox(boxes64[i], GeoNodeBox64(keys64[i], &bbox));
+    }
+  }
+}
+
+}
+
+namespace {
+
+TEST(HilbertOrder, RootIsUnchanged) {
+  EXPECT_EQ(GeoNodeRoot64(), GeoNodeMortonToHilbert64(GeoNodeRoot64()));
+  EXPECT_EQ(GeoNodeRoot64(), GeoNodeHilbertToMorton64(GeoNodeRoot64()));
+}
+
+TEST(HilbertOrder, ConversionRoundTrips) {
+  std::mt19937 gen(7);
+  for (int i = 0; i < 1000; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    int level = i % (GeoNodeMaxDepth64() + 1);
+    GeoNodeKey64 key = (bits | (1ull << 63)) >> (63 - 3 * level);
+    GeoNodeKey64 hilbert = GeoNodeMortonToHilbert64(key);
+    EXPECT_EQ(level, GeoNodeLevel64(hilbert));
+    EXPECT_EQ(key, GeoNodeHilbertToMorton64(hilbert));
+  }
+}
+
+TEST(HilbertOrder, StatesAgreeWithConversion) {
+  std::mt19937 gen(13);
+  for (int i = 0; i < 1000; ++i) {
+    uint64_t bits = ((uint64_t)gen() << 32) | gen();
+    int level = i % GeoNodeMaxDepth64();
+    GeoNodeKey64 key = (bits | (1ull << 63)) >> (63 - 3 * level);
+    int state;
+    GeoNodeKey64 hilbert = GeoNodeMortonToHilbertState64(key, &state);
+    EXPECT_EQ(GeoNodeMortonToHilbert64(key), hilbert);
+    for (int j = 0; j < 8; ++j) {
+      GeoNodeKey64 child = (hilbert << 3) | GeoHilbertDigits[state][j];
+      EXPECT_EQ(GeoNodeMortonToHilbert64((key << 3) | j), child);
+      int child_state;
+      EXPECT_EQ(child, GeoNodeMortonToHilbertState64((key << 3) | j,
+                                                     &child_state));
+      EXPECT_EQ(GeoHilbertChildStates[state][j], child_state);
+    }
+  }
+}
+
+TEST(HilbertOrder, ConsecutiveCellsAreFaceNeighbours) {
+  int level = 3;
+  GeoNodeKey64 first = 1ull << (3 * level);
+  struct GeoBoundingBox bbox{{0, 0, 0}, {8, 8, 8}};
+  struct GeoBoundingBox prev = GeoNodeBox64(GeoNodeHilbertToMorton64(first),
+                                            &bbox);
+  for (GeoNodeKey64 h = first + 1; h < 2 * first; ++h) {
+    struct GeoBoundingBox b = GeoNodeBox64(GeoNodeHilbertToMorton64(h), &bbox);
+    double d = fabs(b.min.x - prev.min.x) + fabs(b.min.y - prev.min.y) +
+        fabs(b.min.z - prev.min.z);
+    EXPECT_EQ(1.0, d) << ">>> h == " << h;
+    prev = b;
+  }
+}
+
+TEST(HilbertOrder, OctantsAreContiguousRanges) {
+  struct GeoBoundingBox bbox{{-1.0, 0.5, 2.0}, {3.0, 1.5, 7.0}};
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  for (int i = 0; i < 100; ++i) {
+    struct GeoPoint p{-1.0 + 4.0 * dist(gen), 0.5 + dist(gen),
+                      2.0 + 5.0 * dist(gen)};
+    GeoSpatialHash64 h = GeoComputeHilbertHash64(&bbox, &p);
+    GeoNodeKey64 key = GeoComputeHash64(&bbox, &p) | (1ull << 63);
+    for (; key != 0; key = GeoNodeParent64(key)) {
+      GeoNodeKey64 hilbert = GeoNodeMortonToHilbert64(key);
+      EXPECT_LE(GeoNodeBegin64(hilbert), h);
+      EXPECT_GT(GeoNodeEnd64(hilbert), h);
+    }
+  }
+}
+
+TEST_F(ComputeHashes, HilbertAgreesWithComputeHilbertHash64) {
+  std::vector<GeoSpatialHash64> hashes(va.size);
+  GeoComputeHilbertHashes64(&bbox, &va, &hashes[0]);
+  for (int i = 0; i < va.size; ++i) {
+    struct GeoPoint p{va.x[i], va.y[i], va.z[i]};
+    EXPECT_EQ(GeoComputeHilbertHash64(&bbox, &p), hashes[i]) <<
+        ">>> i == " << i;
+  }
+}
+
+}
@@ -0,0 +1,391 @@
+#include <hashed_octree.h>
+#include <test_utilities.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+struct Configuration {
+  int num_batches;
+  int batch_size;
+  int num_queries;
+  double epsilon;
+  int num_frames;
+};
+
+struct StreamStats {
+  double insert_cycles;
+  int num_runs;
+  double query_cycles;
+  double compact_cycles;
+  double compacted_query_cycles;
+};
+
+Configuration parse_command_line(int argn, char **argv);
+
+extern "C" {
+
+static int count_hits(struct GeoVertexArray *, int, void *ctx) {
+  ++*static_cast<int*>(ctx);
+  return 1;
+}
+
+static int is_older(struct GeoVertexArray *va, int i, void *ctx) {
+  return (uintptr_t)va->ptrs[i] < *static_cast<uintptr_t*>(ctx);
+}
+
+}
+
+static double time_queries(struct GeoHashedOctree *tree,
+                           const std::vector<struct GeoPoint> &queries,
+                           double eps, int *hits) {
+  uint64_t start = rdtsc();
+  for (const auto &p : queries) {
+    GeoHOVisitNearVertices(tree, &p, eps, count_hits, hits);
+  }
+  uint64_t end = rdtsc();
+  return (double)(end - start) / queries.size();
+}
+
+static StreamStats run_stream(GeoInsertMode mode, const Configuration &conf,
+                              const std::vector<struct GeoVertexArray> &batches,
+                              const std::vector<struct GeoPoint> &queries) {
+  struct GeoHashedOctree tree;
+  GeoHOInitialize(&tree, UnitCube());
+  GeoHOSetInsertMode(&tree, mode);
+
+  StreamStats stats;
+  uint64_t start = rdtsc();
+  for (const auto &batch : batches) {
+    GeoHOInsert(&tree, &batch);
+  }
+  uint64_t end = rdtsc();
+  stats.insert_cycles =
+      (double)(end - start) / ((double)conf.num_batches * conf.batch_size);
+  stats.num_runs = tree.num_runs;
+
+  int hits = 0;
+  stats.query_cycles = time_queries(&tree, queries, conf.epsilon, &hits);
+
+  start = rdtsc();
+  GeoHOCompact(&tree);
+  end = rdtsc();
+  stats.compact_cycles = (double)(end - start);
+
+  int compacted_hits = 0;
+  stats.compacted_query_cycles =
+      time_queries(&tree, queries, conf.epsilon, &compacted_hits);
+  if (hits != compacted_hits) {
+    std::cerr << "Error: queries found " << hits << " vertices before and " <<
+        compacted_hits << " after compaction." << std::endl;
+  }
+
+  GeoHODestroy(&tree);
+  return stats;
+}
+
+// All the vertices of the batches in one vertex array.
+static struct GeoVertexArray concatenate(
+    const std::vector<struct GeoVertexArray> &batches) {
+  struct GeoVertexArray all;
+  GeoVAInitialize(&all);
+  int n = 0;
+  for (const auto &batch : batches) n += batch.size;
+  GeoVAResize(&all, n);
+  int k = 0;
+  for (const auto &batch : batches) {
+    for (int i = 0; i < batch.size; ++i, ++k) {
+      all.x[k] = batch.x[i];
+      all.y[k] = batch.y[i];
+      all.z[k] = batch.z[i];
+      all.ptrs[k] = batch.ptrs[i];
+    }
+  }
+  return all;
+}
+
+// A sliding window that retires the oldest 5% of the vertices per frame,
+// compared to building a tree of the same size from scratch.
+static void run_window(const Configuration &conf,
+                       std::vector<struct GeoVertexArray> &batches,
+                       double *remove_cycles, double *rebuild_cycles) {
+  struct GeoHashedOctree tree;
+  GeoHOInitialize(&tree, UnitCube());
+  GeoHOSetInsertMode(&tree, GEO_INSERT_RUNS);
+  uintptr_t id = 0;
+  for (auto &batch : batches) {
+    for (int i = 0; i < batch.size; ++i) batch.ptrs[i] = (void*)id++;
+    GeoHOInsert(&tree, &batch);
+  }
+  uintptr_t oldest = 0;
+  uint64_t start = rdtsc();
+  for (int frame = 0; frame < conf.num_frames; ++frame) {
+    oldest += id / 20;
+    GeoHORemoveIf(&tree, is_older, &oldest);
+  }
+  uint64_t end = rdtsc();
+  *remove_cycles = (double)(end - start) / conf.num_frames;
+  GeoHODestroy(&tree);
+
+  struct GeoVertexArray all = concatenate(batches);
+  GeoHOInitialize(&tree, UnitCube());
+  start = rdtsc();
+  GeoHOInsert(&tree, &all);
+  end = rdtsc();
+  *rebuild_cycles = (double)(end - start);
+  GeoHODestroy(&tree);
+  GeoVADestroy(&all);
+}
+
+// Startup cost of mapping a saved tree compared to building it from the
+// vertices with a single insertion.
+static void run_snapshot(const std::vector<struct GeoVertexArray> &batches,
+                         double *build_cycles, double *map_cycles) {
+  const char *path = "streaming_insert_test.geoho";
+  struct GeoVertexArray all = concatenate(batches);
+  struct GeoHashedOctree tree;
+  GeoHOInitialize(&tree, UnitCube());
+  uint64_t start = rdtsc();
+  GeoHOInsert(&tree, &all);
+  uint64_t end = rdtsc();
+  *build_cycles = (double)(end - start);
+  GeoVADestroy(&all);
+  if (GeoHOSave(&tree, path) != 0) {
+    std::cerr << "Error: Could not save snapshot." << std::endl;
+  }
+  GeoHODestroy(&tree);
+
+  start = rdtsc();
+  int status = GeoHOMap(&tree, path);
+  end = rdtsc();
+  *map_cycles = (double)(end - start);
+  if (status != 0) {
+    std::cerr << "Error: Could not map snapshot." << std::endl;
+  } else {
+    GeoHODestroy(&tree);
+  }
+  std::remove(path);
+}
+
+struct AttachStats {
+  double insert_cycles;
+  double attach_cycles;
+  double update_cycles;
+  double query_cycles;
+  double attached_query_cycles;
+};
+
+// A tree over the caller's arrays compared to one that stores a copy: the
+// cost of building both, of updating the attached one after every vertex
+// moved a little and of queries.
+static AttachStats run_attached(const Configuration &conf,
+                                const std::vector<struct GeoVertexArray> &batches,
+                                const std::vector<struct GeoPoint> &queries) {
+  struct GeoVertexArray all = concatenate(batches);
+  AttachStats stats;
+  struct GeoHashedOctree stored, attached;
+  GeoHOInitialize(&stored, UnitCube());
+  uint64_t start = rdtsc();
+  GeoHOInsert(&stored, &all);
+  uint64_t end = rdtsc();
+  stats.insert_cycles = (double)(end - start);
+
+  GeoHOInitialize(&attached, UnitCube());
+  start = rdtsc();
+  GeoHOAttach(&attached, all.x, all.y, all.z, all.size);
+  end = rdtsc();
+  stats.attach_cycles = (double)(end - start);
+
+  int hits = 0, attached_hits = 0;
+  stats.query_cycles = time_queries(&stored, queries, conf.epsilon, &hits);
+  stats.attached_query_cycles =
+      time_queries(&attached, queries, conf.epsilon, &attached_hits);
+  if (hits != attached_hits) {
+    std::cerr << "Error: queries found " << hits << " stored and " <<
+        attached_hits << " attached vertices." << std::endl;
+  }
+
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<> step(-1.0e-4, 1.0e-4);
+  for (int i = 0; i < all.size; ++i) {
+    all.x[i] = std::min(1.0, std::max(0.0, all.x[i] + step(gen)));
+    all.y[i] = std::min(1.0, std::max(0.0, all.y[i] + step(gen)));
+    all.z[i] = std::min(1.0, std::max(0.0, all.z[i] + step(gen)));
+  }
+  start = rdtsc();
+  GeoHOUpdate(&attached);
+  end = rdtsc();
+  stats.update_cycles = (double)(end - start);
+
+  GeoHODestroy(&attached);
+  GeoHODestroy(&stored);
+  GeoVADestroy(&all);
+  return stats;
+}
+
+int main(int argn, char **argv) {
+  Configuration conf = parse_command_line(argn, argv);
+
+  struct GeoBoundingBox bbox = UnitCube();
+  std::vector<struct GeoVertexArray> batches(conf.num_batches);
+  std::vector<int> indices(conf.batch_size);
+  for (auto &batch : batches) {
+    GeoVAInitialize(&batch);
+    GeoVAResize(&batch, conf.batch_size);
+    FillWithRandomItems(&batch, &bbox, conf.batch_size, &indices[0]);
+  }
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  std::vector<struct GeoPoint> queries(conf.num_queries);
+  for (auto &p : queries) {
+    p = {dist(gen), dist(gen), dist(gen)};
+  }
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+
+  std::cout << "{\n";
+  std::cout << "  \"num_batches\": " << conf.num_batches << ",\n";
+  std::cout << "  \"batch_size\": " << conf.batch_size << ",\n";
+  std::cout << "  \"num_queries\": " << conf.num_queries << ",\n";
+  std::cout << "  \"epsilon\": " << conf.epsilon << ",\n";
+  std::cout << "  \"modes\": {\n";
+  const GeoInsertMode modes[] = {GEO_INSERT_MERGE, GEO_INSERT_RUNS};
+  const char *names[] = {"merge", "runs"};
+  for (int i = 0; i < 2; ++i) {
+    StreamStats stats = run_stream(modes[i], conf, batches, queries);
+    std::cout << "    \"" << names[i] << "\": {\n";
+    std::cout << "      \"insert_cycles_per_vertex\": " <<
+        stats.insert_cycles << ",\n";
+    std::cout << "      \"num_runs\":                 " <<
+        stats.num_runs << ",\n";
+    std::cout << "      \"query_cycles\":             " <<
+        stats.query_cycles << ",\n";
+    std::cout << "      \"compact_cycles\":           " <<
+        stats.compact_cycles << ",\n";
+    std::cout << "      \"compacted_query_cycles\":   " <<
+        stats.compacted_query_cycles << "\n";
+    std::cout << "    }" << (i == 0 ? "," : "") << "\n";
+  }
+  std::cout << "  },\n";
+  double remove_cycles, rebuild_cycles;
+  run_window(conf, batches, &remove_cycles, &rebuild_cycles);
+  std::cout << "  \"sliding_window\": {\n";
+  std::cout << "    \"num_frames\":           " << conf.num_frames << ",\n";
+  std::cout << "    \"remove_cycles_per_frame\": " << remove_cycles << ",\n";
+  std::cout << "    \"rebuild_cycles\":       " << rebuild_cycles << "\n";
+  std::cout << "  },\n";
+  double build_cycles, map_cycles;
+  run_snapshot(batches, &build_cycles, &map_cycles);
+  std::cout << "  \"snapshot\": {\n";
+  std::cout << "    \"build_cycles\": " << build_cycles << ",\n";
+  std::cout << "    \"map_cycles\":   " << map_cycles << "\n";
+  std::cout << "  },\n";
+  AttachStats attach = run_attached(conf, batches, queries);
+  std::cout << "  \"attached\": {\n";
+  std::cout << "    \"insert_cycles\":         " << attach.insert_cycles <<
+      ",\n";
+  std::cout << "    \"attach_cycles\":         " << attach.attach_cycles <<
+      ",\n";
+  std::cout << "    \"update_cycles\":         " << attach.update_cycles <<
+      ",\n";
+  std::cout << "    \"query_cycles\":          " << attach.query_cycles <<
+      ",\n";
+  std::cout << "    \"attached_query_cycles\": " <<
+      attach.attached_query_cycles << "\n";
+  std::cout << "  }\n";
+  std::cout << "}\n";
+
+  for (auto &batch : batches) {
+    GeoVADestroy(&batch);
+  }
+}
+
+static int find_string(std::string s, int argn, char **argv) {
+  int i = 1;
+  for (; i != argn; ++i) {
+    if (s == argv[i]) break;
+  }
+  return i;
+}
+
+static const std::string usage(
+    "Usage: streaming_insert_test "
+    "[--num_batches num_batches] "
+    "[--batch_size batch_size] "
+    "[--num_queries num_queries] "
+    "[--epsilon epsilon] "
+    "[--num_frames num_frames] "
+    );
+
+Configuration parse_command_line(int argn, char **argv) {
+  Configuration conf;
+  conf.num_batches = 200;
+  conf.batch_size = 10000;
+  conf.num_queries = 10000;
+  conf.epsilon = 1.0e-2;
+  conf.num_frames = 10;
+
+  int i;
+  i = find_string("--help", argn, argv);
+  if (i != argn) {
+    std::cout << usage << std::endl;
+    exit(0);
+  }
+
+  i = find_string("--num_batches", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of batches parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_batches = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--batch_size", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Batch size parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.batch_size = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_queries", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of queries parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_queries = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--epsilon", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: epsilon missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.epsilon = std::stod(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--num_frames", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: Number of frames parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.num_frames = std::stoi(std::string(argv[i + 1]));
+  }
+
+  return conf;
+}
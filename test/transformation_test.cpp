@@ -15,6 +15,8 @@ struct Configuration {
 struct TimingResults {
   double outofplace;
   double inplace;
+  double outofplace_float;
+  double inplace_float;
 };
 
 Configuration parse_command_line(int argn, char **argv);
@@ -24,10 +26,15 @@ struct GeoVertexArray build_va(int n);
 int main(int argn, char **argv) {
   Configuration conf = parse_command_line(argn, argv);
 
-  TimingResults results = {0, 0};
+  TimingResults results = {0, 0, 0, 0};
 
   struct GeoVertexArray a = build_va(conf.num_vertices);
   struct GeoVertexArray b = build_va(conf.num_vertices);
+  std::vector<float> fa[3], fb[3];
+  for (int k = 0; k < 3; ++k) {
+    fa[k].assign(conf.num_vertices, 6.0f + k);
+    fb[k].assign(conf.num_vertices, 6.0f + k);
+  }
   double T[3][4] = {
     {1, 2, 3, 4},
     {5, 6, 7, 8},
@@ -55,20 +62,44 @@ int main(int argn, char **argv) {
     start = rdtsc();
     GeoApplyTransformInplace(T, &a);
     end = rdtsc();
-    std::cout << "      \"in-place\":     " << (end - start) / 1.0e6 << "\n";
+    std::cout << "      \"in-place\":     " << (end - start) / 1.0e6 << ",\n";
     results.inplace += (end - start) / 1.0e6;
 
+    start = rdtsc();
+    GeoApplyTransformFloat(T, fa[0].data(), fa[1].data(), fa[2].data(),
+                           fb[0].data(), fb[1].data(), fb[2].data(),
+                           conf.num_vertices);
+    end = rdtsc();
+    std::cout << "      \"out-of-place-float\": " << (end - start) / 1.0e6 <<
+        ",\n";
+    results.outofplace_float += (end - start) / 1.0e6;
+
+    start = rdtsc();
+    GeoApplyTransformFloatInplace(T, fa[0].data(), fa[1].data(),
+                                  fa[2].data(), conf.num_vertices);
+    end = rdtsc();
+    std::cout << "      \"in-place-float\":     " << (end - start) / 1.0e6 <<
+        "\n";
+    results.inplace_float += (end - start) / 1.0e6;
+
     std::cout << "    }\n  }," << std::endl;
   }
 
   std::cout << "  \"totals\": {\n";
   std::cout << "    \"out-of-place\":   " << results.outofplace << ",\n";
-  std::cout << "    \"in-place\":       " << results.inplace << "\n";
+  std::cout << "    \"in-place\":       " << results.inplace << ",\n";
+  std::cout << "    \"out-of-place-float\": " << results.outofplace_float <<
+      ",\n";
+  std::cout << "    \"in-place-float\":     " << results.inplace_float << "\n";
   std::cout << "  },\n";
 
   std::cout << "  \"averages\": {\n";
   std::cout << "    \"out-of-place\":   " << results.outofplace / conf.num_iter << ",\n";
   std::cout << "    \"in-place\":       " << results.inplace / conf.num_iter << ",\n";
+  std::cout << "    \"out-of-place-float\": " <<
+      results.outofplace_float / conf.num_iter << ",\n";
+  std::cout << "    \"in-place-float\":     " <<
+      results.inplace_float / conf.num_iter << ",\n";
   std::cout << "  }\n";
   std::cout << "}\n";
 
@@ -1,4 +1,5 @@
 #include <hashed_octree.h>
+#include <qsort.h>
 #include <test_utilities.h>
 #include <string>
 #include <iostream>
@@ -11,6 +12,7 @@ struct Configuration {
   int num_vertices;
   int num_iter;
   double epsilon;
+  int depth;
 };
 
 struct TimingResults {
@@ -18,18 +20,24 @@ struct TimingResults {
   double VertexDedup1;
   double BuildTreeFromOrderedItems;
   double VertexDedup2;
+  double VertexDedupGrid;
+  double SortQsortPairs;
+  double SortRadixPairs;
 };
 
 Configuration parse_command_line(int argn, char **argv);
-struct GeoHashedOctree BuildTreeWithRandomItems(struct GeoBoundingBox bbox, int n, int *indices);
+struct GeoHashedOctree BuildTreeWithRandomItems(struct GeoBoundingBox bbox,
+    int depth, int n, int *indices);
 struct GeoHashedOctree BuildTreeFromOrderedItems(
-    struct GeoBoundingBox bbox, const struct GeoVertexArray *va);
+    struct GeoBoundingBox bbox, int depth, const struct GeoVertexArray *va);
+void ComputeRandomHashes(struct GeoBoundingBox bbox, int depth, int n,
+    std::vector<uint64_t> *keys, std::vector<uint32_t> *tags);
 
 
 int main(int argn, char **argv) {
   Configuration conf = parse_command_line(argn, argv);
 
-  TimingResults results = {0, 0, 0, 0};
+  TimingResults results = {0, 0, 0, 0, 0, 0, 0};
 
   std::cout.precision(5);
   std::cout << std::scientific;
@@ -38,6 +46,7 @@ int main(int argn, char **argv) {
   std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
   std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
   std::cout << "  \"epsilon\": " << conf.epsilon << ",\n";
+  std::cout << "  \"depth\": " << conf.depth << ",\n";
   for (int i = 0; i < conf.num_iter; ++i) {
 
     std::cout << "  \"iteration " << i << "\": {\n";
@@ -48,7 +57,8 @@ int main(int argn, char **argv) {
     std::vector<int> indices(conf.num_vertices);
     start = rdtsc();
     struct GeoHashedOctree tree =
-        BuildTreeWithRandomItems(UnitCube(), conf.num_vertices, &indices[0]);
+        BuildTreeWithRandomItems(UnitCube(), conf.depth, conf.num_vertices,
+                                 &indices[0]);
     end = rdtsc();
     std::cout << "      \"ConstructTreeWithRandomItems\": " << (end - start) / 1.0e6 << ",\n";
     results.ConstructTreeWithRandomItems += (end - start) / 1.0e6;
@@ -61,7 +71,7 @@ int main(int argn, char **argv) {
 
     start = rdtsc();
     struct GeoHashedOctree tree2 =
-        BuildTreeFromOrderedItems(UnitCube(), &tree.vertices);
+        BuildTreeFromOrderedItems(UnitCube(), conf.depth, &tree.vertices);
     end = rdtsc();
     std::cout << "      \"BuildTreeFromOrderedItems\":    " << (end - start) / 1.0e6 << ",\n";
     results.BuildTreeFromOrderedItems += (end - start) / 1.0e6;
@@ -69,9 +79,41 @@ int main(int argn, char **argv) {
     start = rdtsc();
     GeoHODeleteDuplicates(&tree2, conf.epsilon, 0, 0);
     end = rdtsc();
-    std::cout << "      \"VertexDedup2\":                 " << (end - start) / 1.0e6 << "\n";
+    std::cout << "      \"VertexDedup2\":                 " << (end - start) / 1.0e6 << ",\n";
     results.VertexDedup2 += (end - start) / 1.0e6;
 
+    struct GeoHashedOctree tree3 =
+        BuildTreeWithRandomItems(UnitCube(), conf.depth, conf.num_vertices,
+                                 &indices[0]);
+    start = rdtsc();
+    GeoHODeleteDuplicatesWithMode(&tree3, conf.epsilon, GEO_DEDUP_GRID, 0, 0);
+    end = rdtsc();
+    std::cout << "      \"VertexDedupGrid\":              " << (end - start) / 1.0e6 << ",\n";
+    results.VertexDedupGrid += (end - start) / 1.0e6;
+    GeoHODestroy(&tree3);
+
+    // The sort inside of GeoHOInsert with the comparison based sort and
+    // with the radix sort that replaced it.
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> tags;
+    ComputeRandomHashes(UnitCube(), conf.depth, conf.num_vertices, &keys,
+                        &tags);
+    std::vector<uint64_t> keys2(keys);
+    std::vector<uint32_t> tags2(tags);
+    start = rdtsc();
+    GeoQsortPairs(keys.data(), tags.data(), conf.num_vertices);
+    end = rdtsc();
+    std::cout << "      \"SortQsortPairs\":               " << (end - start) / 1.0e6 << ",\n";
+    results.SortQsortPairs += (end - start) / 1.0e6;
+
+    start = rdtsc();
+    GeoRadixSortPairs(keys2.data(), tags2.data(), conf.num_vertices,
+                      3 * conf.depth);
+    end = rdtsc();
+    std::cout << "      \"SortRadixPairs\":               " << (end - start) / 1.0e6 << "\n";
+    results.SortRadixPairs += (end - start) / 1.0e6;
+    assert(keys == keys2 && tags == tags2);
+
     std::cout << "    }\n  }," << std::endl;
 
     GeoHODestroy(&tree2);
@@ -82,20 +124,27 @@ int main(int argn, char **argv) {
   std::cout << "    \"ConstructTreeWithRandomItems\":   " << results.ConstructTreeWithRandomItems << ",\n";
   std::cout << "    \"VertexDedup1\":                   " << results.VertexDedup1 << ",\n";
   std::cout << "    \"BuildTreeFromOrderedItems\":      " << results.BuildTreeFromOrderedItems << ",\n";
-  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 << "\n";
+  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 << ",\n";
+  std::cout << "    \"VertexDedupGrid\":                " << results.VertexDedupGrid << ",\n";
+  std::cout << "    \"SortQsortPairs\":                 " << results.SortQsortPairs << ",\n";
+  std::cout << "    \"SortRadixPairs\":                 " << results.SortRadixPairs << "\n";
   std::cout << "  },\n";
 
   std::cout << "  \"averages\": {\n";
   std::cout << "    \"ConstructTreeWithRandomItems\":   " << results.ConstructTreeWithRandomItems / conf.num_iter << ",\n";
   std::cout << "    \"VertexDedup1\":                   " << results.VertexDedup1 / conf.num_iter << ",\n";
   std::cout << "    \"BuildTreeFromOrderedItems\":      " << results.BuildTreeFromOrderedItems / conf.num_iter << ",\n";
-  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 / conf.num_iter << "\n";
-  std::cout << "  }\n";
+  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 / conf.num_iter << ",\n";
+  std::cout << "    \"VertexDedupGrid\":                " << results.VertexDedupGrid / conf.num_iter << ",\n";
+  std::cout << "    \"SortQsortPairs\":                 " << results.SortQsortPairs / conf.num_iter << ",\n";
+  std::cout << "    \"SortRadixPairs\":                 " << results.SortRadixPairs / conf.num_iter << "\n";
+  std::cout << "  },\n";
+  std::cout << "  \"RadixSortSpeedup\": " << results.SortQsortPairs / results.SortRadixPairs << "\n";
   std::cout << "}\n";
 }
 
 struct GeoHashedOctree BuildTreeWithRandomItems(
-    struct GeoBoundingBox bbox, int n, int *indices) {
+    struct GeoBoundingBox bbox, int depth, int n, int *indices) {
   assert(n > 0);
   struct GeoVertexArray va;
   GeoVAInitialize(&va);
@@ -103,7 +152,7 @@ struct GeoHashedOctree BuildTreeWithRandomItems(
   FillWithRandomItems(&va, &bbox, n, indices);
 
   struct GeoHashedOctree tree;
-  GeoHOInitialize(&tree, bbox);
+  GeoHOInitializeWithDepth(&tree, bbox, depth);
   GeoHOInsert(&tree, &va);
 
   GeoVADestroy(&va);
@@ -112,14 +161,30 @@ struct GeoHashedOctree BuildTreeWithRandomItems(
 }
 
 struct GeoHashedOctree BuildTreeFromOrderedItems(
-    struct GeoBoundingBox bbox,
+    struct GeoBoundingBox bbox, int depth,
     const struct GeoVertexArray *va) {
   struct GeoHashedOctree tree;
-  GeoHOInitialize(&tree, bbox);
+  GeoHOInitializeWithDepth(&tree, bbox, depth);
   GeoHOInsert(&tree, va);
   return tree;
 }
 
+void ComputeRandomHashes(struct GeoBoundingBox bbox, int depth, int n,
+    std::vector<uint64_t> *keys, std::vector<uint32_t> *tags) {
+  struct GeoVertexArray va;
+  GeoVAInitialize(&va);
+  GeoVAResize(&va, n);
+  std::vector<int> indices(n);
+  FillWithRandomItems(&va, &bbox, n, &indices[0]);
+  keys->resize(n);
+  tags->resize(n);
+  GeoComputeHashes64(&bbox, &va, keys->data());
+  for (int i = 0; i < n; ++i) {
+    (*keys)[i] >>= 3 * (GeoNodeMaxDepth64() - depth);
+    (*tags)[i] = i;
+  }
+  GeoVADestroy(&va);
+}
 
 static int find_string(std::string s, int argn, char **argv) {
   int i = 1;
@@ -134,6 +199,7 @@ static const std::string usage(
     "[--num_vertices num_vertices] "
     "[--num_iter num_iter] "
     "[--epsilon epsilon] "
+    "[--depth depth] "
     );
 
 Configuration parse_command_line(int argn, char **argv) {
@@ -141,6 +207,7 @@ Configuration parse_command_line(int argn, char **argv) {
   conf.num_vertices = 100;
   conf.num_iter = 10;
   conf.epsilon = 1.0e-3;
+  conf.depth = GeoNodeMaxDepth();
 
   int i;
   i = find_string("--help", argn, argv);
@@ -179,6 +246,16 @@ Configuration parse_command_line(int argn, char **argv) {
     conf.epsilon = std::stod(std::string(argv[i + 1]));
   }
 
+  i = find_string("--depth", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: depth missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.depth = std::stoi(std::string(argv[i + 1]));
+  }
+
   return conf;
 }
 